@@ -7,7 +7,44 @@
 #include <cstdlib>
 #include <fstream>
 #include <sstream>
+#include <map>
+#include <memory>
+#include <optional>
 #include "hbv_model.hpp"
+#include "hbv_io.hpp"
+#include "hbv_cache.hpp"
+#include "hbv_incremental.hpp"
+#include "hbv_checkpoint.hpp"
+#include "hbv_ensemble.hpp"
+#include "hbv_profile.hpp"
+#include "hbv_calibrate.hpp"
+#include "hbv_sampler.hpp"
+#include "hbv_sensitivity.hpp"
+#include "hbv_pipeline.hpp"
+#include "hbv_stream.hpp"
+#include "hbv_precision.hpp"
+#include "hbv_server.hpp"
+#include "hbv_windows.hpp"
+#include "hbv_glue.hpp"
+/**
+ * @brief This function will build HBV model in Real precision, write result file and print NSE.
+ * @param forcing Q, P and T from data file or its cache file
+ * @param parameters parameters vector
+ * @param output_path output path
+ */
+template <typename Real>
+void buildHBV(const hbv_forcing &forcing, const std::vector<double> &parameters, const std::string &output_path) {
+    hbv_model_t<Real> hbv_model(forcing.getQ(), forcing.getP(), forcing.getT(), parameters);
+    std::cout << "HBV model build successful!" <<"\n";
+    try {
+        writeResult(output_path, hbv_model);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << '\n';
+        exit(-1);
+    }
+    std::cout <<"Data file generated as "<< output_path <<"\n\n";
+    hbv_model.getNSE_AD();
+}
 /**
  * @brief This function will run HBV model based on given file path.
  * It will read csv file from line2(since there some header exist), 
@@ -15,180 +52,704 @@
  * @param data_file The path of data file(csv file or same format)
  * @param parameters_file The path of parameter file (txt or similar format)
  * @param output_path output path
+ * @param precision "double" or "float", the scalar type of model
  */
-void runHBV(std::string data_file, std::string parameters_file, std::string output_path) {
-    std::ifstream input1(data_file);  // declare ifstream to process data file
-    std::ifstream input2(parameters_file);  // declare ifstream to process parameters file
-    std::ofstream output(output_path);   // declare ofstream to process output file
-    if (!input1.is_open()) {
-        std::cerr << "Can't Open " << data_file <<"\n";
+void runHBV(std::string data_file, std::string parameters_file, std::string output_path,
+    std::string precision = "double") {
+    hbv_columns columns;  // columns store the column position of T, P and Q from parameter file
+    std::vector<double> parameters;  // parameters are used to store the parameters information
+    hbv_forcing forcing;  // forcing stores Q, P and T from data file or its cache file.
+    try {
+        readParameters(parameters_file, parameters, columns);
+        forcing = loadForcing(data_file, columns);
+        printDataReport(forcing.getReport());
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << '\n';
         exit(-1);
     }
-    if (!input2.is_open()) {
-        std::cerr << "Can't Open " << parameters_file <<"\n";
-        exit(-1);
+    if (precision == "float") {
+        buildHBV<float>(forcing, parameters, output_path);
+    } else {
+        buildHBV<double>(forcing, parameters, output_path);
+    }
+}
+/**
+ * @brief This function will read options as "--name value" pairs from arguments.
+ * @param argc number of arguments from main function
+ * @param argv arguments from main function
+ * @param first position of first option
+ * @return std::map<std::string, std::string> value of each option
+ * @throw std::invalid_argument if an option has no value
+ */
+std::map<std::string, std::string> readOptions(int argc, char *argv[], int first) {
+    std::map<std::string, std::string> options;
+    for (int i = first; i < argc; i += 2) {
+        std::string option = argv[i];
+        if (option.rfind("--", 0) != 0 || i + 1 >= argc) {
+            throw std::invalid_argument("Option " + option + " needs a value");
+        }
+        options[option] = argv[i + 1];
     }
-    if (!output.is_open()) {
-        std::cerr << "Can't Open " << output_path <<"\n";
+    return options;
+}
+/**
+ * @brief This function will run HBV model chunk by chunk from data file to output file, so memory does
+ * not depend on the length of data file. The output file is the same as runHBV().
+ * Usage: hbv stream data_file parameters_file output_path [--chunk N] [--block N]
+ * @param argc number of arguments from main function
+ * @param argv arguments from main function
+ */
+void runStream(int argc, char *argv[]) {
+    if (argc < 5) {
+        std::cout <<"Argument number is incorrect! Please use --help for more information" <<"\n";
+        std::cout << "Usage: hbv --help" << "\n";
+        return;
+    }
+    std::string data_file = argv[2];
+    std::string parameters_file = argv[3];
+    std::string output_path = argv[4];
+    hbv_stream_options options;
+    hbv_columns columns;
+    std::vector<double> parameters;
+    try {
+        for (const auto &[option, value] : readOptions(argc, argv, 5)) {
+            if (option == "--chunk") {
+                options.chunk = std::stoull(value);
+            } else if (option == "--block") {
+                options.block = std::stoull(value);
+            } else {
+                throw std::invalid_argument("Unknown option " + option);
+            }
+        }
+        readParameters(parameters_file, parameters, columns);
+        hbv_stream_result result = streamHBV(data_file, columns, parameters, output_path, options);
+        printDataReport(result.report);
+        std::cout << "HBV model finished " << result.report.records << " days in " << result.chunks << " chunks!"
+            << "\n";
+        std::cout <<"Data file generated as "<< output_path <<"\n\n";
+        printMetrics(result.metrics);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << '\n';
         exit(-1);
     }
-    int64_t t = 0;  // t is a indicator to record the lines of file.
-    int64_t z = 0;  // z is a indicator to record the columns of data file
-    int64_t p_Q = -1;  // p_Q is getting from parameter file and store the column numbers of Q
-    int64_t p_T = -1;  // p_T is getting from parameter file and store the column numbers of T
-    int64_t p_P = -1;  // p_P is getting from parameter file and store the column numbers of P
-    std::string temp;  // temp is used to get string from file as one sentence
-    std::string temp1;  // temp1 are used to get string from file as one cell
-    std::vector<double> parameters;  // parameters are used to store the parameters information
-    std::vector<double> Q;  // Q are used to store Q information from data file.
-    std::vector<double> T;  // T are used to store T information from data file.
-    std::vector<double> P;  // P are used to store P information from data file.
-    double temp3;  // temp3 are used to store the value convert from string to double
-    while (std::getline(input2, temp)) {
-        if (t <= 15) {
-            try {
-                parameters.push_back(std::stod(temp));
-                } catch(const std::exception& e) {
-                    std::cerr << "Parameters contained non-double value" << '\n';
-                    std::cerr << e.what() << '\n';
-                }
-        } else {
-            try {
-                if (t == 16) {
-                    p_T = static_cast<int64_t>(std::stoi(temp));
-                } else if (t == 17) {
-                    p_P = static_cast<int64_t>(std::stoi(temp));
-                } else if (t == 18) {
-                    p_Q = static_cast<int64_t>(std::stoi(temp));
-                }
-            } catch(const std::exception& e) {
-                std::cerr << "Parameters contained non-integer value" << '\n';
-                std::cerr << e.what() << '\n';
+}
+/**
+ * @brief This function will run automatic calibration of the first 11 parameters and write
+ * the best parameters to a new parameters file.
+ * Usage: hbv calibrate data_file parameters_file output_parameters_file [options]
+ * @param argc number of arguments from main function
+ * @param argv arguments from main function
+ */
+void runCalibrate(int argc, char *argv[]) {
+    if (argc < 5) {
+        std::cout <<"Argument number is incorrect! Please use --help for more information" <<"\n";
+        std::cout << "Usage: hbv --help" << "\n";
+        return;
+    }
+    std::string data_file = argv[2];
+    std::string parameters_file = argv[3];
+    std::string output_path = argv[4];
+    std::string log_path = "convergence.csv";  // log_path is where the log of each loop is written
+    std::string memo_path;  // memo_path is the memo file of objective values, if given
+    hbv_calibration_options options;
+    hbv_columns columns;
+    std::vector<double> parameters;
+    try {
+        for (const auto &[option, value] : readOptions(argc, argv, 5)) {
+            if (option == "--method") {
+                options.method = value;
+            } else if (option == "--objective") {
+                options.objective = value;
+            } else if (option == "--evaluations") {
+                options.evaluations = std::stoull(value);
+            } else if (option == "--complexes") {
+                options.complexes = std::stoull(value);
+            } else if (option == "--starts") {
+                options.starts = std::stoull(value);
+            } else if (option == "--smoothing") {
+                options.smoothing = std::stod(value);
+            } else if (option == "--seed") {
+                options.seed = std::stoull(value);
+            } else if (option == "--threads") {
+                options.threads = std::stoull(value);
+            } else if (option == "--log") {
+                log_path = value;
+            } else if (option == "--memo") {
+                memo_path = value;
+            } else {
+                throw std::invalid_argument("Unknown option " + option);
             }
         }
-        t++;
+        readParameters(parameters_file, parameters, columns);
+        hbv_forcing forcing = loadForcing(data_file, columns);
+        printDataReport(forcing.getReport());
+        std::span<const double> Q = forcing.getQ(), P = forcing.getP(), T = forcing.getT();
+        std::unique_ptr<hbv_memo> memo;
+        if (!memo_path.empty()) {
+            memo = std::make_unique<hbv_memo>(memo_path, Q, P, T, findMetric(options.objective).name);
+            options.memo = memo.get();
+        }
+        hbv_calibrator calibrator(Q, P, T, parameters, options);
+        std::vector<double> best = calibrator.run();
+        writeParameters(output_path, best, columns);
+        calibrator.writeLog(log_path);
+        std::cout << "Calibration finished after " << calibrator.getEvaluations() << " model runs!" << "\n";
+        if (memo) {
+            std::cout << memo->getHits() << " of them are found in memo file " << memo_path << "\n";
+        }
+        std::cout << "Parameters file generated as " << output_path << "\n";
+        std::cout << "Convergence log generated as " << log_path << "\n\n";
+        hbv_model hbv_model(Q, P, T, best);
+        hbv_model.getNSE_AD();
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << '\n';
+        exit(-1);
     }
-    input2.close();
-    if (t < 18) {
-        std::cout << "Format is incorrect for " << parameters_file <<"\n";
+}
+/**
+ * @brief This function will run HBV model with many sampled parameters sets and write parameters
+ * and NSE of each set to output file.
+ * Usage: hbv sample data_file parameters_file output_file [options]
+ * @param argc number of arguments from main function
+ * @param argv arguments from main function
+ * @param precision "double" or "float", the scalar type of model
+ */
+void runSample(int argc, char *argv[], const std::string &precision) {
+    if (argc < 5) {
+        std::cout <<"Argument number is incorrect! Please use --help for more information" <<"\n";
+        std::cout << "Usage: hbv --help" << "\n";
+        return;
+    }
+    std::string data_file = argv[2];
+    std::string parameters_file = argv[3];
+    std::string output_path = argv[4];
+    hbv_sampling_options options;
+    options.precision = precision;
+    std::string memo_path;  // memo_path is the memo file of NSE, if given
+    hbv_columns columns;
+    std::vector<double> parameters;
+    try {
+        for (const auto &[option, value] : readOptions(argc, argv, 5)) {
+            if (option == "--method") {
+                options.method = value;
+            } else if (option == "--samples") {
+                options.samples = std::stoull(value);
+            } else if (option == "--seed") {
+                options.seed = std::stoull(value);
+            } else if (option == "--threads") {
+                options.threads = std::stoull(value);
+            } else if (option == "--format") {
+                options.format = value;
+            } else if (option == "--memo") {
+                memo_path = value;
+            } else {
+                throw std::invalid_argument("Unknown option " + option);
+            }
+        }
+        readParameters(parameters_file, parameters, columns);
+        hbv_forcing forcing = loadForcing(data_file, columns);
+        printDataReport(forcing.getReport());
+        std::span<const double> Q = forcing.getQ(), P = forcing.getP(), T = forcing.getT();
+        std::unique_ptr<hbv_memo> memo;
+        if (!memo_path.empty()) {
+            memo = std::make_unique<hbv_memo>(memo_path, Q, P, T, "NSE " + options.precision);
+            options.memo = memo.get();
+        }
+        uint64_t best = sampleParameters(Q, P, T, parameters, options, output_path);
+        std::cout << "Sampling finished with " << options.samples << " model runs!" << "\n";
+        if (memo) {
+            std::cout << memo->getHits() << " of them are found in memo file " << memo_path << "\n";
+        }
+        std::cout << "Data file generated as " << output_path << "\n";
+        if (options.samples > 0) {
+            hbv_sampler sampler(options.method, options.samples, options.seed);
+            hbv_model hbv_model(Q, P, T, sampler.parameters(best, parameters));
+            std::cout << "The best sample is " << best << "\n\n";
+            hbv_model.getNSE_AD();
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << '\n';
         exit(-1);
-    } else if (p_T == p_Q || p_T == p_P || p_P == p_Q) {
-        std::cout << "Column position should not be same!" <<"\n";
+    }
+}
+/**
+ * @brief This function will run HBV model once and print NSE and other metrics of each window (for example
+ * calibration and validation years or months of snow melt).
+ * Usage: hbv windows data_file parameters_file --windows "name=range@months;..." [--start YYYY-MM-DD]
+ * [--output path]
+ * @param argc number of arguments from main function
+ * @param argv arguments from main function
+ */
+void runWindows(int argc, char *argv[]) {
+    if (argc < 4) {
+        std::cout <<"Argument number is incorrect! Please use --help for more information" <<"\n";
+        std::cout << "Usage: hbv --help" << "\n";
+        return;
+    }
+    std::string data_file = argv[2];
+    std::string parameters_file = argv[3];
+    std::string text, output_path;  // text is the windows split by ';'
+    std::optional<int64_t> start;  // start is the date of the first record, if given
+    hbv_columns columns;
+    std::vector<double> parameters;
+    try {
+        for (const auto &[option, value] : readOptions(argc, argv, 4)) {
+            if (option == "--windows") {
+                text = value;
+            } else if (option == "--start") {
+                start = hbv_parse_date(value);
+            } else if (option == "--output") {
+                output_path = value;
+            } else {
+                throw std::invalid_argument("Unknown option " + option);
+            }
+        }
+        std::vector<hbv_window> windows = parseWindows(text, start);
+        readParameters(parameters_file, parameters, columns);
+        hbv_forcing forcing = loadForcing(data_file, columns);
+        printDataReport(forcing.getReport());
+        hbv_parameters p = hbv_parameters::fromVector(parameters);
+        try {
+            p.checkRange();
+        } catch (const std::domain_error& e) {
+            std::cerr << e.what() << '\n';
+            std::cerr << "The vale out of range is set to the lower bound value" << '\n';
+        }
+        std::vector<hbv_metrics> metrics = evaluateWindows(p, forcing.getQ(), forcing.getP(), forcing.getT(),
+            windows, start);
+        printWindows(std::cout, windows, metrics);
+        if (!output_path.empty()) {
+            writeWindows(output_path, windows, metrics);
+            std::cout << "Data file generated as " << output_path << "\n";
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << '\n';
         exit(-1);
-    } else if (p_T == -1 || p_P == -1 || p_Q == -1) {
-        std::cout << "Column position is not initialized!" <<"\n";
+    }
+}
+/**
+ * @brief This function will run HBV model in double and in float and print how far float is from double.
+ * Usage: hbv precision data_file parameters_file [--samples N] [--seed N] [--threads N]
+ * @param argc number of arguments from main function
+ * @param argv arguments from main function
+ */
+void runPrecision(int argc, char *argv[]) {
+    if (argc < 4) {
+        std::cout <<"Argument number is incorrect! Please use --help for more information" <<"\n";
+        std::cout << "Usage: hbv --help" << "\n";
+        return;
+    }
+    std::string data_file = argv[2];
+    std::string parameters_file = argv[3];
+    hbv_precision_options options;
+    hbv_columns columns;
+    std::vector<double> parameters;
+    try {
+        for (const auto &[option, value] : readOptions(argc, argv, 4)) {
+            if (option == "--samples") {
+                options.samples = std::stoull(value);
+            } else if (option == "--seed") {
+                options.seed = std::stoull(value);
+            } else if (option == "--threads") {
+                options.threads = std::stoull(value);
+            } else {
+                throw std::invalid_argument("Unknown option " + option);
+            }
+        }
+        readParameters(parameters_file, parameters, columns);
+        hbv_forcing forcing = loadForcing(data_file, columns);
+        printDataReport(forcing.getReport());
+        hbv_precision_report report = comparePrecision(forcing.getQ(), forcing.getP(), forcing.getT(),
+            parameters, options);
+        printPrecision(std::cout, report);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << '\n';
         exit(-1);
     }
-    t = 0;
-    while (std::getline(input1, temp)) {
-        std::istringstream temp2(temp);
-        // temp2 are used to store stringstream based on each lien string value from data file
-        z = 0;
-        try {
-            while (std::getline(temp2, temp1, ',')) {
-                z++;
-                if (t != 0) {
-                    if ((z-1) == (p_P-1)) {
-                        temp3 = std::stod(temp1);
-                        P.push_back(temp3);
-                    } else if ((z-1) == (p_T-1)) {
-                        temp3 = std::stod(temp1);
-                        T.push_back(temp3);
-                    } else if ((z-1) == (p_Q-1)) {
-                        temp3 = std::stod(temp1);
-                        Q.push_back(temp3);
-                    }
-                }
+}
+/**
+ * @brief This function will calculate first-order and total-order Sobol indices of the first 11 parameters
+ * and write them to output file.
+ * Usage: hbv sensitivity data_file parameters_file output_file [options]
+ * @param argc number of arguments from main function
+ * @param argv arguments from main function
+ */
+void runSensitivity(int argc, char *argv[]) {
+    if (argc < 5) {
+        std::cout <<"Argument number is incorrect! Please use --help for more information" <<"\n";
+        std::cout << "Usage: hbv --help" << "\n";
+        return;
+    }
+    std::string data_file = argv[2];
+    std::string parameters_file = argv[3];
+    std::string output_path = argv[4];
+    hbv_sensitivity_options options;
+    hbv_columns columns;
+    std::vector<double> parameters;
+    try {
+        for (const auto &[option, value] : readOptions(argc, argv, 5)) {
+            if (option == "--method") {
+                options.method = value;
+            } else if (option == "--samples") {
+                options.samples = std::stoull(value);
+            } else if (option == "--bootstrap") {
+                options.bootstrap = std::stoull(value);
+            } else if (option == "--confidence") {
+                options.confidence = std::stod(value);
+            } else if (option == "--objective") {
+                options.objective = value;
+            } else if (option == "--seed") {
+                options.seed = std::stoull(value);
+            } else if (option == "--threads") {
+                options.threads = std::stoull(value);
+            } else {
+                throw std::invalid_argument("Unknown option " + option);
             }
-            } catch(const std::invalid_argument& e) {
-                std::cerr << "Data value contained non-double value" << '\n';
-                std::cerr << "This record will skip but complete will continue" << '\n';
-                std::cerr << e.what() << '\n';
-                uint64_t pos_min = std::min(std::min(Q.size(), P.size()), T.size());
-                if (T.size() != pos_min) {
-                    T.pop_back();
-                }
-                if (P.size() != pos_min) {
-                    P.pop_back();
-                }
-                if (Q.size() != pos_min) {
-                    Q.pop_back();
+        }
+        readParameters(parameters_file, parameters, columns);
+        hbv_forcing forcing = loadForcing(data_file, columns);
+        printDataReport(forcing.getReport());
+        hbv_sensitivity_result result = analyzeSensitivity(forcing.getQ(), forcing.getP(), forcing.getT(),
+            parameters, options);
+        printSensitivity(std::cout, result);
+        writeSensitivity(output_path, result);
+        std::cout << "\nSensitivity analysis finished with " << result.evaluations << " model runs!" << "\n";
+        if (result.skipped > 0) {
+            std::cout << result.skipped << " samples with NaN or infinite " << options.objective << " are not used" << "\n";
+        }
+        std::cout << "Data file generated as " << output_path << "\n";
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << '\n';
+        exit(-1);
+    }
+}
+/**
+ * @brief This function will run GLUE uncertainty analysis with sampled parameters sets and write the
+ * weighted quantiles of runoff of behavioral sets for each day.
+ * Usage: hbv glue data_file parameters_file output_file [options]
+ * @param argc number of arguments from main function
+ * @param argv arguments from main function
+ */
+void runGLUE(int argc, char *argv[]) {
+    if (argc < 5) {
+        std::cout <<"Argument number is incorrect! Please use --help for more information" <<"\n";
+        std::cout << "Usage: hbv --help" << "\n";
+        return;
+    }
+    std::string data_file = argv[2];
+    std::string parameters_file = argv[3];
+    std::string output_path = argv[4];
+    hbv_glue_options options;
+    hbv_columns columns;
+    std::vector<double> parameters;
+    try {
+        for (const auto &[option, value] : readOptions(argc, argv, 5)) {
+            if (option == "--method") {
+                options.method = value;
+            } else if (option == "--samples") {
+                options.samples = std::stoull(value);
+            } else if (option == "--threshold") {
+                options.threshold = std::stod(value);
+            } else if (option == "--quantiles") {
+                options.quantiles.clear();
+                std::istringstream cells(value);
+                for (std::string cell; std::getline(cells, cell, ',');) {
+                    options.quantiles.push_back(std::stod(cell));
                 }
-            } catch (const std::exception& e) {
-                std::cerr << "Something wrong with the program:" << '\n';
-            }
-        try {
-            if (Q.size() != P.size() || Q.size() != T.size() ||T.size() != P.size()) {
-                throw std::domain_error("Detect missing value");
+            } else if (option == "--compression") {
+                options.compression = std::stod(value);
+            } else if (option == "--seed") {
+                options.seed = std::stoull(value);
+            } else if (option == "--threads") {
+                options.threads = std::stoull(value);
+            } else {
+                throw std::invalid_argument("Unknown option " + option);
             }
-        } catch (const std::domain_error& e) {
-            std::cerr << e.what() << '\n';
-            std::cerr << "This record will skip but complete will continue" << '\n';
-            uint64_t pos_min = std::min(std::min(Q.size(), P.size()), T.size());
-            // pos_min use to locate the line with error and pop_up other variable to skip this line.
-            if (T.size() != pos_min) {
-                T.pop_back();
+        }
+        readParameters(parameters_file, parameters, columns);
+        hbv_forcing forcing = loadForcing(data_file, columns);
+        printDataReport(forcing.getReport());
+        hbv_glue_result result = analyzeGLUE(forcing.getQ(), forcing.getP(), forcing.getT(), parameters, options,
+            output_path);
+        printGLUE(std::cout, result, options);
+        std::cout << "Data file generated as " << output_path << "\n";
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << '\n';
+        exit(-1);
+    }
+}
+/**
+ * @brief This function will run HBV model for many basins given by a manifest file or a pattern
+ * of data files, and print NSE of each basin.
+ * Usage: hbv batch manifest_file [options]
+ * Usage: hbv batch --glob pattern --parameters parameters_file --output-dir folder [options]
+ * @param argc number of arguments from main function
+ * @param argv arguments from main function
+ */
+void runBatch(int argc, char *argv[]) {
+    if (argc < 3) {
+        std::cout <<"Argument number is incorrect! Please use --help for more information" <<"\n";
+        std::cout << "Usage: hbv --help" << "\n";
+        return;
+    }
+    std::string manifest_file;  // manifest_file is empty when pattern of data files is used
+    std::string pattern, parameters_file, output_dir = ".", summary_path;
+    hbv_pipeline_options options;
+    try {
+        int first = 2;
+        if (std::string(argv[2]).rfind("--", 0) != 0) {
+            manifest_file = argv[2];
+            first = 3;
+        }
+        for (const auto &[option, value] : readOptions(argc, argv, first)) {
+            if (option == "--glob") {
+                pattern = value;
+            } else if (option == "--parameters") {
+                parameters_file = value;
+            } else if (option == "--output-dir") {
+                output_dir = value;
+            } else if (option == "--summary") {
+                summary_path = value;
+            } else if (option == "--readers") {
+                options.readers = std::stoull(value);
+            } else if (option == "--workers") {
+                options.workers = std::stoull(value);
+            } else if (option == "--writers") {
+                options.writers = std::stoull(value);
+            } else if (option == "--queue") {
+                options.queue = std::stoull(value);
+            } else {
+                throw std::invalid_argument("Unknown option " + option);
             }
-            if (P.size() != pos_min) {
-                P.pop_back();
+        }
+        std::vector<hbv_basin> basins;
+        if (!manifest_file.empty()) {
+            basins = readManifest(manifest_file);
+        } else if (!pattern.empty() && !parameters_file.empty()) {
+            basins = globBasins(pattern, parameters_file, output_dir);
+        } else {
+            throw std::invalid_argument("Please give a manifest file or --glob with --parameters");
+        }
+        std::vector<hbv_basin_result> results = runBasins(basins, options);
+        uint64_t failed = 0;
+        for (const auto &result : results) {
+            failed += result.error.empty() ? 0 : 1;
+        }
+        printSummary(std::cout, basins, results);
+        std::cout << "\n" << basins.size() - failed << " of " << basins.size() << " basins finished";
+        std::cout << (failed > 0 ? ", please check the status of failed basins" : "") << "\n";
+        if (!summary_path.empty()) {
+            writeSummary(summary_path, basins, results);
+            std::cout << "Summary generated as " << summary_path << "\n";
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << '\n';
+        exit(-1);
+    }
+}
+/**
+ * @brief This function will convert T, P and Q of data file to a binary cache file. The cache file
+ * is used instead of data file while data file keeps its size and last write time.
+ * Usage: hbv convert data_file parameters_file [cache_file]
+ * @param argc number of arguments from main function
+ * @param argv arguments from main function
+ */
+void runConvert(int argc, char *argv[]) {
+    if (argc < 4 || argc > 5) {
+        std::cout <<"Argument number is incorrect! Please use --help for more information" <<"\n";
+        std::cout << "Usage: hbv --help" << "\n";
+        return;
+    }
+    std::string data_file = argv[2];
+    std::string parameters_file = argv[3];
+    std::string cache_file = (argc == 5) ? argv[4] : cachePath(data_file);
+    hbv_columns columns;
+    std::vector<double> parameters;
+    try {
+        readParameters(parameters_file, parameters, columns);
+        hbv_data_report report = convertData(data_file, columns, cache_file);
+        printDataReport(report);
+        std::cout << "Cache file generated as " << cache_file << " with " << report.records << " records" << "\n";
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << '\n';
+        exit(-1);
+    }
+}
+/**
+ * @brief This function will run HBV model for the first days of data file (for example a spin-up
+ * period) and save the state of the last day to a checkpoint file.
+ * Usage: hbv spinup data_file parameters_file checkpoint_file [--days N]
+ * @param argc number of arguments from main function
+ * @param argv arguments from main function
+ */
+void runSpinup(int argc, char *argv[]) {
+    if (argc < 5) {
+        std::cout <<"Argument number is incorrect! Please use --help for more information" <<"\n";
+        std::cout << "Usage: hbv --help" << "\n";
+        return;
+    }
+    std::string data_file = argv[2];
+    std::string parameters_file = argv[3];
+    std::string checkpoint_file = argv[4];
+    hbv_columns columns;
+    std::vector<double> parameters;
+    try {
+        uint64_t days = UINT64_MAX;  // days is number of days to run, all days by default
+        for (const auto &[option, value] : readOptions(argc, argv, 5)) {
+            if (option == "--days") {
+                days = std::stoull(value);
+            } else {
+                throw std::invalid_argument("Unknown option " + option);
             }
-            if (Q.size() != pos_min) {
-                Q.pop_back();
+        }
+        readParameters(parameters_file, parameters, columns);
+        hbv_forcing forcing = loadForcing(data_file, columns);
+        printDataReport(forcing.getReport());
+        days = std::min<uint64_t>(days, forcing.size());
+        hbv_incremental model(parameters);
+        model.run(forcing.getQ().first(days), forcing.getP().first(days), forcing.getT().first(days));
+        saveCheckpoint(checkpoint_file, model);
+        std::cout << "Checkpoint file generated as " << checkpoint_file << " after " << days << " days" << "\n";
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << '\n';
+        exit(-1);
+    }
+}
+/**
+ * @brief This function will continue HBV model from a checkpoint file with all records of data file,
+ * and write result of those days in the same format as runHBV(). Parameters are given by checkpoint
+ * file, only column positions of parameters file are used.
+ * Usage: hbv resume checkpoint_file data_file parameters_file output_path [--save checkpoint_file]
+ * @param argc number of arguments from main function
+ * @param argv arguments from main function
+ */
+void runResume(int argc, char *argv[]) {
+    if (argc < 6) {
+        std::cout <<"Argument number is incorrect! Please use --help for more information" <<"\n";
+        std::cout << "Usage: hbv --help" << "\n";
+        return;
+    }
+    std::string checkpoint_file = argv[2];
+    std::string data_file = argv[3];
+    std::string parameters_file = argv[4];
+    std::string output_path = argv[5];
+    std::string save_path;  // save_path is where the state of the last day is saved, if given
+    hbv_columns columns;
+    std::vector<double> parameters;
+    try {
+        for (const auto &[option, value] : readOptions(argc, argv, 6)) {
+            if (option == "--save") {
+                save_path = value;
+            } else {
+                throw std::invalid_argument("Unknown option " + option);
             }
         }
-        if (t == 0) {
-            if ((p_P-1) > z ||(p_T-1) > z || (p_Q-1) > z) {
-                std::cerr << "Position of column exceed total length of file" << '\n';
-                exit(-1);
+        hbv_incremental model = loadCheckpoint(checkpoint_file);
+        readParameters(parameters_file, parameters, columns);
+        hbv_forcing forcing = loadForcing(data_file, columns);
+        printDataReport(forcing.getReport());
+        std::span<const double> Q = forcing.getQ(), P = forcing.getP(), T = forcing.getT();
+        std::string buffer(hbv_result_header);
+        for (uint64_t i = 0; i < Q.size(); i++) {
+            const hbv_flux &flux = model.step(P[i], T[i], Q[i]);
+            const hbv_state &state = model.getState();
+            appendResultRow(buffer, state.day, {flux.RF, flux.ET, flux.AET, state.SLZ + state.SUZ, flux.Qt, flux.Q_a});
+        }
+        std::ofstream output(output_path);
+        if (!output.is_open()) {
+            throw std::runtime_error("Can't Open " + output_path);
+        }
+        output << buffer;
+        std::cout << "Data file generated as " << output_path << " from day " << model.getDay() - Q.size() + 1
+            << " to day " << model.getDay() << "\n";
+        if (!save_path.empty()) {
+            saveCheckpoint(save_path, model);
+            std::cout << "Checkpoint file generated as " << save_path << "\n";
+        }
+        std::cout << "The NSE value since the first day is " << model.getNSE() << "\n";
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << '\n';
+        exit(-1);
+    }
+}
+/**
+ * @brief This function will run ensemble members forward from the state of a checkpoint file and
+ * write quantiles of runoff of each day.
+ * Usage: hbv ensemble checkpoint_file forcing_file output_path [options]
+ * @param argc number of arguments from main function
+ * @param argv arguments from main function
+ */
+void runEnsemble(int argc, char *argv[]) {
+    if (argc < 5) {
+        std::cout <<"Argument number is incorrect! Please use --help for more information" <<"\n";
+        std::cout << "Usage: hbv --help" << "\n";
+        return;
+    }
+    std::string checkpoint_file = argv[2];
+    std::string forcing_file = argv[3];
+    std::string output_path = argv[4];
+    hbv_ensemble_options options;
+    try {
+        for (const auto &[option, value] : readOptions(argc, argv, 5)) {
+            if (option == "--quantiles") {
+                options.quantiles.clear();
+                std::istringstream cells(value);
+                for (std::string cell; std::getline(cells, cell, ',');) {
+                    options.quantiles.push_back(std::stod(cell));
+                }
+            } else if (option == "--threads") {
+                options.threads = std::stoull(value);
+            } else if (option == "--chunk") {
+                options.chunk = std::stoull(value);
+            } else {
+                throw std::invalid_argument("Unknown option " + option);
             }
         }
-        t++;
+        hbv_incremental model = loadCheckpoint(checkpoint_file);
+        std::vector<double> P, T;
+        uint64_t members = 0;
+        uint64_t days = readEnsemble(forcing_file, P, T, members);
+        hbv_ensemble ensemble(model.getParameters(), model.getState(), members);
+        forecastEnsemble(ensemble, P, T, days, options, output_path);
+        std::cout << "Ensemble of " << members << " members finished from day " << model.getDay() + 1
+            << " to day " << ensemble.getDay() << "\n";
+        std::cout << "Data file generated as " << output_path << "\n";
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << '\n';
+        exit(-1);
     }
-    if (Q.size() < 2) {
-        std::cerr << "The data file should contain at leasts 2-day records" << '\n';
+}
+/**
+ * @brief This function will keep running and answer requests of newline-delimited JSON from stdin (answers
+ * to stdout) or from clients of a Unix domain socket, with datasets kept in memory between requests.
+ * Usage: hbv serve [--socket path] [--threads N]
+ * @param argc number of arguments from main function
+ * @param argv arguments from main function
+ */
+void runServe(int argc, char *argv[]) {
+    std::string socket_path;  // socket_path is empty when stdin and stdout are used
+    uint64_t threads = hbv_threads();
+    try {
+        for (const auto &[option, value] : readOptions(argc, argv, 2)) {
+            if (option == "--socket") {
+                socket_path = value;
+            } else if (option == "--threads") {
+                threads = std::stoull(value);
+            } else {
+                throw std::invalid_argument("Unknown option " + option);
+            }
+        }
+        hbv_server server(threads);
+        if (socket_path.empty()) {
+            serveStream(server, std::cin, std::cout);
+        } else {
+            std::cerr << "HBV server is listening on " << socket_path << "\n";
+            serveSocket(server, socket_path);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << '\n';
         exit(-1);
     }
-    input1.close();
-    hbv_model hbv_model(Q, P, T, parameters);
-    std::cout << "HBV model build successful!" <<"\n";
-    std::vector<double> o_RF = hbv_model.getRF();
-    // o_RF are used to get the value of RF from the hbv model and use them to generate the result.csv file.
-    std::vector<double> o_AET = hbv_model.getAET();
-    // o_AET are used to get the value of AET from the hbv model and use them to generate the result.csv file.
-    std::vector<double> o_ET = hbv_model.getET();
-    // o_ET are used to get the value of ET from the hbv model and use them to generate the result.csv file.
-    std::vector<double> o_storage;
-    // o_storage are used to store sum of SUZ and SLZ, and use them to generate the result.csv file.
-    std::vector<double> o_Qt = hbv_model.getQt();
-    // o_Qt are used to get the value of Qt from the hbv model and use them to generate the result.csv file.
-    std::vector<double> o_Qa = hbv_model.getQa();
-    // o_Qa are used to get the value of Q_a from the hbv model and use them to generate the result.csv file.
-    for (uint64_t i = 0; i < o_RF.size(); i++) {
-        o_storage.push_back(hbv_model.getSLZ()[i]+hbv_model.getSUZ()[i]);
-    }
-    o_Qt.insert(o_Qt.begin(), std::nan(""));
-    o_Qa.insert(o_Qa.begin(), std::nan(""));
-    o_AET.insert(o_AET.begin(), std::nan(""));
-    output << "Days,"
-    << "Effective Precipitation (mm/day),"
-    << "Evapotranspiration (mm/day),"
-    << "Actual Evapotranspiration (mm/day),"
-    << "Storage (mm),"
-    << "Runoff (mm/day),"
-    << "Runoff in Area (m^3/day)\n";
-    output << std::setprecision(3) << std::fixed;
-    for (uint64_t i = 0; i < o_RF.size(); i++) {
-        output << std::to_string(i+1) << ","
-            << o_RF[i] << ","
-            << o_ET[i] << ","
-            << o_AET[i] << ","
-            << o_storage[i] << ","
-            << o_Qt[i]<< ","
-            << o_Qa[i]<< "\n";
-    }
-    output.close();
-    std::cout <<"Data file generated as "<< output_path <<"\n\n";
-    hbv_model.getNSE_AD();
 }
 /**
  * @brief This function will print out help message to the console.
@@ -233,6 +794,72 @@ void print_help_message() {
     std::cout << "Use example data to generate data file named \"result.csv\" and calculate NSE,"
         << "please make sure \"example_data.csv\" and \"parameters.txt\" is under the same path."
         << "\n";
+    std::cout << "\nUsage: \nhbv stream data_file_path parameter_file_path output_path [--chunk N] [--block N]"
+        << "\n";
+    std::cout << "Run HBV model N days at a time (65536 by default) and write the same output as above, memory does"
+        << " not depend on the length of data file" << "\n";
+    std::cout << "\nUsage: \nhbv calibrate data_file_path parameter_file_path output_parameter_file_path"
+        << " [--method sceua|dds|lbfgsb] [--objective nse|kge|lognse] [--evaluations N] [--complexes N]"
+        << " [--starts N] [--smoothing width] [--seed N] [--threads N] [--log path] [--memo path]" << "\n";
+    std::cout << "Search the first 11 parameters in their range for the highest NSE (or objective) and write the"
+        << " best parameters file, the objective of each loop is written to \"convergence.csv\"" << "\n";
+    std::cout << "\nUsage: \nhbv sample data_file_path parameter_file_path output_path"
+        << " [--method uniform|lhs|sobol] [--samples N] [--seed N] [--threads N] [--format csv|binary]"
+        << " [--memo path]" << "\n";
+    std::cout << "Run HBV model with N parameters sets sampled in their range and write parameters"
+        << " and NSE of each set to output file" << "\n";
+    std::cout << "\nUsage: \nhbv windows data_file_path parameter_file_path --windows \"name=range@months;...\""
+        << " [--start YYYY-MM-DD] [--output path]" << "\n";
+    std::cout << "Run HBV model once and print NSE and other metrics of each window, range is"
+        << " YYYY-MM-DD:YYYY-MM-DD or days:first-last and months is a list like 3-5 or 12,1,2 (dates and months"
+        << " need the date of the first record)" << "\n";
+    std::cout << "\nUsage: \nhbv precision data_file_path parameter_file_path [--samples N] [--seed N] [--threads N]"
+        << "\n";
+    std::cout << "Run HBV model in double and in float and print the difference of NSE and of each result column,"
+        << " and the difference of NSE of N sampled parameters sets (1000 by default)" << "\n";
+    std::cout << "Calibrate and sample can use --memo path to keep objective value of each parameters set in a file,"
+        << " sets found in it are not run again when the command is run again" << "\n";
+    std::cout << "\nUsage: \nhbv sensitivity data_file_path parameter_file_path output_path"
+        << " [--method sobol|lhs|uniform] [--samples N] [--bootstrap N] [--confidence 0.95]"
+        << " [--objective nse|kge|lognse|rmse|pbias] [--seed N] [--threads N]" << "\n";
+    std::cout << "Calculate first-order and total-order Sobol indices of the first 11 parameters with N * 13 model"
+        << " runs and write them with bootstrap confidence intervals to output file" << "\n";
+    std::cout << "\nUsage: \nhbv glue data_file_path parameter_file_path output_path"
+        << " [--method lhs|sobol|uniform] [--samples N] [--threshold 0.5] [--quantiles 0.05,0.5,0.95]"
+        << " [--compression 100] [--seed N] [--threads N]" << "\n";
+    std::cout << "Run N sampled parameters sets, keep the sets with NSE above threshold and write quantiles of"
+        << " runoff of each day weighted by NSE - threshold, trajectories are not stored" << "\n";
+    std::cout << "\nUsage: \nhbv batch manifest_file_path [--summary path] [--readers N] [--workers N]"
+        << " [--writers N] [--queue N]" << "\n";
+    std::cout << "hbv batch --glob \"folder/*.csv\" --parameters parameter_file_path [--output-dir folder]"
+        << " [options above]" << "\n";
+    std::cout << "Run HBV model for many basins, each line of manifest file is"
+        << " data_file_path,parameter_file_path,output_path" << "\n";
+    std::cout << "\nUsage: \nhbv spinup data_file_path parameter_file_path checkpoint_file_path [--days N]" << "\n";
+    std::cout << "Run HBV model for the first N days (all days by default) and save the state of the last day"
+        << " to a checkpoint file" << "\n";
+    std::cout << "\nUsage: \nhbv resume checkpoint_file_path data_file_path parameter_file_path output_path"
+        << " [--save checkpoint_file_path]" << "\n";
+    std::cout << "Continue HBV model from a checkpoint file with records of data file, parameters are given by"
+        << " checkpoint file and only column positions of parameter file are used" << "\n";
+    std::cout << "\nUsage: \nhbv ensemble checkpoint_file_path forcing_file_path output_path"
+        << " [--quantiles 0,0.05,0.25,0.5,0.75,0.95,1] [--threads N] [--chunk N]" << "\n";
+    std::cout << "Run ensemble members (each line of forcing file is member,P,T) from the state of checkpoint file"
+        << " and write quantiles of runoff of each day" << "\n";
+    std::cout << "\nUsage: \nhbv serve [--socket path] [--threads N]" << "\n";
+    std::cout << "Keep running and answer requests of newline-delimited JSON from stdin (or a Unix domain socket),"
+        << " datasets are loaded once by name and evaluate requests are run together, please check readme file"
+        << "\n";
+    std::cout << "\nUsage: \nhbv [command and options above] --profile [table|json]" << "\n";
+    std::cout << "Print time of each phase (open files, parse parameters, parse data, set parameter, simulate and"
+        << " write result) and counters after the command finished" << "\n";
+    std::cout << "\nUsage: \nhbv [data_file_path parameter_file_path output_path][-e][sample ...] --precision float|double"
+        << "\n";
+    std::cout << "Run HBV model in float (double by default), it is faster for many parameters sets, please check"
+        << " the difference with \"hbv precision\" first" << "\n";
+    std::cout << "\nUsage: \nhbv convert data_file_path parameter_file_path [cache_file_path]" << "\n";
+    std::cout << "Write T, P and Q of data file to a binary cache file (default \"data_file_path.hbvc\"),"
+        << " it is used instead of data file while data file keeps its size and last write time" << "\n";
 }
 /**
  * @brief This function will print overview of program when user only type command without argument.
@@ -260,6 +887,24 @@ void print_overview() {
     std::cout << "Usage: hbv -h" << "\n";
     std::cout << "Usage hbv --help" << "\n\n";
 }
+/**
+ * @brief profile_format is "table" or "json" given by "--profile", empty if it is not given.
+ */
+std::string profile_format;
+/**
+ * @brief This function will print the profile report. It is registered with std::atexit(), so the report
+ * is also printed when a command stops with exit(-1) after an error.
+ */
+void printProfile() {
+    if (!HBV_PROFILE) {
+        std::cerr << "Profile is not available, please compile with -DHBV_PROFILE=1" << "\n";
+    } else if (profile_format == "json") {
+        hbv_profiler::global().printJson(std::cout);
+    } else {
+        hbv_profiler::global().printTable(std::cout);
+    }
+    std::cout.flush();
+}
 /**
  * @brief The main function will get input from user and provide some argument such as "help" and "example" 
  * or build HBV model with given file path.
@@ -270,15 +915,89 @@ int main(int argc, char *argv[]) {
     std::string example1 = "--example";
     std::string example2 = "-e";
     std::string data_path, parameter_path;
+    std::string stream = "stream";
+    std::string calibrate = "calibrate";
+    std::string sample = "sample";
+    std::string sensitivity = "sensitivity";
+    std::string batch = "batch";
+    std::string convert = "convert";
+    std::string spinup = "spinup";
+    std::string resume = "resume";
+    std::string ensemble = "ensemble";
+    std::string compare = "precision";
+    std::string serve = "serve";
+    std::string window = "windows";
+    std::string glue = "glue";
+    // "--profile [table|json]" can be added to any command, it is removed before other arguments are read.
+    std::string profile;
+    // "--precision float|double" is removed in the same way, it is used by the model and sample commands.
+    std::string precision = "double";
+    std::vector<char *> arguments;
+    for (int i = 0; i < argc; i++) {
+        if (std::string(argv[i]) == "--precision" && i + 1 < argc) {
+            precision = argv[++i];
+        } else if (std::string(argv[i]) == "--profile") {
+            profile = "table";
+            if (i + 1 < argc && (std::string(argv[i + 1]) == "table" || std::string(argv[i + 1]) == "json")) {
+                profile = argv[++i];
+            }
+        } else {
+            arguments.push_back(argv[i]);
+        }
+    }
+    argc = static_cast<int>(arguments.size());
+    argv = arguments.data();
+    if (!profile.empty()) {
+        // the profiler is made before the handler is registered, so it still exists when the handler runs.
+        hbv_profiler::global().enable();
+        profile_format = profile;
+        std::atexit(printProfile);
+    }
+    if (precision != "double" && precision != "float") {
+        std::cerr << "Precision should be float or double" << "\n";
+        return -1;
+    }
+    const std::vector<std::string> double_only = {stream, calibrate, sensitivity, batch, convert, spinup, resume,
+        ensemble, serve, window, glue};
+    if (precision == "float" && argc >= 2
+        && std::find(double_only.begin(), double_only.end(), argv[1]) != double_only.end()) {
+        std::cerr << "Precision float is only used by HBV model and sample command, double is used" << "\n";
+    }
     if (argc < 2) {
        // Print Overview of Program
        print_overview();
+    } else if (argv[1] == stream) {
+        runStream(argc, argv);
+    } else if (argv[1] == calibrate) {
+        runCalibrate(argc, argv);
+    } else if (argv[1] == sample) {
+        runSample(argc, argv, precision);
+    } else if (argv[1] == window) {
+        runWindows(argc, argv);
+    } else if (argv[1] == serve) {
+        runServe(argc, argv);
+    } else if (argv[1] == compare) {
+        runPrecision(argc, argv);
+    } else if (argv[1] == sensitivity) {
+        runSensitivity(argc, argv);
+    } else if (argv[1] == glue) {
+        runGLUE(argc, argv);
+    } else if (argv[1] == batch) {
+        runBatch(argc, argv);
+    } else if (argv[1] == convert) {
+        runConvert(argc, argv);
+    } else if (argv[1] == spinup) {
+        runSpinup(argc, argv);
+    } else if (argv[1] == resume) {
+        runResume(argc, argv);
+    } else if (argv[1] == ensemble) {
+        runEnsemble(argc, argv);
     } else if (argc == 2) {
         // Print Simple command of Program
         if (argv[1] == help1 || argv[1] == help2) {
             print_help_message();
         } else if (argv[1] == example1 || argv[1] == example2) {
-            runHBV("example_data.csv", "parameters.txt", "result.csv");
+            runHBV("example_data.csv", "parameters.txt", "result.csv", precision);
         } else {
             std::cout <<"No command found! Please use --help for more information" <<"\n";
             std::cout << "Usage: hbv --help" << "\n";
@@ -286,7 +1005,7 @@ int main(int argc, char *argv[]) {
     } else {
         // Handle given data set
         if (argc == 4) {
-            runHBV(argv[1], argv[2], argv[3]);
+            runHBV(argv[1], argv[2], argv[3], precision);
         } else {
             std::cout <<"Argument number is incorrect! Please use --help for more information" <<"\n";
             std::cout << "Usage: hbv --help" << "\n";
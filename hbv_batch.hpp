@@ -0,0 +1,180 @@
+// Copyright 2022 Tianshuo Li
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <span>
+#include <vector>
+#include "hbv_specialized.hpp"
+/**
+ * @brief hbv_batch will run HBV model with many parameters on the same dataset at the same time.
+ * Parameters and storages are stored as one vector for each value (structure of arrays), and
+ * every day all parameters sets are calculated together with hbv_lane_step(). Its branches are
+ * selects or the same for all lanes, so the loops over parameters sets can be vectorized by compiler
+ * (for example "-O3 -march=native" for AVX2/AVX-512).
+ * The NSE value is exactly the same as hbv_evaluate() as long as compiler do not fuse
+ * multiply and add (use "-ffp-contract=off" together with "-march"). With fast pow, hbv_fast_pow()
+ * is used in F equation so that loop is also vectorized, and NSE is within hbv_kernel_tolerance.
+ * Real is the scalar type of parameters and storages. With float twice as many parameters sets fit
+ * in one vector register, the errors are still summed in double.
+ */
+template <typename Real>
+class hbv_batch_t {
+ public:
+      /**
+       * @brief tile is the number of parameters sets calculated together for the whole dataset.
+       * The storages of one tile can stay in cache.
+       */
+      static constexpr uint64_t tile = 64;
+      /**
+       * @brief Construct a new hbv batch with parameters sets, they are converted to Real.
+       * @param sets parameters sets, range should be checked before
+       * @param fast1 true to use hbv_fast_pow() instead of pow()
+       */
+      explicit hbv_batch_t(const std::vector<hbv_parameters> &sets, bool fast1 = false) {
+         K = sets.size();
+         fast = fast1;
+         uint64_t padded = (K + tile - 1) / tile * tile;
+         for (uint64_t j = 0; j < 16; j++) {
+            // padding lanes copy the last parameters set, their result is not returned.
+            par[j].resize(padded);
+            for (uint64_t k = 0; k < padded; k++) {
+               hbv_parameters p = sets[std::min(k, K - 1)];
+               par[j][k] = static_cast<Real>(p[j]);
+            }
+         }
+      }
+      /**
+       * @brief size() will return number of parameters sets.
+       */
+      uint64_t size() const {
+         return K;
+      }
+      /**
+       * @brief Run all parameters sets and return NSE value of each of them.
+       * @param Q discharge given by dataset
+       * @param P precipitation given by dataset
+       * @param T daily mean temperature given by dataset
+       * @return std::vector<double> NSE value, same order as parameters sets
+       */
+      std::vector<double> evaluate(std::span<const double> Q, std::span<const double> P,
+      std::span<const double> T) const {
+         std::vector<double> NSE(K);
+         evaluate(Q, P, T, 0, K, NSE.data(), hbv_sum_squares_q(Q));
+         return NSE;
+      }
+      /**
+       * @brief Run parameters sets in [begin, end) and write NSE value into out[0, end-begin).
+       * Different ranges can be run by different threads.
+       */
+      void evaluate(std::span<const double> Q, std::span<const double> P, std::span<const double> T,
+      uint64_t begin, uint64_t end, double *out) const {
+         evaluate(Q, P, T, begin, end, out, hbv_sum_squares_q(Q));
+      }
+      /**
+       * @brief Run parameters sets in [begin, end) as above with temp2 given by hbv_sum_squares_q(Q),
+       * so callers running many ranges of one dataset only go through Q once.
+       */
+      void evaluate(std::span<const double> Q, std::span<const double> P, std::span<const double> T,
+      uint64_t begin, uint64_t end, double *out, double temp2) const {
+         double temp1[tile];
+         for (uint64_t b = begin / tile * tile; b < end; b += tile) {
+            runTile(Q, P, T, b, temp1);
+            for (uint64_t l = 0; l < tile; l++) {
+               if (b + l >= begin && b + l < end) {
+                  out[b + l - begin] = 1 - temp1[l] / temp2;
+               }
+            }
+         }
+      }
+
+ private:
+      /**
+       * @brief K is the number of parameters sets.
+       */
+      uint64_t K;
+      /**
+       * @brief fast is true when hbv_fast_pow() is used in F equation.
+       */
+      bool fast;
+      /**
+       * @brief par[j][k] stores j-th parameter of k-th parameters set.
+       */
+      std::vector<Real> par[16];
+      /**
+       * @brief Run one tile of parameters sets from lane b for whole dataset.
+       * @param temp1 the part 1 value of NSE value of each lane
+       */
+      void runTile(std::span<const double> Q, std::span<const double> P, std::span<const double> T,
+      uint64_t b, double *temp1) const {
+         // parameters of this tile are copied to local arrays, so compiler knows
+         // they are not changed by the loops below.
+         Real T_tr[tile], DF[tile], FC[tile], beta[tile], alpha[tile], LP[tile];
+         Real k0[tile], k1[tile], k2[tile], Lsuz[tile], Cperc[tile];
+         Real SD[tile], SM[tile], SUZ[tile], SLZ[tile], powSM[tile];
+         double sum[tile];
+         for (uint64_t l = 0; l < tile; l++) {
+            T_tr[l] = par[0][b + l];
+            DF[l] = par[1][b + l];
+            FC[l] = par[2][b + l];
+            beta[l] = par[3][b + l];
+            alpha[l] = par[4][b + l];
+            LP[l] = par[5][b + l];
+            k0[l] = par[6][b + l];
+            k1[l] = par[7][b + l];
+            k2[l] = par[8][b + l];
+            Lsuz[l] = par[9][b + l];
+            Cperc[l] = par[10][b + l];
+            SD[l] = par[11][b + l];
+            SUZ[l] = par[12][b + l];
+            SLZ[l] = par[13][b + l];
+            SM[l] = par[14][b + l];
+            sum[l] = 0;
+         }
+         // Every lane of one day, day is given as a constant (0 or not 0) at each call so the branches
+         // on the first day are removed and the loop has no control flow.
+         auto runDay = [&](uint64_t i) {
+            const Real Ti = static_cast<Real>(T[i]), Pi = static_cast<Real>(P[i]);
+            const double Qi = Q[i];
+            for (uint64_t l = 0; l < tile; l++) {
+               // initial storages and A are not used by hbv_lane_step().
+               const hbv_parameters_t<Real> p{T_tr[l], DF[l], FC[l], beta[l], alpha[l], LP[l],
+                  k0[l], k1[l], k2[l], Lsuz[l], Cperc[l], 0, 0, 0, 0, 0};
+               hbv_state_t<Real> s{SD[l], SM[l], SUZ[l], SLZ[l], i};
+               const Real Qt = hbv_lane_step(p, s, Pi, Ti, powSM[l]);
+               SD[l] = s.SD;
+               SM[l] = s.SM;
+               SUZ[l] = s.SUZ;
+               SLZ[l] = s.SLZ;
+               if (i > 0) {
+                  double error = Qi - Qt;
+                  sum[l] += error * error;
+               }
+            }
+         };
+         for (uint64_t i = 0; i < Q.size(); i++) {
+            if (i == 0) {
+               // The first day only calculates snow part, pow is not used.
+               std::fill(powSM, powSM + tile, Real(0));
+               runDay(0);
+               continue;
+            }
+            // pow has no vector version that gives the same value, so it stays in its own loop.
+            if (fast) {
+               for (uint64_t l = 0; l < tile; l++) {
+                  powSM[l] = static_cast<Real>(hbv_fast_pow(SM[l] / FC[l], beta[l]));
+               }
+            } else {
+               for (uint64_t l = 0; l < tile; l++) {
+                  powSM[l] = std::pow(SM[l] / FC[l], beta[l]);
+               }
+            }
+            runDay(i);
+         }
+         std::copy(sum, sum + tile, temp1);
+      }
+};
+/**
+ * @brief hbv_batch runs parameters sets in double, it is used by most of the program.
+ */
+using hbv_batch = hbv_batch_t<double>;
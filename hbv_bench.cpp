@@ -0,0 +1,386 @@
+// Copyright 2022 Tianshuo Li
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstdlib>
+#include <cmath>
+#include <chrono>
+#include <cstdio>
+#include <limits>
+#include <atomic>
+#include <filesystem>
+#include <functional>
+#include <fstream>
+#include <sstream>
+#include <new>
+#include "hbv_model.hpp"
+#include "hbv_io.hpp"
+#include "hbv_cache.hpp"
+#include "hbv_synthetic.hpp"
+#include "hbv_specialized.hpp"
+#include "hbv_batch.hpp"
+#include "hbv_sampler.hpp"
+#include "hbv_ensemble.hpp"
+#include "hbv_incremental.hpp"
+#include "hbv_gradient.hpp"
+#include "hbv_memo.hpp"
+/**
+ * @brief allocations counts calls of operator new in this program. operator delete is not inlined,
+ * otherwise gcc sees free() of memory given by new and gives a wrong -Wmismatched-new-delete warning.
+ */
+std::atomic<uint64_t> allocations(0);
+void *operator new(std::size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *address = std::malloc(size == 0 ? 1 : size)) {
+        return address;
+    }
+    throw std::bad_alloc();
+}
+[[gnu::noinline]] void operator delete(void *address) noexcept {
+    std::free(address);
+}
+[[gnu::noinline]] void operator delete(void *address, std::size_t) noexcept {
+    std::free(address);
+}
+/**
+ * @brief hbv_benchmark stores the result of one benchmark on one dataset.
+ */
+struct hbv_benchmark {
+    std::string name;
+    uint64_t years, days, bytes;
+    double seconds;
+    uint64_t allocations;
+};
+/**
+ * @brief This function is the data file reader used before hbv_io.hpp (getline, istringstream and
+ * std::stod for every cell). It is kept here to compare with readData().
+ */
+void readDataLegacy(const std::string &data_file, const hbv_columns &columns, std::vector<double> &Q,
+    std::vector<double> &P, std::vector<double> &T) {
+    std::ifstream input1(data_file);
+    int64_t t = 0;
+    int64_t z = 0;
+    std::string temp;
+    std::string temp1;
+    Q.clear();
+    P.clear();
+    T.clear();
+    while (std::getline(input1, temp)) {
+        std::istringstream temp2(temp);
+        z = 0;
+        try {
+            while (std::getline(temp2, temp1, ',')) {
+                z++;
+                if (t != 0) {
+                    if ((z-1) == (columns.P-1)) {
+                        P.push_back(std::stod(temp1));
+                    } else if ((z-1) == (columns.T-1)) {
+                        T.push_back(std::stod(temp1));
+                    } else if ((z-1) == (columns.Q-1)) {
+                        Q.push_back(std::stod(temp1));
+                    }
+                }
+            }
+        } catch (const std::exception& e) {
+        }
+        uint64_t pos_min = std::min(std::min(Q.size(), P.size()), T.size());
+        if (T.size() != pos_min) {
+            T.pop_back();
+        }
+        if (P.size() != pos_min) {
+            P.pop_back();
+        }
+        if (Q.size() != pos_min) {
+            Q.pop_back();
+        }
+        t++;
+    }
+}
+/**
+ * @brief This function will run fn several times and return the shortest time in seconds and number
+ * of allocations of one run.
+ */
+std::pair<double, uint64_t> measure(const std::function<void()> &fn, uint64_t repeat) {
+    double best = 1e300;
+    uint64_t count = 0;
+    for (uint64_t r = 0; r < std::max<uint64_t>(1, repeat); r++) {
+        uint64_t before = allocations.load();
+        auto start = std::chrono::steady_clock::now();
+        fn();
+        std::chrono::duration<double> time = std::chrono::steady_clock::now() - start;
+        count = allocations.load() - before;
+        best = std::min(best, time.count());
+    }
+    return {best, count};
+}
+/**
+ * @brief This function will print results as a table.
+ */
+void printBenchmarks(const std::vector<hbv_benchmark> &results) {
+    std::cout << std::left << std::setw(14) << "Benchmark" << std::setw(8) << "Years" << std::setw(10) << "Days"
+        << std::setw(12) << "Time (ms)" << std::setw(12) << "ns/day" << std::setw(12) << "Allocs"
+        << "MB/s" << "\n" << std::fixed;
+    for (const auto &result : results) {
+        std::cout << std::setw(14) << result.name << std::setw(8) << result.years << std::setw(10) << result.days
+            << std::setw(12) << std::setprecision(3) << result.seconds * 1e3
+            << std::setw(12) << std::setprecision(1) << result.seconds * 1e9 / static_cast<double>(result.days)
+            << std::setw(12) << result.allocations;
+        if (result.bytes > 0) {
+            std::cout << std::setprecision(1) << static_cast<double>(result.bytes) / 1e6 / result.seconds;
+        } else {
+            std::cout << "-";
+        }
+        std::cout << "\n";
+    }
+    std::cout << std::right;
+}
+/**
+ * @brief This function will write results to a json file, so results of different commits can be compared.
+ * @throw std::runtime_error if the file can't be opened
+ */
+void writeBenchmarks(const std::string &path, const std::string &label, const std::vector<hbv_benchmark> &results) {
+    std::ofstream output(path);
+    if (!output.is_open()) {
+        throw std::runtime_error("Can't Open " + path);
+    }
+    output << "{\n  \"label\": \"" << label << "\",\n  \"benchmarks\": [\n" << std::setprecision(6);
+    for (uint64_t i = 0; i < results.size(); i++) {
+        const auto &result = results[i];
+        const double mb_per_s = (result.bytes > 0) ? static_cast<double>(result.bytes) / 1e6 / result.seconds : 0;
+        output << "    {\"name\": \"" << result.name << "\", \"years\": " << result.years
+            << ", \"days\": " << result.days << ", \"bytes\": " << result.bytes
+            << ", \"seconds\": " << result.seconds
+            << ", \"ns_per_day\": " << result.seconds * 1e9 / static_cast<double>(result.days)
+            << ", \"allocations\": " << result.allocations
+            << ", \"mb_per_s\": " << mb_per_s << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    output << "  ]\n}\n";
+}
+/**
+ * @brief hbv_check stores the largest difference of one engine from the reference on the check dataset.
+ */
+struct hbv_check {
+    std::string name;
+    double difference, tolerance;
+};
+/**
+ * @brief Get the difference of two values, 0 when both are NaN and infinity when only one is NaN.
+ */
+double checkDifference(double a, double b) {
+    if (std::isnan(a) || std::isnan(b)) {
+        return (std::isnan(a) && std::isnan(b)) ? 0 : std::numeric_limits<double>::infinity();
+    }
+    return std::abs(a - b);
+}
+/**
+ * @brief This function will compare engines which run HBV model in their own loop with the reference
+ * on a synthetic dataset, using hbv_synthetic_parameters and samples Latin hypercube parameters sets:
+ * batch (hbv_batch, NSE exactly the same as hbv_evaluate()), batch_fast (hbv_batch with fast pow,
+ * NSE within hbv_kernel_tolerance) and ensemble (one member hbv_ensemble run in two parts, runoff of
+ * every day exactly the same as hbv_incremental::step(), for every 16th parameters set) and kernels (every
+ * instantiation of hbv_evaluate_kernel() with beta set to its B2 / 2, and T_tr set to minimum of T and
+ * no initial snow for those without snow routine, NSE within hbv_kernel_tolerance, for every 16th set) and
+ * gradient (hbv_evaluate_gradient() with width 0, NSE exactly the same as hbv_evaluate(), for every 16th set)
+ * and memo (two hbv_memo opened on one new file, each finds the values inserted by the other after both were
+ * opened, the difference is the number of values not found).
+ */
+std::vector<hbv_check> checkEngines(const hbv_synthetic &data, uint64_t samples) {
+    const hbv_sampler sampler("lhs", samples, 1);
+    std::vector<hbv_parameters> sets = {hbv_parameters::fromVector(hbv_synthetic_parameters)};
+    for (uint64_t i = 0; i < samples; i++) {
+        sets.push_back(hbv_parameters::fromVector(sampler.parameters(i, hbv_synthetic_parameters)));
+    }
+    std::vector<double> reference;
+    for (const auto &p : sets) {
+        reference.push_back(hbv_evaluate(p, data.Q, data.P, data.T).NSE);
+    }
+    std::vector<hbv_check> checks;
+    auto compare = [&](const std::string &name, const std::vector<double> &NSE, double tolerance) {
+        hbv_check check = {name, 0, tolerance};
+        for (uint64_t k = 0; k < sets.size(); k++) {
+            check.difference = std::max(check.difference, checkDifference(NSE[k], reference[k]));
+        }
+        checks.push_back(check);
+    };
+    compare("batch", hbv_batch(sets).evaluate(data.Q, data.P, data.T), 0);
+    compare("batch_fast", hbv_batch(sets, true).evaluate(data.Q, data.P, data.T), hbv_kernel_tolerance);
+    hbv_check ensemble = {"ensemble", 0, 0};
+    const uint64_t days = data.P.size(), half = days / 2;
+    std::vector<double> Qt(days);
+    for (uint64_t k = 0; k < sets.size(); k += 16) {
+        hbv_ensemble members(sets[k], hbv_state::initial(sets[k]), 1);
+        members.runTile(data.P, data.T, days, 0, half, 0, Qt.data());
+        members.advance(half);
+        members.runTile(data.P, data.T, days, half, days - half, 0, Qt.data() + half);
+        hbv_incremental model(sets[k], hbv_state::initial(sets[k]));
+        for (uint64_t i = 0; i < days; i++) {
+            ensemble.difference = std::max(ensemble.difference,
+                checkDifference(Qt[i], model.step(data.P[i], data.T[i]).Qt));
+        }
+    }
+    checks.push_back(ensemble);
+    hbv_check kernels = {"kernels", 0, hbv_kernel_tolerance};
+    const double averageQ = hbv_average_q(data.Q), minT = hbv_min_t(data.T);
+    for (uint64_t k = 0; k < sets.size(); k += 16) {
+        for (int beta2 = 0; beta2 <= hbv_kernel_key::max_beta2; beta2++) {
+            for (bool snow : {false, true}) {
+                hbv_parameters p = sets[k];
+                if (beta2 > 0) {
+                    p.beta = beta2 / 2.0;
+                }
+                if (!snow) {
+                    p.T_tr = minT;
+                    p.SD_i = 0;
+                }
+                kernels.difference = std::max(kernels.difference, checkDifference(
+                    hbv_kernels[beta2][snow](p, data.Q, data.P, data.T, averageQ).NSE,
+                    hbv_evaluate(p, data.Q, data.P, data.T, averageQ).NSE));
+            }
+        }
+    }
+    checks.push_back(kernels);
+    hbv_check gradient = {"gradient", 0, 0};
+    for (uint64_t k = 0; k < sets.size(); k += 16) {
+        gradient.difference = std::max(gradient.difference,
+            checkDifference(hbv_evaluate_gradient(sets[k], data.Q, data.P, data.T).NSE, reference[k]));
+    }
+    checks.push_back(gradient);
+    const std::string memo_path = "bench_memo.bin";
+    std::remove(memo_path.c_str());
+    hbv_check shared = {"memo", 0, 0};
+    {
+        hbv_memo first(memo_path, data.Q, data.P, data.T, "NSE");
+        hbv_memo second(memo_path, data.Q, data.P, data.T, "NSE");
+        for (uint64_t k = 0; k < sets.size(); k++) {
+            hbv_memo &writer = (k % 2 == 0) ? first : second, &reader = (k % 2 == 0) ? second : first;
+            writer.insert(sets[k], reference[k]);
+            const std::optional<double> value = reader.find(sets[k]);
+            shared.difference += (value && checkDifference(*value, reference[k]) == 0) ? 0 : 1;
+        }
+    }
+    std::remove(memo_path.c_str());
+    checks.push_back(shared);
+    return checks;
+}
+/**
+ * @brief This function will print checks as a table.
+ * @return true if every difference is within its tolerance
+ */
+bool printChecks(const std::vector<hbv_check> &checks) {
+    bool passed = true;
+    std::cout << std::left << std::setw(14) << "Check" << std::setw(14) << "Difference" << std::setw(14)
+        << "Tolerance" << "Result" << "\n" << std::scientific << std::setprecision(3);
+    for (const auto &check : checks) {
+        const bool ok = check.difference <= check.tolerance;
+        passed = passed && ok;
+        std::cout << std::setw(14) << check.name << std::setw(14) << check.difference << std::setw(14)
+            << check.tolerance << (ok ? "ok" : "FAILED") << "\n";
+    }
+    std::cout << std::right << std::defaultfloat << "\n";
+    return passed;
+}
+/**
+ * @brief The main function will run benchmarks on synthetic datasets of each length:
+ * parse_legacy (old getline/stod reader), parse (readData() as in runHBV()), cache (mapping cache file),
+ * model (constructor of hbv_model, which calls getResult()), reset (hbv_model::reset() on a model already
+ * run with new T_tr, no memory is allocated), reset_soil (hbv_model::reset() with new k1, which skips the
+ * prepass of S_m, RF and ET), evaluate (hbv_evaluate()), evaluate_fast
+ * (hbv_evaluate_fast()) and write (writeResult()).
+ * Before benchmarks, engines are compared with the reference by checkEngines() on 10 years of synthetic
+ * data, and the program returns 1 if any of them is out of its tolerance.
+ * Usage: hbv_bench [--years 1,10,50,200] [--repeat N] [--json path] [--label text] [--legacy 0|1]
+ * [--check 0|1]
+ */
+int main(int argc, char *argv[]) {
+    std::vector<uint64_t> years = {1, 10, 50, 200};
+    uint64_t repeat = 5;
+    bool legacy = true, check = true;
+    std::string json_path, label;
+    for (int i = 1; i < argc; i += 2) {
+        std::string option = argv[i];
+        if (i + 1 >= argc) {
+            std::cerr << "Option " << option << " needs a value" << "\n";
+            return 1;
+        }
+        std::string value = argv[i + 1];
+        if (option == "--years") {
+            years.clear();
+            std::istringstream cells(value);
+            for (std::string cell; std::getline(cells, cell, ',');) {
+                years.push_back(std::stoull(cell));
+            }
+        } else if (option == "--repeat") {
+            repeat = std::stoull(value);
+        } else if (option == "--json") {
+            json_path = value;
+        } else if (option == "--label") {
+            label = value;
+        } else if (option == "--legacy") {
+            legacy = (value != "0");
+        } else if (option == "--check") {
+            check = (value != "0");
+        } else {
+            std::cerr << "Unknown option " << option << "\n";
+            return 1;
+        }
+    }
+    if (check && !printChecks(checkEngines(generateForcing(10), 255))) {
+        return 1;
+    }
+    hbv_columns columns;
+    columns.T = 5;
+    columns.P = 6;
+    columns.Q = 4;
+    const std::string path = "bench_data.csv", output_path = "bench_result.csv";
+    std::vector<hbv_benchmark> results;
+    for (uint64_t y : years) {
+        const hbv_synthetic data = generateForcing(y);
+        writeForcing(path, data);
+        const uint64_t days = data.Q.size(), bytes = std::filesystem::file_size(path);
+        std::vector<double> Q, P, T;
+        auto add = [&](const std::string &name, uint64_t size, const std::function<void()> &fn) {
+            auto [seconds, count] = measure(fn, repeat);
+            results.push_back({name, y, days, size, seconds, count});
+        };
+        if (legacy) {
+            add("parse_legacy", bytes, [&]() { readDataLegacy(path, columns, Q, P, T); });
+        }
+        add("parse", bytes, [&]() { readData(path, columns, Q, P, T); });
+        convertData(path, columns, cachePath(path));
+        add("cache", 0, [&]() {
+            hbv_forcing forcing = loadForcing(path, columns);
+            if (!forcing.isMapped()) {
+                throw std::runtime_error("Cache file is not used");
+            }
+        });
+        add("model", 0, [&]() { hbv_model hbv_model(data.Q, data.P, data.T, hbv_synthetic_parameters); });
+        hbv_model workspace(data.Q, data.P, data.T, hbv_synthetic_parameters);
+        std::vector<double> changed = hbv_synthetic_parameters;
+        add("reset", 0, [&]() {
+            changed[0] = (changed[0] == hbv_synthetic_parameters[0]) ? changed[0] + 0.1 : hbv_synthetic_parameters[0];
+            workspace.reset(changed);
+        });
+        changed = hbv_synthetic_parameters;
+        add("reset_soil", 0, [&]() {
+            changed[7] = (changed[7] == hbv_synthetic_parameters[7]) ? changed[7] * 1.01 : hbv_synthetic_parameters[7];
+            workspace.reset(changed);
+        });
+        const hbv_parameters par = hbv_parameters::fromVector(hbv_synthetic_parameters);
+        add("evaluate", 0, [&]() { hbv_evaluate(par, data.Q, data.P, data.T); });
+        add("evaluate_fast", 0, [&]() { hbv_evaluate_fast(par, data.Q, data.P, data.T); });
+        const hbv_model hbv_model(data.Q, data.P, data.T, hbv_synthetic_parameters);
+        add("write", 0, [&]() { writeResult(output_path, hbv_model); });
+        results.back().bytes = std::filesystem::file_size(output_path);
+        std::remove(path.c_str());
+        std::remove(cachePath(path).c_str());
+        std::remove(output_path.c_str());
+    }
+    printBenchmarks(results);
+    if (!json_path.empty()) {
+        writeBenchmarks(json_path, label, results);
+        std::cout << "Benchmark file generated as " << json_path << "\n";
+    }
+}
@@ -0,0 +1,358 @@
+// Copyright 2022 Tianshuo Li
+#pragma once
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include "hbv_io.hpp"
+/**
+ * @brief hbv_cache_header is the first 256 bytes of a forcing cache file. It is followed by
+ * Q, P and T, each stored as little-endian doubles starting at a multiple of 64 bytes.
+ */
+struct hbv_cache_header {
+    /**
+     * @brief magic is "HBVFRC01", version is version of format.
+     */
+    char magic[8];
+    uint64_t version;
+    /**
+     * @brief records is number of days of each series.
+     */
+    uint64_t records;
+    /**
+     * @brief column position of T, P and Q in source csv file.
+     */
+    int64_t T, P, Q;
+    /**
+     * @brief lines and skipped are copied from hbv_data_report of source csv file.
+     */
+    uint64_t lines, skipped;
+    /**
+     * @brief source_size is size of source csv file in bytes and source_checksum is its FNV-1a hash.
+     */
+    uint64_t source_size, source_checksum;
+    /**
+     * @brief source_time is last write time of source csv file in nanoseconds since the epoch of
+     * std::filesystem::file_time_type, read before the file is read.
+     */
+    int64_t source_time;
+    /**
+     * @brief offset of Q, P and T from start of file in bytes.
+     */
+    uint64_t offset[3];
+    /**
+     * @brief source is file name of source csv file (without folder).
+     */
+    char source[144];
+};
+static_assert(sizeof(hbv_cache_header) == 256, "hbv_cache_header should be 256 bytes");
+/**
+ * @brief version of cache file written by this program.
+ */
+inline constexpr uint64_t hbv_cache_version = 2;
+/**
+ * @brief Get the FNV-1a 64 bit hash of data, it is used to record which csv file made the cache.
+ */
+inline uint64_t hbv_checksum(std::string_view data) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (char c : data) {
+        hash = (hash ^ static_cast<unsigned char>(c)) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+/**
+ * @brief Get last write time of a file as stored in hbv_cache_header::source_time.
+ * @throw std::filesystem::filesystem_error if the file doesn't exist
+ */
+inline int64_t hbv_write_time(const std::string &file) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::filesystem::last_write_time(file).time_since_epoch()).count();
+}
+/**
+ * @brief Get the default cache path of data file, which is data file path with ".hbvc" appended.
+ */
+inline std::string cachePath(const std::string &data_file) {
+    return data_file + ".hbvc";
+}
+/**
+ * @brief hbv_forcing stores Q, P and T of one dataset. The data is either read from a csv file
+ * into vectors, or mapped from a cache file with mmap so nothing is copied. getQ(), getP() and
+ * getT() give views that can be passed to hbv_model, hbv_calibrator and sampleParameters().
+ * The views are valid as long as the hbv_forcing object (moving it keeps them valid).
+ */
+class hbv_forcing {
+ public:
+      hbv_forcing() = default;
+      /**
+       * @brief Construct a new hbv forcing from vectors read from csv file.
+       */
+      hbv_forcing(std::vector<double> Q1, std::vector<double> P1, std::vector<double> T1,
+      const hbv_data_report &report1) {
+         data[0] = std::move(Q1);
+         data[1] = std::move(P1);
+         data[2] = std::move(T1);
+         for (uint64_t k = 0; k < 3; k++) {
+            series[k] = data[k];
+         }
+         report = report1;
+      }
+      hbv_forcing(const hbv_forcing &) = delete;
+      hbv_forcing &operator=(const hbv_forcing &) = delete;
+      hbv_forcing(hbv_forcing &&other) noexcept {
+         *this = std::move(other);
+      }
+      hbv_forcing &operator=(hbv_forcing &&other) noexcept {
+         if (this != &other) {
+            unmap();
+            // moving a vector keeps its buffer, so the views are still valid.
+            for (uint64_t k = 0; k < 3; k++) {
+               data[k] = std::move(other.data[k]);
+               series[k] = std::exchange(other.series[k], {});
+            }
+            report = other.report;
+            address = std::exchange(other.address, nullptr);
+            length = std::exchange(other.length, 0);
+         }
+         return *this;
+      }
+      ~hbv_forcing() {
+         unmap();
+      }
+      /**
+       * @brief Map a cache file written by convertData() into memory.
+       * @param cache_file path of cache file
+       * @return hbv_forcing views of mapped file
+       * @throw std::runtime_error if the file can't be opened or is not a valid cache file
+       */
+      static hbv_forcing map(const std::string &cache_file) {
+         HBV_PROFILE_SCOPE(open_files);
+         if constexpr (std::endian::native != std::endian::little) {
+            throw std::runtime_error("Cache file is only supported on little-endian machine");
+         }
+         int fd = ::open(cache_file.c_str(), O_RDONLY);
+         if (fd < 0) {
+            throw std::runtime_error("Can't Open " + cache_file);
+         }
+         struct stat status;
+         hbv_forcing forcing;
+         if (::fstat(fd, &status) == 0 && status.st_size >= static_cast<off_t>(sizeof(hbv_cache_header))) {
+            forcing.length = static_cast<uint64_t>(status.st_size);
+            void *address = ::mmap(nullptr, forcing.length, PROT_READ, MAP_PRIVATE, fd, 0);
+            forcing.address = (address == MAP_FAILED) ? nullptr : address;
+         }
+         ::close(fd);
+         const auto *header = static_cast<const hbv_cache_header *>(forcing.address);
+         if (header == nullptr || std::memcmp(header->magic, "HBVFRC01", 8) != 0
+            || header->version != hbv_cache_version) {
+            throw std::runtime_error(cache_file + " is not a cache file of this version");
+         }
+         for (uint64_t k = 0; k < 3; k++) {
+            if (header->offset[k] % alignof(double) != 0 || header->offset[k] > forcing.length
+               || header->records > (forcing.length - header->offset[k]) / sizeof(double)) {
+               throw std::runtime_error(cache_file + " is not complete");
+            }
+            forcing.series[k] = std::span<const double>(reinterpret_cast<const double *>(
+               static_cast<const char *>(forcing.address) + header->offset[k]), header->records);
+         }
+         forcing.report = {header->lines, header->records, header->skipped};
+         return forcing;
+      }
+      /**
+       * @brief getQ() will return view of Q (runoff/discharge).
+       */
+      std::span<const double> getQ() const {
+         return series[0];
+      }
+      /**
+       * @brief getP() will return view of P (precipitation).
+       */
+      std::span<const double> getP() const {
+         return series[1];
+      }
+      /**
+       * @brief getT() will return view of T (daily mean temperature).
+       */
+      std::span<const double> getT() const {
+         return series[2];
+      }
+      /**
+       * @brief size() will return number of days.
+       */
+      uint64_t size() const {
+         return series[0].size();
+      }
+      /**
+       * @brief getReport() will return lines, records and skipped lines of source csv file.
+       */
+      const hbv_data_report &getReport() const {
+         return report;
+      }
+      /**
+       * @brief isMapped() will return true if the data is mapped from a cache file.
+       */
+      bool isMapped() const {
+         return address != nullptr;
+      }
+      /**
+       * @brief Get the header of mapped cache file, nullptr if the data is read from csv file.
+       */
+      const hbv_cache_header *getHeader() const {
+         return static_cast<const hbv_cache_header *>(address);
+      }
+
+ private:
+      /**
+       * @brief data stores Q, P and T read from csv file, it is empty for a mapped file.
+       */
+      std::vector<double> data[3];
+      /**
+       * @brief series are views of Q, P and T.
+       */
+      std::span<const double> series[3];
+      /**
+       * @brief report is lines, records and skipped lines of source csv file.
+       */
+      hbv_data_report report;
+      /**
+       * @brief address and length of mapped file.
+       */
+      void *address = nullptr;
+      uint64_t length = 0;
+      /**
+       * @brief Unmap the file if it is mapped.
+       */
+      void unmap() {
+         if (address != nullptr) {
+            ::munmap(address, length);
+            address = nullptr;
+            length = 0;
+         }
+      }
+};
+/**
+ * @brief hbv_shared_forcing is a read-only forcing dataset shared by reference counting. Models built
+ * with it (see hbv_model_t) and other users keep views of the same data without copying it, and the data
+ * is released (or unmapped) when the last of them is gone.
+ */
+using hbv_shared_forcing = std::shared_ptr<const hbv_forcing>;
+/**
+ * @brief Move a forcing dataset into a hbv_shared_forcing, the data is not copied.
+ */
+inline hbv_shared_forcing shareForcing(hbv_forcing forcing) {
+    return std::make_shared<const hbv_forcing>(std::move(forcing));
+}
+/**
+ * @brief This function will read T, P and Q from data file and write them to a binary columnar
+ * cache file that can be mapped by hbv_forcing::map(). The file is written to a temporary file
+ * first and renamed, so a broken cache file is never left behind.
+ * @param data_file The path of data file(csv file or same format)
+ * @param columns column position of T, P and Q
+ * @param cache_file path of cache file
+ * @return hbv_data_report count of lines, records and skipped lines of data file
+ * @throw std::runtime_error if a file can't be opened or the data file is not correct
+ */
+inline hbv_data_report convertData(const std::string &data_file, const hbv_columns &columns,
+    const std::string &cache_file) {
+    // the time is read first, so a change of data file while it is read makes the cache out of date.
+    const int64_t source_time = hbv_write_time(data_file);
+    std::string buffer = readFile(data_file);
+    std::vector<double> series[3];
+    hbv_data_report report = parseData(buffer, columns, series[0], series[1], series[2]);
+    hbv_cache_header header = {};
+    std::memcpy(header.magic, "HBVFRC01", 8);
+    header.version = hbv_cache_version;
+    header.records = report.records;
+    header.T = columns.T;
+    header.P = columns.P;
+    header.Q = columns.Q;
+    header.lines = report.lines;
+    header.skipped = report.skipped;
+    header.source_size = buffer.size();
+    header.source_checksum = hbv_checksum(buffer);
+    header.source_time = source_time;
+    std::string name = std::filesystem::path(data_file).filename().string();
+    std::memcpy(header.source, name.data(), std::min(name.size(), sizeof(header.source) - 1));
+    // each series starts at a multiple of 64 bytes, so it is aligned for SIMD loads.
+    const uint64_t bytes = (report.records * sizeof(double) + 63) / 64 * 64;
+    for (uint64_t k = 0; k < 3; k++) {
+        header.offset[k] = sizeof(header) + k * bytes;
+    }
+    const std::string temp_file = cache_file + ".tmp";
+    {
+        std::ofstream output(temp_file, std::ios::binary);
+        if (!output.is_open()) {
+            throw std::runtime_error("Can't Open " + temp_file);
+        }
+        output.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        const std::vector<char> padding(bytes - report.records * sizeof(double), 0);
+        for (const auto &values : series) {
+            output.write(reinterpret_cast<const char *>(values.data()),
+                static_cast<std::streamsize>(values.size() * sizeof(double)));
+            output.write(padding.data(), static_cast<std::streamsize>(padding.size()));
+        }
+        if (!output) {
+            throw std::runtime_error("Can't write " + temp_file);
+        }
+    }
+    std::filesystem::rename(temp_file, cache_file);
+    return report;
+}
+/**
+ * @brief This function will load T, P and Q of data file. If data file is a cache file (".hbvc"),
+ * it is mapped directly. Otherwise, the cache file of data file is mapped if it was made with the same
+ * columns from a file of the same size and exactly the same last write time as data file now (a file
+ * restored with an older time, for example by "tar x", "rsync -t" or "cp -p", is not the same source);
+ * if not, the data file is read with readData().
+ * @param data_file The path of data file(csv file or cache file)
+ * @param columns column position of T, P and Q
+ * @param verify true to also read data file and compare its checksum with the cache file, which is
+ * slower but finds a changed data file whose size and time were kept
+ * @return hbv_forcing views of T, P and Q
+ * @throw std::runtime_error if the file can't be opened, the format is not correct or
+ * columns of the cache file are not the same as columns
+ */
+inline hbv_forcing loadForcing(const std::string &data_file, const hbv_columns &columns, bool verify = false) {
+    namespace fs = std::filesystem;
+    auto sameColumns = [&](const hbv_cache_header *header) {
+        return header->T == columns.T && header->P == columns.P && header->Q == columns.Q;
+    };
+    if (fs::path(data_file).extension() == ".hbvc") {
+        hbv_forcing forcing = hbv_forcing::map(data_file);
+        if (!sameColumns(forcing.getHeader())) {
+            throw std::runtime_error("Column position of " + data_file + " is not the same as parameters file");
+        }
+        return forcing;
+    }
+    const std::string cache_file = cachePath(data_file);
+    std::error_code error;
+    if (fs::exists(cache_file, error) && fs::exists(data_file, error)) {
+        try {
+            hbv_forcing forcing = hbv_forcing::map(cache_file);
+            const hbv_cache_header *header = forcing.getHeader();
+            if (sameColumns(header) && header->source_size == fs::file_size(data_file)
+                && header->source_time == hbv_write_time(data_file)
+                && (!verify || header->source_checksum == hbv_checksum(readFile(data_file)))) {
+                return forcing;
+            }
+        } catch (const std::exception &) {
+            // a broken or old cache file is ignored and the csv file is read again.
+        }
+    }
+    std::vector<double> Q, P, T;
+    hbv_data_report report = readData(data_file, columns, Q, P, T);
+    return hbv_forcing(std::move(Q), std::move(P), std::move(T), report);
+}
@@ -0,0 +1,643 @@
+// Copyright 2022 Tianshuo Li
+#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <limits>
+#include <optional>
+#include <random>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "hbv_metrics.hpp"
+#include "hbv_specialized.hpp"
+#include "hbv_parallel.hpp"
+#include "hbv_memo.hpp"
+#include "hbv_gradient.hpp"
+/**
+ * @brief hbv_calibration_options stores the options of hbv_calibrator.
+ */
+struct hbv_calibration_options {
+    /**
+     * @brief method is "sceua" (Shuffled Complex Evolution), "dds" (Dynamically Dimensioned Search) or
+     * "lbfgsb" (L-BFGS-B with gradient by automatic differentiation, only for NSE).
+     */
+    std::string method = "sceua";
+    /**
+     * @brief objective is the name of metric in hbv_metric_table that is maximized, it should be an
+     * efficiency (NSE, KGE or logNSE).
+     */
+    std::string objective = "NSE";
+    /**
+     * @brief evaluations is the maximum number of model runs.
+     */
+    uint64_t evaluations = 20000;
+    /**
+     * @brief complexes is number of complexes of SCE-UA, they are evolved in parallel.
+     */
+    uint64_t complexes = std::max<uint64_t>(2, hbv_threads());
+    /**
+     * @brief batch is number of candidates tried together in each loop of DDS.
+     */
+    uint64_t batch = 8;
+    /**
+     * @brief seed of random number. Same seed and options give same result whatever the number of threads.
+     */
+    uint64_t seed = 1;
+    /**
+     * @brief threads is number of threads used to run model.
+     */
+    uint64_t threads = hbv_threads();
+    /**
+     * @brief SCE-UA will stop when range of population is less than tolerance of range of bounds.
+     */
+    double tolerance = 1e-3;
+    /**
+     * @brief starts is number of start points of L-BFGS-B, they are searched in parallel. The first is the
+     * given parameters and the others are random points.
+     */
+    uint64_t starts = 4;
+    /**
+     * @brief smoothing is the width of smoothing of thresholds used by L-BFGS-B (see hbv_smooth_step()),
+     * 0 for the model without smoothing.
+     */
+    double smoothing = 0;
+    /**
+     * @brief memo stores objective values of parameters already run (for example by a calibration stopped
+     * before), it should be opened with the same dataset and objective. It is not used when it is nullptr.
+     */
+    hbv_memo *memo = nullptr;
+};
+/**
+ * @brief hbv_calibration_log stores the state of one loop of calibration.
+ */
+struct hbv_calibration_log {
+    uint64_t loop, evaluations;
+    double best, worst;
+};
+/**
+ * @brief hbv_calibrator will search the first 11 parameters in hbv_bounds that give
+ * the highest NSE value. Other parameters (initial storages and area) are kept as given.
+ */
+class hbv_calibrator {
+ public:
+      /**
+       * @brief Construct a new hbv calibrator
+       * @param Q1 discharge given by dataset
+       * @param P1 precipitation given by dataset
+       * @param T1 daily mean temperature given by dataset
+       * @param parameters1 parameters vector, it is used as start point and the last 5 values are kept
+       * @param options1 options of calibration
+       */
+      hbv_calibrator(std::span<const double> Q1, std::span<const double> P1, std::span<const double> T1,
+      const std::vector<double> &parameters1, const hbv_calibration_options &options1) {
+         Q = Q1;
+         P = P1;
+         T = T1;
+         base = parameters1;
+         options = options1;
+         metric = &findMetric(options.objective);
+         if (!metric->efficiency) {
+            throw std::invalid_argument("Objective of calibration should be NSE, KGE or logNSE");
+         }
+         averageQ = hbv_average_q(Q);
+         minT = hbv_min_t(T);
+      }
+      /**
+       * @brief run() will run calibration with chosen method.
+       * @return std::vector<double> best parameters vector
+       * @throw std::invalid_argument if method is unknown
+       */
+      std::vector<double> run() {
+         evaluations = 0;
+         log.clear();
+         if (options.method == "sceua") {
+            runSCE();
+         } else if (options.method == "dds") {
+            runDDS();
+         } else if (options.method == "lbfgsb") {
+            runLBFGSB();
+         } else {
+            throw std::invalid_argument("Unknown calibration method " + options.method);
+         }
+         return toVector(best.x);
+      }
+      /**
+       * @brief getNSE() will return value of objective (NSE by default) of best parameters.
+       */
+      double getNSE() {
+         return 1 - best.f;
+      }
+      /**
+       * @brief getEvaluations() will return number of model runs.
+       */
+      uint64_t getEvaluations() {
+         return evaluations;
+      }
+      /**
+       * @brief getLog() will return state of each loop.
+       */
+      const std::vector<hbv_calibration_log> &getLog() {
+         return log;
+      }
+      /**
+       * @brief writeLog() will write state of each loop to a csv file.
+       * @param path path of log file
+       * @throw std::runtime_error if the file can't be opened
+       */
+      void writeLog(const std::string &path) {
+         std::ofstream output(path);
+         if (!output.is_open()) {
+            throw std::runtime_error("Can't Open " + path);
+         }
+         output << "Loop,Evaluations,Best " << metric->name << ",Worst " << metric->name << "\n";
+         output.precision(10);
+         for (const auto &l : log) {
+            output << l.loop << "," << l.evaluations << "," << l.best << "," << l.worst << "\n";
+         }
+      }
+
+ private:
+      /**
+       * @brief n is number of calibrated parameters.
+       */
+      static constexpr uint64_t n = hbv_bounds.size();
+      /**
+       * @brief point stores calibrated parameters x and objective value f (1 - NSE by default).
+       */
+      struct point {
+         std::array<double, n> x;
+         double f;
+         bool operator<(const point &other) const {
+            return f < other.f;
+         }
+      };
+      /**
+       * @brief Q, P, T are discharge, precipitation and daily mean temperature given by dataset.
+       */
+      std::span<const double> Q, P, T;
+      /**
+       * @brief base is the given parameters vector.
+       */
+      std::vector<double> base;
+      /**
+       * @brief options of calibration.
+       */
+      hbv_calibration_options options;
+      /**
+       * @brief averageQ is average value of Q, it is calculated once for all model runs.
+       */
+      double averageQ;
+      /**
+       * @brief metric is the objective of calibration.
+       */
+      const hbv_metric *metric;
+      /**
+       * @brief minT is minimum of T, it is used to choose the kernel of hbv_evaluate_fast().
+       */
+      double minT;
+      /**
+       * @brief evaluations is number of model runs, it is counted by all threads.
+       */
+      std::atomic<uint64_t> evaluations;
+      /**
+       * @brief log stores state of each loop.
+       */
+      std::vector<hbv_calibration_log> log;
+      /**
+       * @brief best is the best point found.
+       */
+      point best;
+      /**
+       * @brief Build parameters vector with calibrated parameters and kept parameters.
+       */
+      std::vector<double> toVector(const std::array<double, n> &x) {
+         std::vector<double> parameters = base;
+         std::copy(x.begin(), x.end(), parameters.begin());
+         return parameters;
+      }
+      /**
+       * @brief Run model and return 1 - objective (1 - NSE by default). NaN is changed to infinity so it
+       * is always the worst. Other metrics than NSE are calculated together by hbv_evaluate_metrics().
+       * A value found in memo is counted as a model run, so the search is the same with or without memo.
+       */
+      double objective(const std::array<double, n> &x) {
+         hbv_parameters p = hbv_parameters::fromVector(toVector(x));
+         std::optional<double> cached = options.memo ? options.memo->find(p) : std::nullopt;
+         double value = 0;
+         if (cached) {
+            value = *cached;
+         } else {
+            value = (metric == &hbv_metric_table[0]) ? hbv_evaluate_fast(p, Q, P, T, averageQ, minT).NSE
+               : (hbv_evaluate_metrics(p, Q, P, T).*metric->value)();
+            if (options.memo) {
+               options.memo->insert(p, value);
+            }
+         }
+         evaluations++;
+         return std::isnan(value) ? std::numeric_limits<double>::infinity() : 1 - value;
+      }
+      /**
+       * @brief Get start point from given parameters, value out of range is moved to bounds.
+       */
+      std::array<double, n> start() {
+         std::array<double, n> x;
+         for (uint64_t d = 0; d < n; d++) {
+            x[d] = std::clamp(base[d], hbv_bounds[d].low, hbv_bounds[d].high);
+         }
+         return x;
+      }
+      /**
+       * @brief Get a uniform random point in box [low, high].
+       */
+      static std::array<double, n> randomPoint(std::mt19937_64 &rng, const std::array<double, n> &low,
+      const std::array<double, n> &high) {
+         std::array<double, n> x;
+         for (uint64_t d = 0; d < n; d++) {
+            x[d] = std::uniform_real_distribution<double>(low[d], high[d])(rng);
+         }
+         return x;
+      }
+      /**
+       * @brief Run Shuffled Complex Evolution (SCE-UA, Duan et al. 1994). Each complex
+       * has 2n+1 points and is evolved by its own thread with its own random number.
+       */
+      void runSCE() {
+         const uint64_t p = std::max<uint64_t>(1, options.complexes);
+         const uint64_t m = 2 * n + 1;
+         std::array<double, n> low, high;
+         for (uint64_t d = 0; d < n; d++) {
+            low[d] = hbv_bounds[d].low;
+            high[d] = hbv_bounds[d].high;
+         }
+         std::vector<point> population(p * m);
+         std::mt19937_64 rng(hbv_seed(options.seed, 0));
+         for (uint64_t i = 0; i < population.size(); i++) {
+            population[i].x = (i == 0) ? start() : randomPoint(rng, low, high);
+         }
+         parallel_for(population.size(), options.threads, [&](uint64_t i, uint64_t) {
+            population[i].f = objective(population[i].x);
+         });
+         std::sort(population.begin(), population.end());
+         log.push_back({0, evaluations, 1 - population.front().f, 1 - population.back().f});
+         for (uint64_t loop = 1; evaluations < options.evaluations; loop++) {
+            std::vector<std::vector<point>> complex(p);
+            for (uint64_t i = 0; i < population.size(); i++) {
+               complex[i % p].push_back(population[i]);
+            }
+            parallel_for(p, options.threads, [&](uint64_t k, uint64_t) {
+               std::mt19937_64 rng_k(hbv_seed(options.seed, loop * p + k + 1));
+               evolve(complex[k], rng_k);
+            });
+            population.clear();
+            for (const auto &c : complex) {
+               population.insert(population.end(), c.begin(), c.end());
+            }
+            std::sort(population.begin(), population.end());
+            log.push_back({loop, evaluations, 1 - population.front().f, 1 - population.back().f});
+            // stop when the population shrinks to a point, range is measured as geometric mean
+            // of range of each parameter divided by width of its bounds.
+            double range = 0;
+            for (uint64_t d = 0; d < n; d++) {
+               auto [first, last] = std::minmax_element(population.begin(), population.end(),
+                  [d](const point &a, const point &b) { return a.x[d] < b.x[d]; });
+               range += std::log(std::max(last->x[d] - first->x[d], 1e-300) / (high[d] - low[d])) / n;
+            }
+            if (std::exp(range) < options.tolerance) {
+               break;
+            }
+         }
+         best = population.front();
+      }
+      /**
+       * @brief Competitive Complex Evolution step of SCE-UA. Worst point of a sub-complex is
+       * reflected or contracted through centroid of the others, or replaced by a random point.
+       * @param c complex sorted from best to worst
+       */
+      void evolve(std::vector<point> &c, std::mt19937_64 &rng) {
+         const uint64_t m = c.size();
+         const uint64_t q = n + 1;
+         // trapezoidal probability, better point has higher chance to be chosen.
+         std::vector<double> weight(m);
+         for (uint64_t j = 0; j < m; j++) {
+            weight[j] = static_cast<double>(m - j);
+         }
+         for (uint64_t step = 0; step < 2 * n + 1; step++) {
+            std::vector<uint64_t> chosen;
+            std::vector<double> w = weight;
+            while (chosen.size() < q) {
+               uint64_t j = std::discrete_distribution<uint64_t>(w.begin(), w.end())(rng);
+               w[j] = 0;
+               chosen.push_back(j);
+            }
+            std::sort(chosen.begin(), chosen.end());
+            point &worst = c[chosen.back()];
+            std::array<double, n> g{}, r, low, high;
+            for (uint64_t d = 0; d < n; d++) {
+               for (uint64_t j = 0; j + 1 < q; j++) {
+                  g[d] += c[chosen[j]].x[d] / static_cast<double>(q - 1);
+               }
+               low[d] = high[d] = c[0].x[d];
+               for (const auto &pt : c) {
+                  low[d] = std::min(low[d], pt.x[d]);
+                  high[d] = std::max(high[d], pt.x[d]);
+               }
+            }
+            bool inside = true;
+            for (uint64_t d = 0; d < n; d++) {
+               r[d] = 2 * g[d] - worst.x[d];
+               inside = inside && hbv_parameters::inRange(r[d], hbv_bounds[d].low, hbv_bounds[d].high);
+            }
+            if (!inside) {
+               r = randomPoint(rng, low, high);
+            }
+            double fr = objective(r);
+            if (fr < worst.f) {
+               worst = {r, fr};
+            } else {
+               for (uint64_t d = 0; d < n; d++) {
+                  r[d] = (g[d] + worst.x[d]) / 2;
+               }
+               fr = objective(r);
+               if (fr < worst.f) {
+                  worst = {r, fr};
+               } else {
+                  r = randomPoint(rng, low, high);
+                  worst = {r, objective(r)};
+               }
+            }
+            std::sort(c.begin(), c.end());
+         }
+      }
+      /**
+       * @brief Run Dynamically Dimensioned Search (DDS, Tolson and Shoemaker 2007). Each loop
+       * tries a batch of candidates around the best point in parallel. The chance to change each
+       * parameter becomes smaller when more model runs are used.
+       */
+      void runDDS() {
+         const double r = 0.2;
+         const uint64_t c = std::max<uint64_t>(1, options.batch);
+         best.x = start();
+         best.f = objective(best.x);
+         log.push_back({0, evaluations, 1 - best.f, 1 - best.f});
+         std::vector<point> candidate(c);
+         for (uint64_t loop = 1; evaluations < options.evaluations; loop++) {
+            const uint64_t done = evaluations;
+            parallel_for(c, options.threads, [&](uint64_t j, uint64_t) {
+               std::mt19937_64 rng(hbv_seed(options.seed, done + j + 1));
+               double chance = 1 - std::log(static_cast<double>(done + j + 1))
+                  / std::log(static_cast<double>(std::max<uint64_t>(2, options.evaluations)));
+               std::array<double, n> x = best.x;
+               bool changed = false;
+               std::normal_distribution<double> normal(0, 1);
+               std::uniform_real_distribution<double> uniform(0, 1);
+               for (uint64_t d = 0; d < n; d++) {
+                  if (uniform(rng) < chance) {
+                     x[d] = perturb(x[d], d, r, normal(rng));
+                     changed = true;
+                  }
+               }
+               if (!changed) {
+                  uint64_t d = std::uniform_int_distribution<uint64_t>(0, n - 1)(rng);
+                  x[d] = perturb(x[d], d, r, normal(rng));
+               }
+               candidate[j] = {x, objective(x)};
+            });
+            auto [first, last] = std::minmax_element(candidate.begin(), candidate.end());
+            double worst = last->f;
+            if (first->f <= best.f) {
+               best = *first;
+            }
+            log.push_back({loop, evaluations, 1 - best.f, 1 - worst});
+         }
+      }
+      /**
+       * @brief Run projected L-BFGS (L-BFGS-B, Byrd et al. 1995) from options.starts start points in parallel,
+       * each with its share of options.evaluations. NSE and its gradient are given by hbv_evaluate_gradient()
+       * in one model run, which is counted as one model run. Parameters are scaled to [0, 1] by their bounds,
+       * so every step is clamped into the range checked by checkRange().
+       * Best point of each start is run again without smoothing and the best of them is kept, the log has
+       * the loops of each start one after another so it does not depend on the number of threads.
+       * @throw std::invalid_argument if objective is not NSE
+       */
+      void runLBFGSB() {
+         if (metric != &hbv_metric_table[0]) {
+            throw std::invalid_argument("Objective of lbfgsb should be NSE");
+         }
+         const uint64_t starts = std::max<uint64_t>(1, options.starts);
+         const uint64_t budget = std::max<uint64_t>(2, options.evaluations / starts);
+         std::array<double, n> low, high;
+         for (uint64_t d = 0; d < n; d++) {
+            low[d] = hbv_bounds[d].low;
+            high[d] = hbv_bounds[d].high;
+         }
+         std::vector<point> result(starts);
+         std::vector<std::vector<hbv_calibration_log>> logs(starts);
+         parallel_for(starts, options.threads, [&](uint64_t k, uint64_t) {
+            std::mt19937_64 rng(hbv_seed(options.seed, k));
+            result[k] = descend((k == 0) ? start() : randomPoint(rng, low, high), budget, logs[k]);
+         });
+         best = *std::min_element(result.begin(), result.end());
+         uint64_t loop = 0, used = 0;
+         for (const auto &l : logs) {
+            for (auto entry : l) {
+               entry.loop = loop++;
+               entry.evaluations += used;
+               log.push_back(entry);
+            }
+            used += l.empty() ? 0 : l.back().evaluations;
+         }
+      }
+      /**
+       * @brief Search from x0 with projected L-BFGS until the projected gradient or the change of objective
+       * is very small, the line search fails, or budget model runs are used.
+       * @param x0 start point
+       * @param budget maximum number of model runs
+       * @param l log of this start, its evaluations count from this start and the last loop is the run
+       * without smoothing
+       * @return point the best point, its objective is calculated without smoothing
+       */
+      point descend(const std::array<double, n> &x0, uint64_t budget, std::vector<hbv_calibration_log> &l) {
+         using vector = std::array<double, n>;
+         const uint64_t memory = 8;
+         uint64_t used = 0;
+         auto dot = [](const vector &a, const vector &b) {
+            double sum = 0;
+            for (uint64_t d = 0; d < n; d++) {
+               sum += a[d] * b[d];
+            }
+            return sum;
+         };
+         // objective and its gradient at u (scaled to [0, 1])
+         auto evaluate = [&](const vector &u, vector &g) {
+            vector x;
+            for (uint64_t d = 0; d < n; d++) {
+               x[d] = hbv_bounds[d].low + u[d] * (hbv_bounds[d].high - hbv_bounds[d].low);
+            }
+            const hbv_gradient result = hbv_evaluate_gradient(hbv_parameters::fromVector(toVector(x)), Q, P, T,
+               options.smoothing);
+            used++;
+            evaluations++;
+            for (uint64_t d = 0; d < n; d++) {
+               g[d] = -result.gradient[d] * (hbv_bounds[d].high - hbv_bounds[d].low);
+            }
+            const bool finite = std::isfinite(result.NSE) && std::all_of(g.begin(), g.end(),
+               [](double v) { return std::isfinite(v); });
+            return finite ? 1 - result.NSE : std::numeric_limits<double>::infinity();
+         };
+         vector u, g;
+         for (uint64_t d = 0; d < n; d++) {
+            u[d] = (x0[d] - hbv_bounds[d].low) / (hbv_bounds[d].high - hbv_bounds[d].low);
+         }
+         double f = evaluate(u, g);
+         l.push_back({0, used, 1 - f, 1 - f});
+         std::vector<vector> S, Y;
+         for (uint64_t loop = 1; used < budget && std::isfinite(f); loop++) {
+            // variables at a bound with gradient pointing out of range are fixed in this loop
+            std::array<bool, n> free;
+            double norm = 0;
+            for (uint64_t d = 0; d < n; d++) {
+               free[d] = !((u[d] <= 0 && g[d] > 0) || (u[d] >= 1 && g[d] < 0));
+               norm = std::max(norm, free[d] ? std::abs(g[d]) : 0.0);
+            }
+            if (norm < 1e-8) {
+               break;
+            }
+            // two-loop recursion of L-BFGS on free variables
+            vector q;
+            for (uint64_t d = 0; d < n; d++) {
+               q[d] = free[d] ? g[d] : 0;
+            }
+            auto masked = [&](const vector &a, const vector &b) {
+               double sum = 0;
+               for (uint64_t d = 0; d < n; d++) {
+                  sum += free[d] ? a[d] * b[d] : 0;
+               }
+               return sum;
+            };
+            std::vector<double> alpha(S.size());
+            double scale = 1;
+            for (uint64_t j = S.size(); j-- > 0;) {
+               const double sy = masked(S[j], Y[j]);
+               if (sy <= 1e-12) {
+                  continue;
+               }
+               alpha[j] = masked(S[j], q) / sy;
+               for (uint64_t d = 0; d < n; d++) {
+                  q[d] -= free[d] ? alpha[j] * Y[j][d] : 0;
+               }
+            }
+            if (!S.empty() && masked(S.back(), Y.back()) > 1e-12) {
+               scale = masked(S.back(), Y.back()) / masked(Y.back(), Y.back());
+            }
+            for (uint64_t d = 0; d < n; d++) {
+               q[d] *= scale;
+            }
+            for (uint64_t j = 0; j < S.size(); j++) {
+               const double sy = masked(S[j], Y[j]);
+               if (sy <= 1e-12) {
+                  continue;
+               }
+               const double beta = masked(Y[j], q) / sy;
+               for (uint64_t d = 0; d < n; d++) {
+                  q[d] += free[d] ? (alpha[j] - beta) * S[j][d] : 0;
+               }
+            }
+            vector direction;
+            for (uint64_t d = 0; d < n; d++) {
+               direction[d] = free[d] ? -q[d] : 0;
+            }
+            if (dot(direction, g) >= 0) {
+               // not a descent direction, memory is dropped and steepest descent is used
+               S.clear();
+               Y.clear();
+               for (uint64_t d = 0; d < n; d++) {
+                  direction[d] = free[d] ? -g[d] : 0;
+               }
+            }
+            // first step of steepest descent moves at most 0.1 of range
+            double step = 1;
+            if (S.empty()) {
+               double longest = 0;
+               for (uint64_t d = 0; d < n; d++) {
+                  longest = std::max(longest, std::abs(direction[d]));
+               }
+               step = std::min(1.0, 0.1 / longest);
+            }
+            // projected backtracking line search with Armijo condition
+            vector u1, g1;
+            double f1 = f;
+            bool accepted = false;
+            for (uint64_t trial = 0; trial < 30 && used < budget; trial++, step /= 2) {
+               for (uint64_t d = 0; d < n; d++) {
+                  u1[d] = std::clamp(u[d] + step * direction[d], 0.0, 1.0);
+               }
+               vector s;
+               for (uint64_t d = 0; d < n; d++) {
+                  s[d] = u1[d] - u[d];
+               }
+               f1 = evaluate(u1, g1);
+               if (f1 <= f + 1e-4 * dot(g, s)) {
+                  accepted = true;
+                  break;
+               }
+            }
+            if (!accepted) {
+               break;
+            }
+            vector s, y;
+            for (uint64_t d = 0; d < n; d++) {
+               s[d] = u1[d] - u[d];
+               y[d] = g1[d] - g[d];
+            }
+            if (dot(s, y) > 1e-12) {
+               S.push_back(s);
+               Y.push_back(y);
+               if (S.size() > memory) {
+                  S.erase(S.begin());
+                  Y.erase(Y.begin());
+               }
+            }
+            const double change = f - f1;
+            u = u1;
+            g = g1;
+            f = f1;
+            l.push_back({loop, used, 1 - f, 1 - f});
+            if (change <= 1e-10 * (1 + std::abs(f))) {
+               break;
+            }
+         }
+         point result;
+         for (uint64_t d = 0; d < n; d++) {
+            result.x[d] = std::clamp(hbv_bounds[d].low + u[d] * (hbv_bounds[d].high - hbv_bounds[d].low),
+               hbv_bounds[d].low, hbv_bounds[d].high);
+         }
+         result.f = objective(result.x);
+         used++;
+         l.push_back({l.size(), used, 1 - result.f, 1 - result.f});
+         return result;
+      }
+      /**
+       * @brief Move value with a normal step and reflect it at bounds.
+       */
+      static double perturb(double value, uint64_t d, double r, double z) {
+         const double low = hbv_bounds[d].low, high = hbv_bounds[d].high;
+         double x = value + r * (high - low) * z;
+         if (x < low) {
+            x = low + (low - x);
+            if (x > high) {
+               x = low;
+            }
+         } else if (x > high) {
+            x = high - (x - high);
+            if (x < low) {
+               x = high;
+            }
+         }
+         return x;
+      }
+};
@@ -0,0 +1,126 @@
+// Copyright 2022 Tianshuo Li
+#pragma once
+#include <bit>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "hbv_kernel.hpp"
+#include "hbv_incremental.hpp"
+#include "hbv_cache.hpp"
+/**
+ * @brief version of checkpoint file written by this program.
+ */
+inline constexpr uint64_t hbv_checkpoint_version = 1;
+/**
+ * @brief number of values in checkpoint file.
+ */
+inline constexpr uint64_t hbv_checkpoint_values = 26;
+/**
+ * @brief Get the values saved in checkpoint in order of file, doubles are saved by their bits so
+ * they are restored exactly.
+ * @param model model to save
+ * @return std::vector<uint64_t> 16 parameters, SD, SM, SUZ, SLZ, day, days, count, SSE, mean and M2
+ * (hbv_checkpoint_values in total)
+ */
+inline std::vector<uint64_t> checkpointValues(const hbv_incremental &model) {
+    std::vector<uint64_t> values;
+    hbv_parameters par = model.getParameters();
+    for (uint64_t i = 0; i < 16; i++) {
+        values.push_back(std::bit_cast<uint64_t>(par[i]));
+    }
+    const hbv_state &state = model.getState();
+    for (double value : {state.SD, state.SM, state.SUZ, state.SLZ}) {
+        values.push_back(std::bit_cast<uint64_t>(value));
+    }
+    values.push_back(state.day);
+    const hbv_running_nse &nse = model.getRunningNSE();
+    values.push_back(nse.days);
+    values.push_back(nse.count);
+    for (double value : {nse.SSE, nse.mean, nse.M2}) {
+        values.push_back(std::bit_cast<uint64_t>(value));
+    }
+    return values;
+}
+/**
+ * @brief This function will save parameters, storages and running NSE of model to a checkpoint file.
+ * The file is "HBVCKPT1", version, number of values, the values given by checkpointValues() and
+ * FNV-1a checksum of the values, all as little-endian uint64. It is written to checkpoint_file + ".tmp"
+ * and renamed, so an old checkpoint is replaced at once and is kept if the new one can't be written.
+ * @param checkpoint_file path of checkpoint file
+ * @param model model to save
+ * @throw std::runtime_error if the file can't be opened
+ */
+inline void saveCheckpoint(const std::string &checkpoint_file, const hbv_incremental &model) {
+    if constexpr (std::endian::native != std::endian::little) {
+        throw std::runtime_error("Checkpoint file is only supported on little-endian machine");
+    }
+    std::vector<uint64_t> values = checkpointValues(model);
+    const std::string_view bytes(reinterpret_cast<const char *>(values.data()), values.size() * sizeof(uint64_t));
+    const uint64_t header[2] = {hbv_checkpoint_version, values.size()};
+    const uint64_t checksum = hbv_checksum(bytes);
+    const std::string temp_file = checkpoint_file + ".tmp";
+    {
+        std::ofstream output(temp_file, std::ios::binary);
+        if (!output.is_open()) {
+            throw std::runtime_error("Can't Open " + temp_file);
+        }
+        output.write("HBVCKPT1", 8);
+        output.write(reinterpret_cast<const char *>(header), sizeof(header));
+        output.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+        output.write(reinterpret_cast<const char *>(&checksum), sizeof(checksum));
+        output.close();
+        if (!output) {
+            std::remove(temp_file.c_str());
+            throw std::runtime_error("Can't write " + temp_file);
+        }
+    }
+    std::filesystem::rename(temp_file, checkpoint_file);
+}
+/**
+ * @brief This function will load a checkpoint file written by saveCheckpoint(). Calling step() of
+ * the loaded model gives exactly the same value as the model that was saved.
+ * @param checkpoint_file path of checkpoint file
+ * @return hbv_incremental model at the day of checkpoint
+ * @throw std::runtime_error if the file can't be opened, version is different or it is broken
+ */
+inline hbv_incremental loadCheckpoint(const std::string &checkpoint_file) {
+    if constexpr (std::endian::native != std::endian::little) {
+        throw std::runtime_error("Checkpoint file is only supported on little-endian machine");
+    }
+    std::string buffer = readFile(checkpoint_file);
+    const uint64_t count = hbv_checkpoint_values;
+    uint64_t header[2] = {0, 0}, checksum = 0;
+    if (buffer.size() >= 8 + sizeof(header)) {
+        std::memcpy(header, buffer.data() + 8, sizeof(header));
+    }
+    if (buffer.compare(0, 8, "HBVCKPT1") != 0 || header[0] != hbv_checkpoint_version || header[1] != count
+        || buffer.size() != 8 + sizeof(header) + (count + 1) * sizeof(uint64_t)) {
+        throw std::runtime_error(checkpoint_file + " is not a checkpoint file of this version");
+    }
+    std::vector<uint64_t> values(count);
+    const char *data = buffer.data() + 8 + sizeof(header);
+    std::memcpy(values.data(), data, count * sizeof(uint64_t));
+    std::memcpy(&checksum, data + count * sizeof(uint64_t), sizeof(checksum));
+    if (checksum != hbv_checksum(std::string_view(data, count * sizeof(uint64_t)))) {
+        throw std::runtime_error(checkpoint_file + " is broken (checksum is not correct)");
+    }
+    auto number = [&](uint64_t i) { return std::bit_cast<double>(values[i]); };
+    hbv_parameters par;
+    for (uint64_t i = 0; i < 16; i++) {
+        par[i] = number(i);
+    }
+    hbv_state state = {number(16), number(17), number(18), number(19), values[20]};
+    hbv_running_nse nse;
+    nse.days = values[21];
+    nse.count = values[22];
+    nse.SSE = number(23);
+    nse.mean = number(24);
+    nse.M2 = number(25);
+    return hbv_incremental(par, state, nse);
+}
@@ -0,0 +1,307 @@
+// Copyright 2022 Tianshuo Li
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <span>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "hbv_kernel.hpp"
+#include "hbv_parallel.hpp"
+#include "hbv_io.hpp"
+#include "hbv_metrics.hpp"
+/**
+ * @brief hbv_ensemble will run many forcing members (for example perturbed P and T of a forecast)
+ * with the same parameters from the same state. Storages of members are stored as one vector for
+ * each storage (structure of arrays) and members in a tile of 64 are calculated together with
+ * hbv_lane_step(), so the loops over members can be vectorized by compiler as hbv_batch. Value of each member is exactly
+ * the same as hbv_incremental::step() with the same forcing.
+ */
+class hbv_ensemble {
+ public:
+      /**
+       * @brief tile is the number of members calculated together.
+       */
+      static constexpr uint64_t tile = 64;
+      /**
+       * @brief Construct a new hbv ensemble, all members start from the same state.
+       * @param par1 parameters of model, range should be checked before
+       * @param state1 state shared by all members (for example given by a checkpoint file)
+       * @param members1 number of members
+       */
+      hbv_ensemble(const hbv_parameters &par1, const hbv_state &state1, uint64_t members1) {
+         par = par1;
+         day = state1.day;
+         members = members1;
+         const uint64_t padded = (members + tile - 1) / tile * tile;
+         SD.assign(padded, state1.SD);
+         SM.assign(padded, state1.SM);
+         SUZ.assign(padded, state1.SUZ);
+         SLZ.assign(padded, state1.SLZ);
+      }
+      /**
+       * @brief size() will return number of members.
+       */
+      uint64_t size() const {
+         return members;
+      }
+      /**
+       * @brief getDay() will return number of days already calculated (same for all members).
+       */
+      uint64_t getDay() const {
+         return day;
+      }
+      /**
+       * @brief Get the state of one member.
+       */
+      hbv_state getState(uint64_t m) const {
+         return {SD[m], SM[m], SUZ[m], SLZ[m], day};
+      }
+      /**
+       * @brief Calculate members in tile starting from member b for days [first, first+count) of
+       * forcing and write runoff to Qt[d * size() + m] for d in [0, count). Different tiles can be
+       * run by different threads, but all tiles should be run before advance(count) is called.
+       * @param P precipitation of all members, member-major (P[m * days + d])
+       * @param T daily mean temperature of all members, same order as P
+       * @param days number of days of each member in P and T
+       * @param first first day of forcing to calculate
+       * @param count number of days to calculate
+       * @param b first member of tile, a multiple of tile
+       * @param Qt runoff of each day and member, NaN on the first day of model
+       */
+      void runTile(std::span<const double> P, std::span<const double> T, uint64_t days, uint64_t first,
+      uint64_t count, uint64_t b, double *Qt) {
+         // parameters are copied to a local variable, so compiler knows they are not changed below.
+         const hbv_parameters p = par;
+         const uint64_t lanes = std::min(tile, members - b);
+         double sd[tile], sm[tile], suz[tile], slz[tile], Pi[tile], Ti[tile], powSM[tile], qt[tile];
+         std::copy(&SD[b], &SD[b] + tile, sd);
+         std::copy(&SM[b], &SM[b] + tile, sm);
+         std::copy(&SUZ[b], &SUZ[b] + tile, suz);
+         std::copy(&SLZ[b], &SLZ[b] + tile, slz);
+         // Every member of one day, n is the number of days calculated before that day and it is given
+         // as a constant (0 or not 0) at each call so the loop has no control flow.
+         auto runDay = [&](uint64_t n) {
+            for (uint64_t l = 0; l < tile; l++) {
+               hbv_state s{sd[l], sm[l], suz[l], slz[l], n};
+               qt[l] = hbv_lane_step(p, s, Pi[l], Ti[l], powSM[l]);
+               sd[l] = s.SD;
+               sm[l] = s.SM;
+               suz[l] = s.SUZ;
+               slz[l] = s.SLZ;
+            }
+         };
+         for (uint64_t d = 0; d < count; d++) {
+            // padding lanes use forcing of the last member, their result is not written.
+            for (uint64_t l = 0; l < tile; l++) {
+               const uint64_t m = b + std::min(l, lanes - 1);
+               Pi[l] = P[m * days + first + d];
+               Ti[l] = T[m * days + first + d];
+            }
+            const uint64_t n = day + d;
+            if (n == 0) {
+               // The first day only calculates snow part, pow is not used.
+               std::fill(powSM, powSM + tile, 0.0);
+               runDay(0);
+            } else {
+               // pow has no vector version that gives the same value, so it stays in its own loop.
+               for (uint64_t l = 0; l < tile; l++) {
+                  powSM[l] = pow(sm[l] / p.FC, p.beta);
+               }
+               runDay(n);
+            }
+            std::copy(qt, qt + lanes, Qt + d * members + b);
+         }
+         std::copy(sd, sd + tile, &SD[b]);
+         std::copy(sm, sm + tile, &SM[b]);
+         std::copy(suz, suz + tile, &SUZ[b]);
+         std::copy(slz, slz + tile, &SLZ[b]);
+      }
+      /**
+       * @brief Move day counter after all tiles calculated count days.
+       */
+      void advance(uint64_t count) {
+         day += count;
+      }
+      /**
+       * @brief Get runoff in area from runoff, the same equation as hbv_step().
+       */
+      double area(double Qt) const {
+         return (Qt * 0.001) * par.A;
+      }
+
+ private:
+      /**
+       * @brief par stores parameters shared by all members.
+       */
+      hbv_parameters par;
+      /**
+       * @brief day is number of days already calculated and members is number of members.
+       */
+      uint64_t day, members;
+      /**
+       * @brief storages of each member, padded to a multiple of tile.
+       */
+      std::vector<double> SD, SM, SUZ, SLZ;
+};
+/**
+ * @brief This function will read forcing of ensemble members. The first line is header and each
+ * other line is "member,P,T". Lines of one member should be together and in order of days, and
+ * every member should have the same number of days.
+ * @param forcing_file path of forcing file
+ * @param P precipitation of all members, member-major
+ * @param T daily mean temperature of all members, member-major
+ * @param members number of members
+ * @return uint64_t number of days of each member
+ * @throw std::runtime_error if the file can't be opened or the format is not correct
+ */
+inline uint64_t readEnsemble(const std::string &forcing_file, std::vector<double> &P, std::vector<double> &T,
+    uint64_t &members) {
+    std::string buffer = readFile(forcing_file);
+    const char *begin = buffer.data(), *end = buffer.data() + buffer.size();
+    std::vector<uint64_t> sizes;  // sizes stores number of days of each member
+    double last = std::nan(""), value[3];
+    P.clear();
+    T.clear();
+    for (uint64_t line = 1; begin < end; line++) {
+        const char *line_end = std::find(begin, end, '\n');
+        const char *cell = begin;
+        uint64_t k = 0;
+        for (; line > 1 && k < 3 && cell <= line_end; k++) {
+            const char *next = std::find(cell, line_end, ',');
+            if (!parseCell(cell, next, value[k])) {
+                break;
+            }
+            cell = next + 1;
+        }
+        if (line > 1 && k < 3 && !std::all_of(begin, line_end, [](char c) { return std::isspace(static_cast<unsigned char>(c)); })) {
+            throw std::runtime_error("Line " + std::to_string(line) + " of " + forcing_file + " should be member,P,T");
+        } else if (line > 1 && k == 3) {
+            if (value[0] != last) {
+                sizes.push_back(0);
+                last = value[0];
+            }
+            sizes.back()++;
+            P.push_back(value[1]);
+            T.push_back(value[2]);
+        }
+        begin = (line_end == end) ? end : line_end + 1;
+    }
+    members = sizes.size();
+    if (members == 0 || std::count(sizes.begin(), sizes.end(), sizes[0]) != static_cast<int64_t>(members)) {
+        throw std::runtime_error("Every member in " + forcing_file + " should have the same number of days");
+    }
+    return sizes[0];
+}
+/**
+ * @brief hbv_ensemble_options stores the options of forecastEnsemble().
+ */
+struct hbv_ensemble_options {
+    /**
+     * @brief quantiles written for each day, between 0 (min) and 1 (max).
+     */
+    std::vector<double> quantiles = {0, 0.05, 0.25, 0.5, 0.75, 0.95, 1};
+    /**
+     * @brief threads is number of threads used to run members.
+     */
+    uint64_t threads = hbv_threads();
+    /**
+     * @brief chunk is number of days calculated before quantiles are written, memory used for
+     * runoff is chunk * members doubles.
+     */
+    uint64_t chunk = 64;
+};
+/**
+ * @brief Get the column name of quantile: "min", "max", "median" or "p" with percent (such as "p5").
+ */
+inline std::string hbv_quantile_name(double q) {
+    if (q == 0) {
+        return "min";
+    } else if (q == 1) {
+        return "max";
+    } else if (q == 0.5) {
+        return "median";
+    }
+    std::ostringstream name;
+    name << "p" << q * 100;
+    return name.str();
+}
+/**
+ * @brief Run all members of ensemble forward and write quantiles of runoff (Qt) and runoff in area
+ * (Q_a) of each day to a csv file, trajectories of members are not stored. Members are run tile by tile
+ * with a work stealing thread pool for a chunk of days, then quantiles of the chunk are calculated in
+ * parallel and written in order of days. Members with NaN runoff are not counted in quantiles.
+ * @param ensemble ensemble with initial state of members
+ * @param P precipitation of all members, member-major (P[m * days + d])
+ * @param T daily mean temperature of all members, same order as P
+ * @param days number of days of each member
+ * @param options options of ensemble
+ * @param output_path path of output file
+ * @throw std::runtime_error if the file can't be opened
+ * @throw std::invalid_argument if size of P or T is not members * days, or quantile is not in [0, 1]
+ */
+inline void forecastEnsemble(hbv_ensemble &ensemble, std::span<const double> P, std::span<const double> T,
+    uint64_t days, const hbv_ensemble_options &options, const std::string &output_path) {
+    const uint64_t members = ensemble.size();
+    if (P.size() != members * days || T.size() != members * days) {
+        throw std::invalid_argument("Forcing should have " + std::to_string(days) + " days for each member");
+    }
+    for (double q : options.quantiles) {
+        if (!(q >= 0 && q <= 1)) {
+            throw std::invalid_argument("Quantile should be between 0 and 1");
+        }
+    }
+    std::ofstream output(output_path);
+    if (!output.is_open()) {
+        throw std::runtime_error("Can't Open " + output_path);
+    }
+    output << "Days";
+    for (const char *series : {"Qt", "Q_a"}) {
+        for (double q : options.quantiles) {
+            output << "," << series << "_" << hbv_quantile_name(q);
+        }
+    }
+    output << "\n";
+    output.precision(10);
+    const uint64_t chunk = std::max<uint64_t>(1, options.chunk);
+    const uint64_t tiles = (members + hbv_ensemble::tile - 1) / hbv_ensemble::tile;
+    const uint64_t columns = 2 * options.quantiles.size();
+    hbv_thread_pool pool(options.threads);
+    std::vector<double> Qt(chunk * members), table(chunk * columns);
+    // sorted[worker] and sorted_area[worker] are workspace of each thread for Qt and Q_a of one day.
+    std::vector<std::vector<double>> sorted(pool.size(), std::vector<double>(members));
+    std::vector<std::vector<double>> sorted_area = sorted;
+    for (uint64_t first = 0; first < days; first += chunk) {
+        const uint64_t count = std::min(chunk, days - first);
+        pool.parallel_for(tiles, [&](uint64_t t, uint64_t) {
+            ensemble.runTile(P, T, days, first, count, t * hbv_ensemble::tile, Qt.data());
+        });
+        pool.parallel_for(count, [&](uint64_t d, uint64_t worker) {
+            std::vector<double> &values = sorted[worker], &area = sorted_area[worker];
+            auto last = std::remove_copy_if(Qt.begin() + d * members, Qt.begin() + (d + 1) * members,
+                values.begin(), [](double value) { return std::isnan(value); });
+            const uint64_t valid = last - values.begin();
+            std::sort(values.begin(), last);
+            for (uint64_t m = 0; m < valid; m++) {
+                area[m] = ensemble.area(values[m]);
+            }
+            std::sort(area.begin(), area.begin() + valid);
+            for (uint64_t k = 0; k < options.quantiles.size(); k++) {
+                table[d * columns + k] = hbv_quantile({values.data(), valid}, options.quantiles[k]);
+                table[d * columns + options.quantiles.size() + k] = hbv_quantile({area.data(), valid},
+                    options.quantiles[k]);
+            }
+        });
+        ensemble.advance(count);
+        for (uint64_t d = 0; d < count; d++) {
+            output << ensemble.getDay() - count + d + 1;
+            for (uint64_t k = 0; k < columns; k++) {
+                output << "," << table[d * columns + k];
+            }
+            output << "\n";
+        }
+    }
+}
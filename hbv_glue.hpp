@@ -0,0 +1,327 @@
+// Copyright 2022 Tianshuo Li
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <limits>
+#include <numbers>
+#include <ostream>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "hbv_kernel.hpp"
+#include "hbv_batch.hpp"
+#include "hbv_parallel.hpp"
+#include "hbv_sampler.hpp"
+#include "hbv_ensemble.hpp"
+/**
+ * @brief hbv_quantile_sketch is a merging t-digest (Dunning and Ertl 2019) of weighted values: values are
+ * kept as centroids (mean and weight), small near both tails and large in the middle, so quantiles near
+ * 0 and 1 are accurate and memory only depends on compression, not on number of values. Values are
+ * added to a buffer and merged into centroids when it is full. A sketch is only used by one thread at a
+ * time: analyzeGLUE() gives each day its own sketch and shares days between threads, not values.
+ */
+class hbv_quantile_sketch {
+ public:
+      /**
+       * @brief Construct a new sketch.
+       * @param compression1 larger compression keeps more centroids (at most about compression) and
+       * gives more accurate quantiles
+       */
+      explicit hbv_quantile_sketch(double compression1 = 100) {
+         compression = std::max(compression1, 10.0);
+         limit = static_cast<uint64_t>(compression);
+      }
+      /**
+       * @brief Add value x with weight w, NaN values and weights not greater than 0 are not added.
+       */
+      void add(double x, double w = 1) {
+         if (std::isnan(x) || !(w > 0)) {
+            return;
+         }
+         buffer.push_back({x, w});
+         low = std::min(low, x);
+         high = std::max(high, x);
+         if (buffer.size() >= limit) {
+            compress();
+         }
+      }
+      /**
+       * @brief Get weighted q-quantile, interpolated between centers of centroids.
+       * @param q quantile between 0 and 1
+       * @return double quantile value, NaN if there is no value
+       */
+      double quantile(double q) {
+         compress();
+         if (centroids.empty()) {
+            return std::nan("");
+         }
+         const double target = std::clamp(q, 0.0, 1.0) * total;
+         double before = 0;  // before is weight of centroids before c
+         for (uint64_t c = 0; c < centroids.size(); c++) {
+            const double center = before + centroids[c].weight / 2;
+            if (target < center) {
+               if (c == 0) {
+                  return low + (centroids[0].mean - low) * target / center;
+               }
+               const double previous = before - centroids[c - 1].weight / 2;
+               return centroids[c - 1].mean + (centroids[c].mean - centroids[c - 1].mean)
+                  * (target - previous) / (center - previous);
+            }
+            before += centroids[c].weight;
+         }
+         const double center = total - centroids.back().weight / 2;
+         return centroids.back().mean + (high - centroids.back().mean) * (target - center)
+            / std::max(total - center, std::numeric_limits<double>::min());
+      }
+      /**
+       * @brief getWeight() will return sum of weights of all values.
+       */
+      double getWeight() {
+         compress();
+         return total;
+      }
+      /**
+       * @brief size() will return number of centroids.
+       */
+      uint64_t size() {
+         compress();
+         return centroids.size();
+      }
+
+ private:
+      /**
+       * @brief centroid is mean of some values and sum of their weights.
+       */
+      struct centroid {
+         double mean, weight;
+      };
+      /**
+       * @brief compression of sketch and limit of buffer.
+       */
+      double compression;
+      uint64_t limit;
+      /**
+       * @brief centroids sorted by mean, their total weight, and values not merged yet.
+       */
+      std::vector<centroid> centroids, buffer;
+      double total = 0;
+      /**
+       * @brief low and high are the smallest and largest values added.
+       */
+      double low = std::numeric_limits<double>::infinity();
+      double high = -std::numeric_limits<double>::infinity();
+      /**
+       * @brief Scale function k1 of t-digest and its inverse, a centroid covers at most 1 of k.
+       */
+      double scale(double q) const {
+         return compression / (2 * std::numbers::pi) * std::asin(2 * q - 1);
+      }
+      double inverse(double k) const {
+         return (std::sin(2 * std::numbers::pi * k / compression) + 1) / 2;
+      }
+      /**
+       * @brief Merge buffer into centroids.
+       */
+      void compress() {
+         if (buffer.empty()) {
+            return;
+         }
+         buffer.insert(buffer.end(), centroids.begin(), centroids.end());
+         std::sort(buffer.begin(), buffer.end(), [](const centroid &a, const centroid &b) { return a.mean < b.mean; });
+         total = 0;
+         for (const auto &c : buffer) {
+            total += c.weight;
+         }
+         centroids.clear();
+         centroid current = buffer[0];
+         double done = 0;  // done is weight of centroids finished
+         double bound = inverse(scale(0) + 1) * total;
+         for (uint64_t i = 1; i < buffer.size(); i++) {
+            if (done + current.weight + buffer[i].weight <= bound) {
+               current.weight += buffer[i].weight;
+               current.mean += (buffer[i].mean - current.mean) * buffer[i].weight / current.weight;
+            } else {
+               centroids.push_back(current);
+               done += current.weight;
+               bound = inverse(scale(done / total) + 1) * total;
+               current = buffer[i];
+            }
+         }
+         centroids.push_back(current);
+         buffer.clear();
+      }
+};
+/**
+ * @brief hbv_glue_options stores the options of analyzeGLUE().
+ */
+struct hbv_glue_options {
+    /**
+     * @brief method is "uniform", "lhs" or "sobol" (see hbv_sampler).
+     */
+    std::string method = "lhs";
+    /**
+     * @brief samples is number of parameters sets run.
+     */
+    uint64_t samples = 10000;
+    /**
+     * @brief threshold of NSE, a parameters set is behavioral when its NSE is higher than it.
+     */
+    double threshold = 0.5;
+    /**
+     * @brief quantiles of Qt written for each day in this order, the lowest and the highest are the band.
+     */
+    std::vector<double> quantiles = {0.05, 0.5, 0.95};
+    /**
+     * @brief compression of hbv_quantile_sketch of each day.
+     */
+    double compression = 100;
+    /**
+     * @brief seed of random number. Same seed gives same file whatever the number of threads.
+     */
+    uint64_t seed = 1;
+    /**
+     * @brief threads is number of threads used to run model.
+     */
+    uint64_t threads = hbv_threads();
+};
+/**
+ * @brief hbv_glue_result stores the summary of analyzeGLUE(). containment is the part of days whose
+ * observed Q is inside the band, and width is the average width of band.
+ */
+struct hbv_glue_result {
+    uint64_t samples, behavioral;
+    double best_NSE, containment, width;
+};
+/**
+ * @brief Run GLUE (Generalized Likelihood Uncertainty Estimation, Beven and Binley 1992): sample parameters
+ * sets, keep the behavioral ones (NSE higher than threshold) with likelihood weight NSE - threshold, and
+ * write weighted quantiles of Qt of each day to a csv file. Trajectories are not stored: each day has an
+ * hbv_quantile_sketch, so memory depends on number of days and compression, not on number of samples.
+ * Samples are run block by block: NSE of a block is calculated by tiles of hbv_batch, behavioral sets are
+ * run again by a few at a time to get Qt, then their Qt is added to the sketch of each day in parallel over
+ * days in order of samples, so the result is the same whatever the number of threads.
+ * @param Q discharge given by dataset
+ * @param P precipitation given by dataset
+ * @param T daily mean temperature given by dataset
+ * @param base parameters vector, the last 5 values are used for all samples
+ * @param options options of GLUE
+ * @param output_path path of band file
+ * @return hbv_glue_result
+ * @throw std::runtime_error if the file can't be opened
+ * @throw std::invalid_argument if quantile is not in [0, 1] or the sampling method is unknown
+ */
+inline hbv_glue_result analyzeGLUE(std::span<const double> Q, std::span<const double> P, std::span<const double> T,
+    const std::vector<double> &base, const hbv_glue_options &options, const std::string &output_path) {
+    if (options.quantiles.empty()) {
+        throw std::invalid_argument("There is no quantile");
+    }
+    for (double q : options.quantiles) {
+        if (!(q >= 0 && q <= 1)) {
+            throw std::invalid_argument("Quantile should be between 0 and 1");
+        }
+    }
+    const uint64_t days = Q.size();
+    const uint64_t block = 64 * hbv_batch::tile;
+    hbv_sampler sampler(options.method, options.samples, options.seed);
+    hbv_thread_pool pool(options.threads);
+    // runs is number of behavioral sets run together, Qt stores their trajectories.
+    const uint64_t runs = 4 * pool.size();
+    std::vector<hbv_quantile_sketch> sketch(days, hbv_quantile_sketch(options.compression));
+    std::vector<hbv_parameters> sets;
+    std::vector<double> NSE(block), Qt(runs * days), weight(runs);
+    std::vector<uint64_t> behavioral;
+    hbv_glue_result result{options.samples, 0, -std::numeric_limits<double>::infinity(), 0, 0};
+    const double temp2 = hbv_sum_squares_q(Q);
+    for (uint64_t b = 0; b < options.samples; b += block) {
+        const uint64_t size = std::min(block, options.samples - b);
+        sets.resize(size);
+        pool.parallel_for(size, [&](uint64_t i, uint64_t) {
+            sets[i] = hbv_parameters::fromVector(sampler.parameters(b + i, base));
+        });
+        const hbv_batch batch(sets);
+        const uint64_t tiles = (size + hbv_batch::tile - 1) / hbv_batch::tile;
+        pool.parallel_for(tiles, [&](uint64_t t, uint64_t) {
+            const uint64_t begin = t * hbv_batch::tile;
+            batch.evaluate(Q, P, T, begin, std::min(size, begin + hbv_batch::tile), NSE.data() + begin, temp2);
+        });
+        behavioral.clear();
+        for (uint64_t i = 0; i < size; i++) {
+            if (NSE[i] > options.threshold) {
+                behavioral.push_back(i);
+            }
+            if (NSE[i] > result.best_NSE) {
+                result.best_NSE = NSE[i];
+            }
+        }
+        result.behavioral += behavioral.size();
+        for (uint64_t first = 0; first < behavioral.size(); first += runs) {
+            const uint64_t count = std::min(runs, behavioral.size() - first);
+            pool.parallel_for(count, [&](uint64_t r, uint64_t) {
+                const hbv_parameters &p = sets[behavioral[first + r]];
+                hbv_state s = hbv_state::initial(p);
+                hbv_flux f;
+                for (uint64_t i = 0; i < days; i++) {
+                    hbv_step(p, s, P[i], T[i], f);
+                    Qt[r * days + i] = f.Qt;
+                }
+                weight[r] = NSE[behavioral[first + r]] - options.threshold;
+            });
+            pool.parallel_for((days + 255) / 256, [&](uint64_t c, uint64_t) {
+                for (uint64_t i = c * 256; i < std::min(days, c * 256 + 256); i++) {
+                    for (uint64_t r = 0; r < count; r++) {
+                        sketch[i].add(Qt[r * days + i], weight[r]);
+                    }
+                }
+            });
+        }
+    }
+    std::ofstream output(output_path);
+    if (!output.is_open()) {
+        throw std::runtime_error("Can't Open " + output_path);
+    }
+    output << "Days,Q";
+    for (double q : options.quantiles) {
+        output << ",Qt_" << hbv_quantile_name(q);
+    }
+    output << "\n";
+    output.precision(10);
+    const uint64_t columns = options.quantiles.size();
+    std::vector<double> band(columns);
+    // the band is from the lowest to the highest quantile whatever the order of columns.
+    const auto [lowest, highest] = std::minmax_element(options.quantiles.begin(), options.quantiles.end());
+    const uint64_t low = lowest - options.quantiles.begin(), high = highest - options.quantiles.begin();
+    uint64_t counted = 0;
+    for (uint64_t i = 0; i < days; i++) {
+        output << i + 1 << "," << Q[i];
+        for (uint64_t k = 0; k < columns; k++) {
+            band[k] = sketch[i].quantile(options.quantiles[k]);
+            output << "," << band[k];
+        }
+        output << "\n";
+        // the first day has no Qt, so it is not counted
+        if (!std::isnan(band[low]) && !std::isnan(band[high])) {
+            counted++;
+            result.containment += (Q[i] >= band[low] && Q[i] <= band[high]) ? 1 : 0;
+            result.width += band[high] - band[low];
+        }
+    }
+    result.containment /= static_cast<double>(std::max<uint64_t>(counted, 1));
+    result.width /= static_cast<double>(std::max<uint64_t>(counted, 1));
+    return result;
+}
+/**
+ * @brief This function will print the summary of GLUE.
+ */
+inline void printGLUE(std::ostream &output, const hbv_glue_result &result, const hbv_glue_options &options) {
+    output << result.behavioral << " of " << result.samples << " parameters sets are behavioral (NSE > "
+        << options.threshold << "), the best NSE is " << result.best_NSE << "\n";
+    if (result.behavioral > 0) {
+        const auto [lowest, highest] = std::minmax_element(options.quantiles.begin(), options.quantiles.end());
+        output << "Observed Q is inside the band of " << hbv_quantile_name(*lowest) << " to "
+            << hbv_quantile_name(*highest) << " in " << result.containment * 100
+            << "% of days, the average width of band is " << result.width << "\n";
+    }
+}
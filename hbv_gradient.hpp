@@ -0,0 +1,262 @@
+// Copyright 2022 Tianshuo Li
+#pragma once
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <span>
+#include "hbv_kernel.hpp"
+/**
+ * @brief hbv_dual is a dual number for forward-mode automatic differentiation: v is the value and d[k]
+ * is the derivative by k-th parameter. Every operation updates all N derivatives in a loop over an array,
+ * so the compiler can vectorize it and one run of the model gives the whole gradient.
+ * exp, log, log1p and pow are hidden friends found by argument-dependent lookup, so code written as
+ * "using std::exp; exp(x)" works for both double and hbv_dual.
+ */
+template <uint64_t N>
+struct hbv_dual {
+    double v;
+    std::array<double, N> d;
+    hbv_dual() : hbv_dual(0.0) {}
+    hbv_dual(double value) : v(value) {  // NOLINT: constants are converted implicitly as double
+        d.fill(0);
+    }
+    /**
+     * @brief Get a dual number with value whose derivatives are not set, they should all be written.
+     */
+    static hbv_dual uninitialized(double value) {
+        return hbv_dual(value, nullptr);
+    }
+    /**
+     * @brief Get the k-th variable with value, its derivative by itself is 1.
+     */
+    static hbv_dual variable(double value, uint64_t k) {
+        hbv_dual x(value);
+        x.d[k] = 1;
+        return x;
+    }
+    friend hbv_dual operator+(const hbv_dual &a, const hbv_dual &b) {
+        hbv_dual r = uninitialized(a.v + b.v);
+        for (uint64_t k = 0; k < N; k++) {
+            r.d[k] = a.d[k] + b.d[k];
+        }
+        return r;
+    }
+    friend hbv_dual operator-(const hbv_dual &a, const hbv_dual &b) {
+        hbv_dual r = uninitialized(a.v - b.v);
+        for (uint64_t k = 0; k < N; k++) {
+            r.d[k] = a.d[k] - b.d[k];
+        }
+        return r;
+    }
+    friend hbv_dual operator*(const hbv_dual &a, const hbv_dual &b) {
+        hbv_dual r = uninitialized(a.v * b.v);
+        for (uint64_t k = 0; k < N; k++) {
+            r.d[k] = a.d[k] * b.v + a.v * b.d[k];
+        }
+        return r;
+    }
+    friend hbv_dual operator/(const hbv_dual &a, const hbv_dual &b) {
+        hbv_dual r = uninitialized(a.v / b.v);
+        for (uint64_t k = 0; k < N; k++) {
+            r.d[k] = (a.d[k] - r.v * b.d[k]) / b.v;
+        }
+        return r;
+    }
+    // operations with a constant don't loop over its derivatives, which are all 0
+    friend hbv_dual operator+(const hbv_dual &a, double b) {
+        hbv_dual r = a;
+        r.v += b;
+        return r;
+    }
+    friend hbv_dual operator+(double a, const hbv_dual &b) {
+        return b + a;
+    }
+    friend hbv_dual operator-(const hbv_dual &a, double b) {
+        return a + (-b);
+    }
+    friend hbv_dual operator-(double a, const hbv_dual &b) {
+        return chain(b, a - b.v, -1);
+    }
+    friend hbv_dual operator*(const hbv_dual &a, double b) {
+        return chain(a, a.v * b, b);
+    }
+    friend hbv_dual operator*(double a, const hbv_dual &b) {
+        return b * a;
+    }
+    friend hbv_dual operator/(const hbv_dual &a, double b) {
+        return chain(a, a.v / b, 1 / b);
+    }
+    friend hbv_dual operator/(double a, const hbv_dual &b) {
+        const double value = a / b.v;
+        return chain(b, value, -value / b.v);
+    }
+    hbv_dual &operator+=(const hbv_dual &b) {
+        return *this = *this + b;
+    }
+    friend bool operator<(const hbv_dual &a, const hbv_dual &b) {
+        return a.v < b.v;
+    }
+    friend bool operator>(const hbv_dual &a, const hbv_dual &b) {
+        return a.v > b.v;
+    }
+    /**
+     * @brief Multiply all derivatives by the derivative of a function of one value.
+     */
+    static hbv_dual chain(const hbv_dual &a, double value, double slope) {
+        hbv_dual r = uninitialized(value);
+        for (uint64_t k = 0; k < N; k++) {
+            r.d[k] = slope * a.d[k];
+        }
+        return r;
+    }
+    friend hbv_dual exp(const hbv_dual &a) {
+        const double value = std::exp(a.v);
+        return chain(a, value, value);
+    }
+    friend hbv_dual log(const hbv_dual &a) {
+        return chain(a, std::log(a.v), 1 / a.v);
+    }
+    friend hbv_dual log1p(const hbv_dual &a) {
+        return chain(a, std::log1p(a.v), 1 / (1 + a.v));
+    }
+    /**
+     * @brief a to the power b. When a is 0 the value is 0 and only the part of a is kept, so there
+     * is no log(0).
+     */
+    friend hbv_dual pow(const hbv_dual &a, const hbv_dual &b) {
+        const double value = std::pow(a.v, b.v);
+        const double slope_a = (a.v == 0) ? 0 : b.v * value / a.v;
+        const double slope_b = (a.v > 0) ? value * std::log(a.v) : 0;
+        hbv_dual r = uninitialized(value);
+        for (uint64_t k = 0; k < N; k++) {
+            r.d[k] = slope_a * a.d[k] + slope_b * b.d[k];
+        }
+        return r;
+    }
+
+ private:
+    hbv_dual(double value, std::nullptr_t) : v(value) {}
+};
+/**
+ * @brief Get max(x, 0). With width > 0 it is the softplus width * log(1 + exp(x / width)), which is
+ * smooth and differs from max(x, 0) by at most width * log(2).
+ */
+template <typename Real>
+inline Real hbv_ramp(const Real &x, double width) {
+    using std::exp;
+    using std::log1p;
+    if (width <= 0) {
+        return (x > Real(0)) ? x : Real(0);
+    }
+    // written so exp() never overflows
+    return (x > Real(0)) ? x + width * log1p(exp(x / -width)) : width * log1p(exp(x / width));
+}
+/**
+ * @brief Get the step function x > 0 (1 or 0). With width > 0 it is the logistic function of x / width.
+ */
+template <typename Real>
+inline Real hbv_heaviside(const Real &x, double width) {
+    using std::exp;
+    if (width <= 0) {
+        return (x > Real(0)) ? Real(1) : Real(0);
+    }
+    // written so exp() never overflows
+    if (x > Real(0)) {
+        return 1.0 / (1.0 + exp(x / -width));
+    }
+    const Real e = exp(x / width);
+    return e / (1.0 + e);
+}
+/**
+ * @brief Calculate one day of HBV model as hbv_step() with thresholds written as hbv_ramp() and
+ * hbv_heaviside(): snow melt is DF * ramp(T - T_tr), snow falls when T < T_tr, snow melt is at most snow
+ * depth, Q0 is k0 * ramp(SUZ - Lsuz), and the limits of AET, Q2, percolation and SUZ are min or max.
+ * With width 0 the value is exactly the same as hbv_step() (T == T_tr gives rain as hbv_step() does),
+ * and with width > 0 every threshold is smooth, so the gradient is continuous for gradient-based
+ * calibration. Real can be double or hbv_dual.
+ * @param p parameters of model
+ * @param s state of model, it will be updated
+ * @param P precipitation in that day
+ * @param T daily mean temperature in that day
+ * @param f flux calculated in that day
+ * @param width width of smoothing, in the unit of each threshold (mm or degree)
+ */
+template <typename Real>
+inline void hbv_smooth_step(const hbv_parameters_t<Real> &p, hbv_state_t<Real> &s, double P, double T,
+    hbv_flux_t<Real> &f, double width) {
+    using std::pow;
+    auto min = [width](const Real &a, const Real &b) {
+        if (width <= 0) {
+            return (a > b) ? b : a;
+        }
+        return a - hbv_ramp(a - b, width);
+    };
+    f.S_m = p.DF * hbv_ramp(T - p.T_tr, width);
+    f.ASM = min(f.S_m, s.SD);
+    f.SG = P * hbv_heaviside(p.T_tr - T, width);
+    f.RF = P - f.SG;
+    s.SD = s.SD + f.SG - f.ASM;
+    f.ET = (T >= 0) ? p.alpha * T : Real(0);
+    if (s.day > 0) {
+        f.AET = f.ET * min(s.SM / (p.FC * p.LP), Real(1));
+        f.F = pow(s.SM / p.FC, p.beta) * (f.RF + f.ASM);
+        f.Q0 = p.k0 * hbv_ramp(s.SUZ - p.Lsuz, width);
+        f.Q1 = p.k1 * s.SUZ;
+        f.Q2 = hbv_ramp(p.k2 * s.SLZ, width);
+        f.Qt = f.Q0 + f.Q1 + f.Q2;
+        f.Q_a = (f.Qt * 0.001) * p.A;
+        s.SM = s.SM + f.RF + f.ASM - f.AET - f.F;
+        s.SLZ = s.SLZ + min(p.Cperc, s.SUZ) - f.Q2;
+        s.SUZ = hbv_ramp(s.SUZ + f.F - f.Q0 - f.Q1 - p.Cperc, width);
+    } else {
+        f.AET = f.F = f.Q0 = f.Q1 = f.Q2 = f.Qt = f.Q_a = Real(std::nan(""));
+    }
+    s.day++;
+}
+/**
+ * @brief hbv_gradient stores NSE and its gradient by the first 11 parameters given by hbv_evaluate_gradient().
+ */
+struct hbv_gradient {
+    double NSE;
+    std::array<double, hbv_bounds.size()> gradient;
+};
+/**
+ * @brief Run HBV model once with hbv_dual and return NSE and its derivative by each of the first 11
+ * parameters (forward-mode automatic differentiation). With width 0, NSE is the same as hbv_evaluate()
+ * and the gradient is the derivative of the branch taken on each day (it jumps where a threshold
+ * is crossed), with width > 0 both are of the smoothed model of hbv_smooth_step().
+ * @param p parameters of model, range should be checked before
+ * @param Q discharge given by dataset
+ * @param P precipitation given by dataset
+ * @param T daily mean temperature given by dataset
+ * @param width width of smoothing, 0 for the model without smoothing
+ * @return hbv_gradient
+ */
+inline hbv_gradient hbv_evaluate_gradient(const hbv_parameters &p, std::span<const double> Q,
+    std::span<const double> P, std::span<const double> T, double width = 0) {
+    constexpr uint64_t n = hbv_bounds.size();
+    using dual = hbv_dual<n>;
+    hbv_parameters_t<dual> q;
+    for (uint64_t k = 0; k < 16; k++) {
+        q[k] = (k < n) ? dual::variable(p[k], k) : dual(p[k]);
+    }
+    hbv_state_t<dual> s = hbv_state_t<dual>::initial(q);
+    hbv_flux_t<dual> f;
+    const double averageQ = hbv_average_q(Q);
+    double SST = 0;
+    dual SSE;
+    for (uint64_t i = 0; i < Q.size(); i++) {
+        hbv_smooth_step(q, s, P[i], T[i], f, width);
+        if (i > 0) {
+            const dual error = f.Qt - Q[i];
+            SSE += error * error;
+            SST += (Q[i] - averageQ) * (Q[i] - averageQ);
+        }
+    }
+    hbv_gradient result;
+    result.NSE = 1 - SSE.v / SST;
+    for (uint64_t k = 0; k < n; k++) {
+        result.gradient[k] = -SSE.d[k] / SST;
+    }
+    return result;
+}
@@ -0,0 +1,134 @@
+// Copyright 2022 Tianshuo Li
+#pragma once
+#include <iostream>
+#include <cmath>
+#include <cstdint>
+#include <span>
+#include <vector>
+#include "hbv_kernel.hpp"
+/**
+ * @brief hbv_incremental runs HBV model one day at a time for operational use. It only keeps the
+ * parameters, the storages of the last day and the running NSE, so adding a new day costs the same
+ * whatever the length of history. Running all days of a dataset with step() gives the same value
+ * as hbv_model for each day.
+ */
+class hbv_incremental {
+ public:
+      /**
+       * @brief Construct a new hbv incremental model with initial storages given by parameters.
+       * @param parameters1 parameters vector with the same order as hbv_model::parameters
+       * Out of range value is set to the lower bound value as hbv_model does.
+       */
+      explicit hbv_incremental(const std::vector<double> &parameters1) {
+         par = hbv_parameters::fromVector(parameters1);
+         try {
+            par.checkRange();
+         }
+         catch(const std::exception& e) {
+            std::cerr << e.what() << '\n';
+            std::cerr << "The vale out of range is set to the lower bound value" << '\n';
+         }
+         state = hbv_state::initial(par);
+      }
+      /**
+       * @brief Construct a new hbv incremental model from a saved state.
+       * @param par1 parameters of model, range should be checked before
+       * @param state1 storages and number of days already calculated
+       * @param nse1 running NSE until that day
+       */
+      hbv_incremental(const hbv_parameters &par1, const hbv_state &state1,
+      const hbv_running_nse &nse1 = hbv_running_nse()) {
+         par = par1;
+         state = state1;
+         nse = nse1;
+      }
+      /**
+       * @brief Calculate one new day without observed discharge, NSE is not changed.
+       * @param P precipitation in that day
+       * @param T daily mean temperature in that day
+       * @return const hbv_flux& value calculated in that day (runoff is NaN on the first day)
+       */
+      const hbv_flux &step(double P, double T) {
+         hbv_step(par, state, P, T, flux);
+         return flux;
+      }
+      /**
+       * @brief Calculate one new day and add observed discharge of that day to NSE.
+       * @param P precipitation in that day
+       * @param T daily mean temperature in that day
+       * @param Q observed discharge in that day
+       * @return const hbv_flux& value calculated in that day (runoff is NaN on the first day)
+       */
+      const hbv_flux &step(double P, double T, double Q) {
+         const bool first = (state.day == 0);
+         hbv_step(par, state, P, T, flux);
+         nse.add(first, Q, flux.Qt);
+         return flux;
+      }
+      /**
+       * @brief Calculate many new days with step(P, T, Q).
+       * @return const hbv_flux& value calculated in the last day
+       */
+      const hbv_flux &run(std::span<const double> Q, std::span<const double> P, std::span<const double> T) {
+         for (uint64_t i = 0; i < Q.size(); i++) {
+            step(P[i], T[i], Q[i]);
+         }
+         return flux;
+      }
+      /**
+       * @brief getNSE() will return NSE value of all days with observed discharge
+       * @return double NSE value, NaN if there is no day used in NSE
+       */
+      double getNSE() const {
+         return nse.NSE();
+      }
+      /**
+       * @brief getDay() will return number of days already calculated
+       */
+      uint64_t getDay() const {
+         return state.day;
+      }
+      /**
+       * @brief getState() will return storages of the last day
+       */
+      const hbv_state &getState() const {
+         return state;
+      }
+      /**
+       * @brief getRunningNSE() will return parts of running NSE
+       */
+      const hbv_running_nse &getRunningNSE() const {
+         return nse;
+      }
+      /**
+       * @brief getParameters() will return parameters of model
+       */
+      const hbv_parameters &getParameters() const {
+         return par;
+      }
+      /**
+       * @brief getFlux() will return value calculated in the last day
+       */
+      const hbv_flux &getFlux() const {
+         return flux;
+      }
+
+ private:
+      /**
+       * @brief par stores parameters value for calculation.
+       */
+      hbv_parameters par;
+      /**
+       * @brief state stores storages (SD, SM, SUZ and SLZ) of the last day. The HBV equation only
+       * uses storages of the previous day, so nothing else is needed to continue.
+       */
+      hbv_state state;
+      /**
+       * @brief nse stores parts of running NSE.
+       */
+      hbv_running_nse nse;
+      /**
+       * @brief flux stores value calculated in the last day.
+       */
+      hbv_flux flux = {};
+};
@@ -0,0 +1,317 @@
+// Copyright 2022 Tianshuo Li
+#pragma once
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <array>
+#include <vector>
+#include <string>
+#include <string_view>
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <cmath>
+#include <cctype>
+#include <charconv>
+#include "hbv_model.hpp"
+#include "hbv_profile.hpp"
+/**
+ * @brief hbv_columns stores column position of T, P and Q in data file, which are
+ * the last 3 lines of parameters file. Position starts from 1.
+ */
+struct hbv_columns {
+    int64_t T = -1;
+    int64_t P = -1;
+    int64_t Q = -1;
+};
+/**
+ * @brief This function will read parameters file. The first 16 lines are stored into parameters
+ * and the last 3 lines are stored into columns.
+ * @param parameters_file The path of parameter file (txt or similar format)
+ * @param parameters vector to store the parameters
+ * @param columns column position of T, P and Q
+ * @throw std::runtime_error if the file can't be opened or the format is incorrect
+ */
+inline void readParameters(const std::string &parameters_file, std::vector<double> &parameters,
+    hbv_columns &columns) {
+    HBV_PROFILE_SCOPE(parse_parameters);
+    std::ifstream input2(parameters_file);  // declare ifstream to process parameters file
+    if (!input2.is_open()) {
+        throw std::runtime_error("Can't Open " + parameters_file);
+    }
+    int64_t t = 0;  // t is a indicator to record the lines of file.
+    std::string temp;  // temp is used to get string from file as one sentence
+    parameters.clear();
+    columns = hbv_columns();
+    while (std::getline(input2, temp)) {
+        if (t <= 15) {
+            try {
+                parameters.push_back(std::stod(temp));
+                } catch(const std::exception& e) {
+                    std::cerr << "Parameters contained non-double value" << '\n';
+                    std::cerr << e.what() << '\n';
+                }
+        } else {
+            try {
+                if (t == 16) {
+                    columns.T = static_cast<int64_t>(std::stoi(temp));
+                } else if (t == 17) {
+                    columns.P = static_cast<int64_t>(std::stoi(temp));
+                } else if (t == 18) {
+                    columns.Q = static_cast<int64_t>(std::stoi(temp));
+                }
+            } catch(const std::exception& e) {
+                std::cerr << "Parameters contained non-integer value" << '\n';
+                std::cerr << e.what() << '\n';
+            }
+        }
+        t++;
+    }
+    input2.close();
+    if (t < 18) {
+        throw std::runtime_error("Format is incorrect for " + parameters_file);
+    } else if (columns.T == columns.Q || columns.T == columns.P || columns.P == columns.Q) {
+        throw std::runtime_error("Column position should not be same!");
+    } else if (columns.T == -1 || columns.P == -1 || columns.Q == -1) {
+        throw std::runtime_error("Column position is not initialized!");
+    } else if (parameters.size() < 16) {
+        throw std::runtime_error("Parameters contained non-double value in " + parameters_file);
+    }
+}
+/**
+ * @brief This function will write parameters file in the same format that readParameters() reads.
+ * @param parameters_file The path of parameter file
+ * @param parameters 16 parameters
+ * @param columns column position of T, P and Q
+ * @throw std::runtime_error if the file can't be opened
+ */
+inline void writeParameters(const std::string &parameters_file, const std::vector<double> &parameters,
+    const hbv_columns &columns) {
+    std::ofstream output(parameters_file);
+    if (!output.is_open()) {
+        throw std::runtime_error("Can't Open " + parameters_file);
+    }
+    output << std::setprecision(17);
+    for (uint64_t i = 0; i < 16; i++) {
+        output << parameters[i] << "\n";
+    }
+    output << columns.T << "\n" << columns.P << "\n" << columns.Q << "\n";
+}
+/**
+ * @brief hbv_data_report stores how many lines are read from data file. lines includes header,
+ * records is number of days stored and skipped is number of lines with missing value or
+ * non-double value (empty lines are not counted).
+ */
+struct hbv_data_report {
+    uint64_t lines = 0;
+    uint64_t records = 0;
+    uint64_t skipped = 0;
+};
+/**
+ * @brief This function will convert one cell to double in the same way as std::stod (leading
+ * space and characters after the number are ignored), but it does not depend on locale
+ * and does not throw exception.
+ * @param begin first character of cell
+ * @param end end of cell
+ * @param value value of cell
+ * @return true if cell is a double value, false otherwise
+ */
+inline bool parseCell(const char *begin, const char *end, double &value) {
+    while (begin < end && std::isspace(static_cast<unsigned char>(*begin))) {
+        begin++;
+    }
+    if (begin + 1 < end && *begin == '+' && begin[1] != '-' && begin[1] != '+') {
+        begin++;
+    }
+    auto [ptr, ec] = std::from_chars(begin, end, value);
+    return ec == std::errc();
+}
+/**
+ * @brief This function will parse one line of data file. The first line is header and only used
+ * to check position of columns, other lines give one record if T, P and Q are all double value.
+ * @param begin first character of line
+ * @param end end of line (without '\n')
+ * @param columns column position of T, P and Q
+ * @param Q vector to store discharge
+ * @param P vector to store precipitation
+ * @param T vector to store daily mean temperature
+ * @param report count of lines, records and skipped lines
+ * @throw std::runtime_error if the column position exceed length of header
+ */
+inline void parseDataLine(const char *begin, const char *end, const hbv_columns &columns,
+    std::vector<double> &Q, std::vector<double> &P, std::vector<double> &T, hbv_data_report &report) {
+    if (report.lines++ == 0) {
+        // a comma at the end of line does not start a new column.
+        int64_t z = (begin == end) ? 0 : std::count(begin, end, ',') + (end[-1] == ',' ? 0 : 1);
+        if ((columns.P-1) > z ||(columns.T-1) > z || (columns.Q-1) > z) {
+            throw std::runtime_error("Position of column exceed total length of file");
+        }
+        return;
+    }
+    if (begin == end) {
+        return;
+    }
+    double value[3];
+    const int64_t position[3] = {columns.Q, columns.P, columns.T};
+    uint64_t found = 0;
+    int64_t z = 1;  // z is the column of cell starts from begin
+    for (const char *cell = begin; cell < end && found < 3; z++) {
+        const char *next = std::find(cell, end, ',');
+        for (uint64_t k = 0; k < 3; k++) {
+            if (position[k] == z) {
+                if (!parseCell(cell, next, value[k])) {
+                    report.skipped++;
+                    return;
+                }
+                found++;
+            }
+        }
+        cell = (next == end) ? end : next + 1;
+    }
+    if (found < 3) {
+        report.skipped++;
+        return;
+    }
+    Q.push_back(value[0]);
+    P.push_back(value[1]);
+    T.push_back(value[2]);
+    report.records++;
+}
+/**
+ * @brief This function will read the whole file into memory.
+ * @param path path of file
+ * @return std::string content of file
+ * @throw std::runtime_error if the file can't be opened
+ */
+inline std::string readFile(const std::string &path) {
+    HBV_PROFILE_SCOPE(open_files);
+    std::ifstream input(path, std::ios::binary);
+    if (!input.is_open()) {
+        throw std::runtime_error("Can't Open " + path);
+    }
+    std::string buffer;  // buffer stores the whole file
+    input.seekg(0, std::ios::end);
+    buffer.resize(static_cast<uint64_t>(input.tellg()));
+    input.seekg(0, std::ios::beg);
+    input.read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+    return buffer;
+}
+/**
+ * @brief This function will parse content of data file line by line with parseDataLine().
+ * @param buffer content of data file
+ * @param columns column position of T, P and Q
+ * @param Q vector to store discharge
+ * @param P vector to store precipitation
+ * @param T vector to store daily mean temperature
+ * @return hbv_data_report count of lines, records and skipped lines
+ * @throw std::runtime_error if the column position exceed length of file or there are less than 2 records
+ */
+inline hbv_data_report parseData(std::string_view buffer, const hbv_columns &columns,
+    std::vector<double> &Q, std::vector<double> &P, std::vector<double> &T) {
+    HBV_PROFILE_SCOPE(parse_data);
+    const char *begin = buffer.data(), *end = buffer.data() + buffer.size();
+    uint64_t lines = std::count(begin, end, '\n') + 1;
+    Q.clear();
+    P.clear();
+    T.clear();
+    Q.reserve(lines);
+    P.reserve(lines);
+    T.reserve(lines);
+    hbv_data_report report;
+    while (begin < end) {
+        const char *line_end = std::find(begin, end, '\n');
+        parseDataLine(begin, line_end, columns, Q, P, T, report);
+        begin = (line_end == end) ? end : line_end + 1;
+    }
+    HBV_PROFILE_COUNT(records_parsed, report.records);
+    HBV_PROFILE_COUNT(records_skipped, report.skipped);
+    HBV_PROFILE_COUNT(peak_vector_bytes, (Q.capacity() + P.capacity() + T.capacity()) * sizeof(double));
+    if (Q.size() < 2) {
+        throw std::runtime_error("The data file should contain at leasts 2-day records");
+    }
+    return report;
+}
+/**
+ * @brief This function will read data file from line2(since there some header exist),
+ * and can detect missing value or non-double value in the data file and skiped to next records.
+ * The whole file is read into memory once and only columns of T, P and Q are converted.
+ * @param data_file The path of data file(csv file or same format)
+ * @param columns column position of T, P and Q
+ * @param Q vector to store discharge
+ * @param P vector to store precipitation
+ * @param T vector to store daily mean temperature
+ * @return hbv_data_report count of lines, records and skipped lines
+ * @throw std::runtime_error if the file can't be opened, the column position exceed length
+ * of file or there are less than 2 records
+ */
+inline hbv_data_report readData(const std::string &data_file, const hbv_columns &columns,
+    std::vector<double> &Q, std::vector<double> &P, std::vector<double> &T) {
+    return parseData(readFile(data_file), columns, Q, P, T);
+}
+/**
+ * @brief This function will print number of skipped lines of data file, if there is any.
+ * @param report report given by readData()
+ */
+inline void printDataReport(const hbv_data_report &report) {
+    if (report.skipped > 0) {
+        std::cerr << report.skipped << " records contained missing value or non-double value and were skipped"
+            << '\n';
+    }
+}
+/**
+ * @brief Header of result file.
+ */
+inline constexpr std::string_view hbv_result_header = "Days,"
+    "Effective Precipitation (mm/day),"
+    "Evapotranspiration (mm/day),"
+    "Actual Evapotranspiration (mm/day),"
+    "Storage (mm),"
+    "Runoff (mm/day),"
+    "Runoff in Area (m^3/day)\n";
+/**
+ * @brief This function will add one row of result file to buffer. Values are written with 3 decimals
+ * by std::to_chars, same as std::fixed with precision 3.
+ * @param buffer buffer of result file
+ * @param day number of day, starts from 1
+ * @param values effective precipitation, evapotranspiration, actual evapotranspiration, storage,
+ * runoff and runoff in area of that day
+ */
+inline void appendResultRow(std::string &buffer, uint64_t day, const std::array<double, 6> &values) {
+    char cell[512];  // the longest double written with 3 decimals has 314 characters
+    char *last = std::to_chars(cell, cell + sizeof(cell), day).ptr;
+    for (double value : values) {
+        *last++ = ',';
+        buffer.append(cell, last);
+        last = std::to_chars(cell, cell + sizeof(cell), value, std::chars_format::fixed, 3).ptr;
+    }
+    *last++ = '\n';
+    buffer.append(cell, last);
+}
+/**
+ * @brief This function will write result of HBV model to a csv file. Each row is one day, with
+ * effective precipitation, evapotranspiration, actual evapotranspiration, storage, runoff
+ * and runoff in area.
+ * @param output_path output path
+ * @param hbv_model HBV model already calculated, in double or float
+ * @throw std::runtime_error if the file can't be opened
+ */
+template <typename Real>
+inline void writeResult(const std::string &output_path, const hbv_model_t<Real> &hbv_model) {
+    HBV_PROFILE_SCOPE(write_result);
+    std::ofstream output(output_path);   // declare ofstream to process output file
+    if (!output.is_open()) {
+        throw std::runtime_error("Can't Open " + output_path);
+    }
+    // result are views of the series in hbv model, nothing is copied.
+    const hbv_result_t<Real> result = hbv_model.getResults();
+    const double none = std::nan("");  // AET, Qt and Q_a have no value on the first day.
+    std::string buffer(hbv_result_header);
+    buffer.reserve(buffer.size() + result.RF.size() * 96);
+    for (uint64_t i = 0; i < result.RF.size(); i++) {
+        appendResultRow(buffer, i+1, {result.RF[i], result.ET[i], i > 0 ? result.AET[i-1] : none,
+            result.storage[i], i > 0 ? result.Qt[i-1] : none, i > 0 ? result.Q_a[i-1] : none});
+    }
+    output.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+    output.close();
+}
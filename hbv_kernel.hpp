@@ -0,0 +1,372 @@
+// Copyright 2022 Tianshuo Li
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <span>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+/**
+ * @brief hbv_bound stores name, lower bound and upper bound of one calibrated parameter.
+ */
+struct hbv_bound {
+    const char *name;
+    double low;
+    double high;
+};
+/**
+ * @brief hbv_bounds is the range table of the first 11 parameters. It follows the order
+ * of parameters vector and it is the only place those ranges are written down.
+ */
+inline constexpr std::array<hbv_bound, 11> hbv_bounds = {{
+    {"T_tr", -1.5, 2.5},
+    {"DF", 1, 10},
+    {"FC", 50, 500},
+    {"beta", 1, 6},
+    {"alpha", 0.5, 1.25},
+    {"LP", 0.1, 0.9},
+    {"k0", 0.01, 0.8},
+    {"k1", 0.01, 0.4},
+    {"k2", 0.001, 0.15},
+    {"Lsuz", 1, 100},
+    {"Cperc", 0.01, 6},
+}};
+/**
+ * @brief hbv_parameters_t stores the 16 values of parameters vector by name, Real is the
+ * scalar type used in calculation (double, or float for float32 mode). hbv_parameters is the
+ * double version used by most of the program.
+ * For detailed information about each parameters, please check readme file.
+ */
+template <typename Real>
+struct hbv_parameters_t {
+    Real T_tr, DF, FC, beta, alpha, LP, k0, k1, k2, Lsuz, Cperc, SD_i, SUZ_i, SLZ_i, SM_i, A;
+    /**
+     * @brief Build parameters from parameters vector. The value will not be checked.
+     * @param parameters vector follow the order in hbv_model::parameters
+     * @return hbv_parameters_t
+     */
+    static hbv_parameters_t fromVector(const std::vector<double> &parameters) {
+        hbv_parameters_t p;
+        for (uint64_t i = 0; i < 16; i++) {
+            p[i] = static_cast<Real>(parameters[i]);
+        }
+        return p;
+    }
+    /**
+     * @brief Get the same parameters with another scalar type.
+     */
+    template <typename Other>
+    hbv_parameters_t<Other> as() const {
+        hbv_parameters_t<Other> p;
+        for (uint64_t i = 0; i < 16; i++) {
+            p[i] = static_cast<Other>((*this)[i]);
+        }
+        return p;
+    }
+    /**
+     * @brief Get the value of i-th parameters with the same order as parameters vector.
+     */
+    Real &operator[](uint64_t i) {
+        Real *all[16] = {&T_tr, &DF, &FC, &beta, &alpha, &LP, &k0, &k1, &k2,
+            &Lsuz, &Cperc, &SD_i, &SUZ_i, &SLZ_i, &SM_i, &A};
+        return *all[i];
+    }
+    Real operator[](uint64_t i) const {
+        return const_cast<hbv_parameters_t &>(*this)[i];
+    }
+    /**
+     * @brief checkRange() will check range of first 11 parameters with hbv_bounds. If the value
+     * is not in range, it will set to lower bound and throw a domain_error.
+     */
+    void checkRange() {
+        for (uint64_t i = 0; i < hbv_bounds.size(); i++) {
+            Real &value = (*this)[i];
+            if (!inRange(value, hbv_bounds[i].low, hbv_bounds[i].high)) {
+                value = hbv_bounds[i].low;
+                std::ostringstream message;
+                message << "The range of " << hbv_bounds[i].name << " should be between "
+                    << hbv_bounds[i].low << " and " << hbv_bounds[i].high;
+                throw std::domain_error(message.str());
+            }
+        }
+    }
+    /**
+     * @brief This function will check value in the range.
+     * @param value value want to check
+     * @param low lower bound of parameters
+     * @param high higher bound of parameters
+     * @return true value is in the range
+     * @return false value is not in the range
+     */
+    static bool inRange(double value, double low, double high) {
+        return ((low <= value) && (value <= high));
+    }
+};
+/**
+ * @brief hbv_parameters is parameters in double.
+ */
+using hbv_parameters = hbv_parameters_t<double>;
+/**
+ * @brief hbv_state_t stores the storages carried from one day to the next day.
+ * day is the number of days already calculated.
+ */
+template <typename Real>
+struct hbv_state_t {
+    Real SD, SM, SUZ, SLZ;
+    uint64_t day;
+    /**
+     * @brief Build state from initial value in parameters.
+     */
+    static hbv_state_t initial(const hbv_parameters_t<Real> &p) {
+        return {p.SD_i, p.SM_i, p.SUZ_i, p.SLZ_i, 0};
+    }
+};
+/**
+ * @brief hbv_state is state in double.
+ */
+using hbv_state = hbv_state_t<double>;
+/**
+ * @brief hbv_flux_t stores the value calculated in one day. The first day only calculates
+ * snow and evapotranspiration part, so AET, F, Q0, Q1, Q2, Qt and Q_a are NaN on that day.
+ * S_m, RF, ET and SG (snow gain) only depend on P, T and parameters, see hbv_forcing_flux().
+ */
+template <typename Real>
+struct hbv_flux_t {
+    Real S_m, ASM, RF, ET, AET, F, Q0, Q1, Q2, Qt, Q_a, SG;
+};
+/**
+ * @brief hbv_flux is flux in double.
+ */
+using hbv_flux = hbv_flux_t<double>;
+/**
+ * @brief Calculate the part of one day that does not depend on state: potential snow melt S_m, rain RF,
+ * snow gain SG and potential evapotranspiration ET. It is written with selects instead of branches,
+ * so a loop of it over many days (hbv_forcing_fluxes()) can be vectorized by compiler.
+ * @param p parameters of model, only T_tr, DF and alpha are used
+ * @param P precipitation in that day
+ * @param T daily mean temperature in that day
+ * @param f flux of that day, S_m, RF, SG and ET are written
+ */
+template <typename Real>
+inline void hbv_forcing_flux(const hbv_parameters_t<Real> &p, std::type_identity_t<Real> P,
+    std::type_identity_t<Real> T, hbv_flux_t<Real> &f) {
+    const bool cold = T < p.T_tr;
+    f.S_m = (T > p.T_tr) ? p.DF * (T - p.T_tr) : Real(0);
+    f.SG = cold ? P : Real(0);
+    f.RF = cold ? Real(0) : P;
+    f.ET = (T >= 0) ? p.alpha * T : Real(0);
+}
+/**
+ * @brief Calculate S_m, RF, SG and ET of every day with hbv_forcing_flux(), each output has P.size() values.
+ * The loop has no branch and no dependence between days.
+ */
+template <typename Real>
+inline void hbv_forcing_fluxes(const hbv_parameters_t<Real> &p, std::span<const double> P,
+    std::span<const double> T, Real *S_m, Real *RF, Real *SG, Real *ET) {
+    for (uint64_t i = 0; i < P.size(); i++) {
+        hbv_flux_t<Real> f;
+        hbv_forcing_flux(p, static_cast<Real>(P[i]), static_cast<Real>(T[i]), f);
+        S_m[i] = f.S_m;
+        RF[i] = f.RF;
+        SG[i] = f.SG;
+        ET[i] = f.ET;
+    }
+}
+/**
+ * @brief Calculate the part of one day that depends on state and move state to the next day.
+ * S_m, RF, SG and ET of f should be given by hbv_forcing_flux() first.
+ * @param p parameters of model
+ * @param s state of model, it will be updated
+ * @param f flux of that day, other values are written
+ * @param powSM value of pow(SM / FC, beta) with SM of state before that day, used in F equation
+ */
+template <typename Real>
+inline void hbv_storage_step(const hbv_parameters_t<Real> &p, hbv_state_t<Real> &s, hbv_flux_t<Real> &f,
+    std::type_identity_t<Real> powSM) {
+    f.ASM = (f.S_m > s.SD) ? s.SD : f.S_m;
+    s.SD = s.SD + f.SG - f.ASM;
+    if (s.day > 0) {
+        f.AET = f.ET * std::min((s.SM / (p.FC * p.LP)), Real(1));
+        f.F = powSM * (f.RF + f.ASM);
+        f.Q0 = (s.SUZ > p.Lsuz) ? p.k0 * (s.SUZ - p.Lsuz) : 0;
+        f.Q1 = p.k1 * s.SUZ;
+        f.Q2 = std::max(p.k2 * s.SLZ, Real(0));
+        f.Qt = f.Q0 + f.Q1 + f.Q2;
+        f.Q_a = (f.Qt * Real(0.001)) * p.A;
+        s.SM = s.SM + f.RF + f.ASM - f.AET - f.F;
+        s.SLZ = s.SLZ + std::min(p.Cperc, s.SUZ) - f.Q2;
+        s.SUZ = std::max((s.SUZ + f.F - f.Q0 - f.Q1 - p.Cperc), Real(0));
+    } else {
+        f.AET = f.F = f.Q0 = f.Q1 = f.Q2 = f.Qt = f.Q_a = std::numeric_limits<Real>::quiet_NaN();
+    }
+    s.day++;
+}
+/**
+ * @brief Calculate the part of one day that depends on state with pow() in F equation.
+ */
+template <typename Real>
+inline void hbv_storage_step(const hbv_parameters_t<Real> &p, hbv_state_t<Real> &s, hbv_flux_t<Real> &f) {
+    hbv_storage_step(p, s, f, (s.day > 0) ? std::pow(s.SM / p.FC, p.beta) : Real(0));
+}
+/**
+ * @brief Calculate one day of HBV model and move state to the next day.
+ * hbv_forcing_flux() and hbv_storage_step() are the only place of HBV equation: hbv_model, hbv_incremental
+ * and hbv_evaluate() call them through this function, hbv_batch_t, hbv_ensemble and hbv_evaluate_fast()
+ * through hbv_lane_step(). The one other copy is hbv_smooth_step() in hbv_gradient.hpp, which writes
+ * the thresholds as smooth functions for the gradient; with width 0 hbv_bench checks it gives the same NSE.
+ * For detailed information please check readme file.
+ * All values are calculated in Real, P and T are converted to Real first.
+ * @param p parameters of model
+ * @param s state of model, it will be updated
+ * @param P precipitation in that day
+ * @param T daily mean temperature in that day
+ * @param f flux calculated in that day
+ */
+template <typename Real>
+inline void hbv_step(const hbv_parameters_t<Real> &p, hbv_state_t<Real> &s, std::type_identity_t<Real> P,
+    std::type_identity_t<Real> T, hbv_flux_t<Real> &f) {
+    hbv_forcing_flux(p, P, T, f);
+    hbv_storage_step(p, s, f);
+}
+/**
+ * @brief Calculate one day of one lane of an engine which runs many parameters sets or members together
+ * (hbv_batch_t, hbv_ensemble and hbv_evaluate_fast()) and return runoff Qt of that day (NaN on the first day).
+ * It is hbv_step() with pow(SM / FC, beta) given by the engine, which computes it in its own loop so that
+ * loop can be vectorized or specialized. With Snow false the engine knows SD is 0 and T >= T_tr on every day,
+ * so snow melt and snow gain are 0 and their selects are skipped.
+ * @param powSM value of pow(SM / FC, beta) with SM of state before that day, not used on the first day
+ */
+template <bool Snow = true, typename Real>
+inline Real hbv_lane_step(const hbv_parameters_t<Real> &p, hbv_state_t<Real> &s, std::type_identity_t<Real> P,
+    std::type_identity_t<Real> T, std::type_identity_t<Real> powSM) {
+    hbv_flux_t<Real> f;
+    hbv_forcing_flux(p, P, T, f);
+    if constexpr (!Snow) {
+        f.S_m = f.SG = Real(0);
+    }
+    hbv_storage_step(p, s, f, powSM);
+    return f.Qt;
+}
+/**
+ * @brief Get the Average value of Q(run off/discharge) as the same way of hbv_model.
+ * @param Q discharge given by dataset
+ * @return double average value of Q
+ */
+inline double hbv_average_q(std::span<const double> Q) {
+    double a = 0;  // used to store total value of Q.
+    for (uint64_t i = 1; i < Q.size(); i++) {
+        a += Q[i];
+    }
+    return a/static_cast<double>(Q.size());
+}
+/**
+ * @brief Get the sum of squares of Q about hbv_average_q(), it is the part 2 value of NSE value and
+ * it is same for all parameters sets, so it can be calculated once for a dataset.
+ * @param Q discharge given by dataset
+ * @return double sum of squares, summed in the same order as hbv_evaluate()
+ */
+inline double hbv_sum_squares_q(std::span<const double> Q) {
+    const double averageQ = hbv_average_q(Q);
+    double temp2 = 0;
+    for (uint64_t i = 1; i < Q.size(); i++) {
+        temp2 += pow(Q[i] - averageQ, 2);
+    }
+    return temp2;
+}
+/**
+ * @brief hbv_running_nse sums parts of NSE one day at a time, so NSE can be updated when a new day
+ * is observed without going through the history again. Average of Q follows hbv_average_q()
+ * (Q of the first day is counted in number of days but not in sum), the SST is kept with Welford's
+ * method and moved to that average, so NSE is the same as hbv_evaluate() up to rounding.
+ */
+struct hbv_running_nse {
+    /**
+     * @brief days is number of days with observed Q and count is number of days used in NSE
+     * (all days except the first one).
+     */
+    uint64_t days = 0;
+    uint64_t count = 0;
+    /**
+     * @brief SSE is the part 1 value of NSE, mean and M2 are mean and sum of squared differences
+     * from mean of Q used in NSE.
+     */
+    double SSE = 0;
+    double mean = 0;
+    double M2 = 0;
+    /**
+     * @brief Add one day.
+     * @param first true for the first day of model, which is not used in NSE
+     * @param Q observed discharge in that day
+     * @param Qt calculated discharge in that day
+     */
+    void add(bool first, double Q, double Qt) {
+        days++;
+        if (first) {
+            return;
+        }
+        count++;
+        SSE += pow(Q - Qt, 2);
+        double delta = Q - mean;
+        mean += delta / static_cast<double>(count);
+        M2 += delta * (Q - mean);
+    }
+    /**
+     * @brief Get the part 2 value of NSE.
+     */
+    double SST() const {
+        double average = mean * static_cast<double>(count) / static_cast<double>(days);
+        return M2 + static_cast<double>(count) * pow(mean - average, 2);
+    }
+    /**
+     * @brief Get NSE value of all days added, NaN if there is no day used in NSE.
+     */
+    double NSE() const {
+        return (count == 0) ? std::nan("") : 1 - SSE / SST();
+    }
+};
+/**
+ * @brief hbv_score stores the result of hbv_evaluate().
+ * SSE is the part 1 value of NSE and SST is the part 2 value of NSE.
+ */
+struct hbv_score {
+    double NSE, SSE, SST;
+    hbv_state state;
+};
+/**
+ * @brief Run HBV model and only return NSE value. It keeps storages in local variables and
+ * sums NSE parts day by day, so no vector will be allocated whatever the length of dataset.
+ * The NSE value is the same as hbv_model::getNSE() with the same input up to rounding.
+ * @param p parameters of model, range should be checked before
+ * @param Q discharge given by dataset
+ * @param P precipitation given by dataset
+ * @param T daily mean temperature given by dataset
+ * @param averageQ average value of Q given by hbv_average_q()
+ * @return hbv_score
+ */
+inline hbv_score hbv_evaluate(const hbv_parameters &p, std::span<const double> Q,
+    std::span<const double> P, std::span<const double> T, double averageQ) {
+    hbv_state s = hbv_state::initial(p);
+    hbv_flux f;
+    double temp1 = 0;  // temp1 is to store the part 1 value of NSE value.
+    double temp2 = 0;  // temp2 is to store the part 2 value of NSE value.
+    for (uint64_t i = 0; i < Q.size(); i++) {
+        hbv_step(p, s, P[i], T[i], f);
+        if (i > 0) {
+            temp1 += pow(Q[i] - f.Qt, 2);
+            temp2 += pow(Q[i] - averageQ, 2);
+        }
+    }
+    return {1 - temp1 / temp2, temp1, temp2, s};
+}
+/**
+ * @brief Run HBV model and only return NSE value, average value of Q will be calculated first.
+ */
+inline hbv_score hbv_evaluate(const hbv_parameters &p, std::span<const double> Q,
+    std::span<const double> P, std::span<const double> T) {
+    return hbv_evaluate(p, Q, P, T, hbv_average_q(Q));
+}
@@ -0,0 +1,264 @@
+// Copyright 2022 Tianshuo Li
+#pragma once
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include "hbv_kernel.hpp"
+#include "hbv_cache.hpp"
+#include "hbv_parallel.hpp"
+/**
+ * @brief hbv_memo_record is one record of a memo file: the key, the objective value and the parameters
+ * it was calculated for (only kept so the file can be read by other programs).
+ */
+struct hbv_memo_record {
+    uint64_t key[2];
+    double value;
+    double parameters[16];
+};
+static_assert(sizeof(hbv_memo_record) == 152, "hbv_memo_record should be 152 bytes");
+/**
+ * @brief Get a digest of Q, P and T, it is a part of every key of hbv_memo so values of different
+ * datasets are never mixed.
+ */
+inline uint64_t hbv_forcing_digest(std::span<const double> Q, std::span<const double> P, std::span<const double> T) {
+    uint64_t digest = Q.size();
+    for (std::span<const double> series : {Q, P, T}) {
+        for (uint64_t i = 0; i < series.size(); i++) {
+            digest = hbv_seed(digest ^ std::bit_cast<uint64_t>(series[i]), i);
+        }
+    }
+    return digest;
+}
+/**
+ * @brief hbv_memo is a persistent cache of objective values of parameters sets, so a calibration or
+ * sampling that is restarted does not run the model again for parameters sets it already ran.
+ * The key is two 64 bit hashes of the 16 parameters quantized to bits bits of mantissa (so nearly the
+ * same parameters share a value), the digest of forcing and the name of objective. The memo file starts
+ * with 8 characters "HBVMEMO1" and the size of record (uint64), followed by hbv_memo_record; records are
+ * only appended. When it is opened the file is mapped with mmap and the keys are put in an index in memory,
+ * a record cut by a crash at the end of file is removed. When find() misses, the file is mapped again if it
+ * has grown and the records appended since (by this or another process) are added to the index, so many
+ * processes sharing one memo file see the values of each other before running the model.
+ * find() and insert() can be called by many threads.
+ */
+class hbv_memo {
+ public:
+      /**
+       * @brief Open (or create) a memo file.
+       * @param path path of memo file
+       * @param Q discharge given by dataset
+       * @param P precipitation given by dataset
+       * @param T daily mean temperature given by dataset
+       * @param objective name of objective (and anything else that changes the value, for example precision)
+       * @param bits1 bits of mantissa kept when parameters are quantized (52 for exact parameters)
+       * @throw std::runtime_error if the file can't be opened or it is not a memo file
+       */
+      hbv_memo(const std::string &path, std::span<const double> Q, std::span<const double> P,
+      std::span<const double> T, const std::string &objective, uint64_t bits1 = 36) {
+         bits = std::min<uint64_t>(bits1, 52);
+         salt = hbv_forcing_digest(Q, P, T) ^ hbv_checksum(objective);
+         fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+         if (fd < 0) {
+            throw std::runtime_error("Can't Open " + path);
+         }
+         struct stat status;
+         ::fstat(fd, &status);
+         const uint64_t size = static_cast<uint64_t>(status.st_size);
+         if (size < header) {
+            // a new file, or a file cut before the header was written
+            char text[header] = {'H', 'B', 'V', 'M', 'E', 'M', 'O', '1'};
+            std::memcpy(text + 8, &record, sizeof(record));
+            if (::ftruncate(fd, 0) != 0 || ::write(fd, text, header) != static_cast<ssize_t>(header)) {
+               ::close(fd);
+               throw std::runtime_error("Can't Write " + path);
+            }
+            return;
+         }
+         void *data = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+         if (data == MAP_FAILED) {
+            ::close(fd);
+            throw std::runtime_error("Can't Open " + path);
+         }
+         uint64_t width = 0;
+         std::memcpy(&width, static_cast<const char *>(data) + 8, sizeof(width));
+         if (std::memcmp(data, "HBVMEMO1", 8) != 0 || width != record) {
+            ::munmap(data, size);
+            ::close(fd);
+            throw std::runtime_error(path + " is not a memo file");
+         }
+         address = data;
+         length = size;
+         const uint64_t end = header + (size - header) / record * record;
+         index.reserve((size - header) / record);
+         readRecords(end);
+         if (end != size && ::ftruncate(fd, static_cast<off_t>(end))) {
+            unmap();
+            ::close(fd);
+            throw std::runtime_error("Can't Write " + path);
+         }
+      }
+      hbv_memo(const hbv_memo &) = delete;
+      hbv_memo &operator=(const hbv_memo &) = delete;
+      ~hbv_memo() {
+         unmap();
+         ::close(fd);
+      }
+      /**
+       * @brief Find the value of parameters.
+       * @return std::optional<double> value, empty if it was not calculated before
+       */
+      std::optional<double> find(const hbv_parameters &p) {
+         const std::array<uint64_t, 2> k = key(p);
+         {
+            std::shared_lock<std::shared_mutex> lock(mutex);
+            auto found = index.find(k[0]);
+            if (found != index.end() && found->second.first == k[1]) {
+               hits++;
+               return found->second.second;
+            }
+         }
+         // the value may have been appended by another process after the index was built.
+         std::unique_lock<std::shared_mutex> lock(mutex);
+         refresh();
+         auto found = index.find(k[0]);
+         if (found == index.end() || found->second.first != k[1]) {
+            return std::nullopt;
+         }
+         hits++;
+         return found->second.second;
+      }
+      /**
+       * @brief Add the value of parameters and append it to memo file, nothing is done if it is already there.
+       */
+      void insert(const hbv_parameters &p, double value) {
+         hbv_memo_record item;
+         const std::array<uint64_t, 2> k = key(p);
+         item.key[0] = k[0];
+         item.key[1] = k[1];
+         item.value = value;
+         for (uint64_t i = 0; i < 16; i++) {
+            item.parameters[i] = p[i];
+         }
+         std::unique_lock<std::shared_mutex> lock(mutex);
+         if (index.try_emplace(k[0], k[1], value).second) {
+            // O_APPEND writes the whole record at the end, even if another process appends too.
+            if (::write(fd, &item, sizeof(item)) != static_cast<ssize_t>(sizeof(item))) {
+               throw std::runtime_error("Can't Write memo file");
+            }
+         }
+      }
+      /**
+       * @brief size() will return number of values in memo.
+       */
+      uint64_t size() {
+         std::shared_lock<std::shared_mutex> lock(mutex);
+         return index.size();
+      }
+      /**
+       * @brief getHits() will return number of values found by find().
+       */
+      uint64_t getHits() const {
+         return hits;
+      }
+
+ private:
+      /**
+       * @brief header is the size of header of memo file and record is the size of one record.
+       */
+      static constexpr uint64_t header = 16, record = sizeof(hbv_memo_record);
+      /**
+       * @brief fd is the file descriptor of memo file opened for appending.
+       */
+      int fd;
+      /**
+       * @brief address and length of the mapped memo file, and indexed is the end of the records in index.
+       */
+      void *address = nullptr;
+      uint64_t length = 0;
+      uint64_t indexed = header;
+      /**
+       * @brief bits is bits of mantissa kept and salt is the digest of forcing and objective.
+       */
+      uint64_t bits;
+      uint64_t salt;
+      /**
+       * @brief index stores the second key and the value by the first key.
+       */
+      std::unordered_map<uint64_t, std::pair<uint64_t, double>> index;
+      std::shared_mutex mutex;
+      std::atomic<uint64_t> hits = 0;
+      /**
+       * @brief Add records of the mapped file from indexed to end into index, mutex should be locked.
+       */
+      void readRecords(uint64_t end) {
+         const char *data = static_cast<const char *>(address);
+         for (; indexed < end; indexed += record) {
+            hbv_memo_record item;
+            std::memcpy(&item, data + indexed, record);
+            index.try_emplace(item.key[0], item.key[1], item.value);
+         }
+      }
+      /**
+       * @brief Map the memo file again if it has grown and add the new whole records into index (records
+       * appended by this program are read again, they are already there). mutex should be locked.
+       */
+      void refresh() {
+         struct stat status;
+         if (::fstat(fd, &status) != 0) {
+            return;
+         }
+         const uint64_t size = static_cast<uint64_t>(status.st_size);
+         const uint64_t end = (size < header) ? header : header + (size - header) / record * record;
+         if (end <= indexed) {
+            return;
+         }
+         unmap();
+         void *data = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+         if (data == MAP_FAILED) {
+            return;
+         }
+         address = data;
+         length = size;
+         readRecords(end);
+      }
+      /**
+       * @brief Unmap the memo file if it is mapped.
+       */
+      void unmap() {
+         if (address != nullptr) {
+            ::munmap(address, length);
+            address = nullptr;
+            length = 0;
+         }
+      }
+      /**
+       * @brief Get the two keys of parameters, each parameter is rounded to bits of mantissa first.
+       */
+      std::array<uint64_t, 2> key(const hbv_parameters &p) const {
+         std::array<uint64_t, 2> k = {salt, ~salt};
+         const uint64_t drop = 52 - bits;
+         for (uint64_t i = 0; i < 16; i++) {
+            uint64_t value = std::bit_cast<uint64_t>(p[i] == 0 ? 0.0 : p[i]);  // -0 is the same as 0
+            if (drop > 0) {
+               value = (value + (uint64_t(1) << (drop - 1))) >> drop;
+            }
+            k[0] = hbv_seed(k[0] ^ value, i);
+            k[1] = hbv_seed(k[1] ^ value, i + 16);
+         }
+         return k;
+      }
+};
@@ -0,0 +1,198 @@
+// Copyright 2022 Tianshuo Li
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include "hbv_kernel.hpp"
+/**
+ * @brief hbv_log_epsilon is added to observed and calculated discharge before log in log-NSE,
+ * so days with no discharge can still be used.
+ */
+inline constexpr double hbv_log_epsilon = 0.01;
+/**
+ * @brief hbv_kahan sums values with Kahan's compensated summation, so the sum of a long series
+ * of small values does not lose the last digits.
+ */
+struct hbv_kahan {
+    double sum = 0;
+    double compensation = 0;
+    void add(double value) {
+        double y = value - compensation;
+        double t = sum + y;
+        compensation = (t - sum) - y;
+        sum = t;
+    }
+};
+/**
+ * @brief Get the q-quantile of sorted values with linear interpolation between closest ranks.
+ * @param sorted values sorted from small to large, NaN is not allowed
+ * @param q quantile between 0 and 1
+ * @return double quantile value, NaN if there is no value
+ */
+inline double hbv_quantile(std::span<const double> sorted, double q) {
+    if (sorted.empty()) {
+        return std::nan("");
+    }
+    const double position = q * static_cast<double>(sorted.size() - 1);
+    const uint64_t low = static_cast<uint64_t>(std::floor(position));
+    const uint64_t high = std::min<uint64_t>(low + 1, sorted.size() - 1);
+    return sorted[low] + (position - static_cast<double>(low)) * (sorted[high] - sorted[low]);
+}
+/**
+ * @brief hbv_metrics computes NSE, KGE, log-NSE, RMSE and PBIAS together in one pass over the days,
+ * nothing of each day is stored. Means, variances and covariance of observed and calculated discharge
+ * are updated with Welford's method and squared errors are summed with hbv_kahan.
+ * NSE is hbv_running_nse, so it keeps the average of Q of hbv_average_q() used by every NSE of this program.
+ * Other metrics use mean of the days compared (all days except the first one).
+ */
+struct hbv_metrics {
+    /**
+     * @brief nse stores parts of NSE.
+     */
+    hbv_running_nse nse;
+    /**
+     * @brief count is number of days compared.
+     */
+    uint64_t count = 0;
+    /**
+     * @brief Mean and sum of squared differences from mean of observed (Q) and calculated (Qt)
+     * discharge, and the co-moment C of them.
+     */
+    double meanQ = 0, meanQt = 0, M2Q = 0, M2Qt = 0, C = 0;
+    /**
+     * @brief Mean and sum of squared differences from mean of log of observed discharge.
+     */
+    double meanLogQ = 0, M2LogQ = 0;
+    /**
+     * @brief SSE and SSELog are sums of squared errors of discharge and of log of discharge.
+     */
+    hbv_kahan SSE, SSELog;
+    /**
+     * @brief Add one day.
+     * @param first true for the first day of model, which is not compared
+     * @param Q observed discharge in that day
+     * @param Qt calculated discharge in that day
+     */
+    void add(bool first, double Q, double Qt) {
+        nse.add(first, Q, Qt);
+        if (first) {
+            return;
+        }
+        count++;
+        const double n = static_cast<double>(count);
+        const double dQ = Q - meanQ;
+        meanQ += dQ / n;
+        const double dQt = Qt - meanQt;
+        meanQt += dQt / n;
+        M2Q += dQ * (Q - meanQ);
+        M2Qt += dQt * (Qt - meanQt);
+        C += dQ * (Qt - meanQt);
+        const double logQ = std::log(Q + hbv_log_epsilon), logQt = std::log(Qt + hbv_log_epsilon);
+        const double dLogQ = logQ - meanLogQ;
+        meanLogQ += dLogQ / n;
+        M2LogQ += dLogQ * (logQ - meanLogQ);
+        SSE.add((Q - Qt) * (Q - Qt));
+        SSELog.add((logQ - logQt) * (logQ - logQt));
+    }
+    /**
+     * @brief Nash–Sutcliffe efficiency, the same as hbv_running_nse.
+     */
+    double NSE() const {
+        return nse.NSE();
+    }
+    /**
+     * @brief Kling–Gupta efficiency, 1 - sqrt((r - 1)^2 + (alpha - 1)^2 + (beta - 1)^2) with correlation r,
+     * ratio of standard deviation alpha and ratio of mean beta.
+     */
+    double KGE() const {
+        if (count == 0) {
+            return std::nan("");
+        }
+        double r = C / std::sqrt(M2Q * M2Qt);
+        double alpha = std::sqrt(M2Qt / M2Q);
+        double beta = meanQt / meanQ;
+        return 1 - std::sqrt((r - 1) * (r - 1) + (alpha - 1) * (alpha - 1) + (beta - 1) * (beta - 1));
+    }
+    /**
+     * @brief NSE of log(Q + hbv_log_epsilon), it gives more weight to low flow.
+     */
+    double logNSE() const {
+        return (count == 0) ? std::nan("") : 1 - SSELog.sum / M2LogQ;
+    }
+    /**
+     * @brief Root mean square error, in the unit of discharge.
+     */
+    double RMSE() const {
+        return (count == 0) ? std::nan("") : std::sqrt(SSE.sum / static_cast<double>(count));
+    }
+    /**
+     * @brief Percent bias, 100 * sum(Qt - Q) / sum(Q). Positive value means discharge is over estimated.
+     */
+    double PBIAS() const {
+        return (count == 0) ? std::nan("") : 100 * (meanQt - meanQ) / meanQ;
+    }
+};
+/**
+ * @brief hbv_metric stores name and getter of one metric of hbv_metrics. efficiency is true when 1 is
+ * the best value and higher is better, those metrics can be used as objective of calibration.
+ */
+struct hbv_metric {
+    const char *name;
+    const char *description;
+    bool efficiency;
+    double (hbv_metrics::*value)() const;
+};
+/**
+ * @brief hbv_metric_table is the list of metrics shown in reports. A new metric is added to
+ * hbv_metrics and to this table.
+ */
+inline constexpr std::array<hbv_metric, 5> hbv_metric_table = {{
+    {"NSE", "Nash-Sutcliffe efficiency", true, &hbv_metrics::NSE},
+    {"KGE", "Kling-Gupta efficiency", true, &hbv_metrics::KGE},
+    {"logNSE", "NSE of log discharge", true, &hbv_metrics::logNSE},
+    {"RMSE", "root mean square error", false, &hbv_metrics::RMSE},
+    {"PBIAS", "percent bias", false, &hbv_metrics::PBIAS},
+}};
+/**
+ * @brief Find a metric by name (case is ignored).
+ * @throw std::invalid_argument if there is no metric with that name
+ */
+inline const hbv_metric &findMetric(const std::string &name) {
+    auto lower = [](std::string text) {
+        for (char &c : text) {
+            c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+        }
+        return text;
+    };
+    for (const auto &metric : hbv_metric_table) {
+        if (lower(metric.name) == lower(name)) {
+            return metric;
+        }
+    }
+    throw std::invalid_argument("Unknown metric " + name);
+}
+/**
+ * @brief Run HBV model and return all metrics. Like hbv_evaluate(), it keeps the storages in local
+ * variables, so no vector will be allocated whatever the length of dataset.
+ * @param p parameters of model, range should be checked before
+ * @param Q discharge given by dataset
+ * @param P precipitation given by dataset
+ * @param T daily mean temperature given by dataset
+ * @return hbv_metrics
+ */
+inline hbv_metrics hbv_evaluate_metrics(const hbv_parameters &p, std::span<const double> Q,
+    std::span<const double> P, std::span<const double> T) {
+    hbv_state s = hbv_state::initial(p);
+    hbv_flux f;
+    hbv_metrics metrics;
+    for (uint64_t i = 0; i < Q.size(); i++) {
+        hbv_step(p, s, P[i], T[i], f);
+        metrics.add(i == 0, Q[i], f.Qt);
+    }
+    return metrics;
+}
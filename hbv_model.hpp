@@ -6,25 +6,86 @@
 #include <string>
 #include <cmath>
 #include <cstdlib>
+#include <span>
+#include <array>
+#include <memory>
+#include <optional>
+#include "hbv_kernel.hpp"
+#include "hbv_metrics.hpp"
+#include "hbv_profile.hpp"
 /**
- * @brief hbv_model class will build HBV model with given dataset and parameters.
+ * @brief hbv_result_t stores views of the daily series used in result file. Views are valid
+ * as long as the hbv_model_t, nothing is copied.
+ */
+template <typename Real>
+struct hbv_result_t {
+    /**
+     * @brief RF, ET, storage (SLZ + SUZ), SLZ and SUZ have one value for each day.
+     */
+    std::span<const Real> RF, ET, storage, SLZ, SUZ;
+    /**
+     * @brief AET, Qt and Q_a start from day 2, since there is no value on the first day.
+     */
+    std::span<const Real> AET, Qt, Q_a;
+};
+/**
+ * @brief hbv_result is result of hbv_model in double.
+ */
+using hbv_result = hbv_result_t<double>;
+/**
+ * @brief printMetrics() will print NSE value with suggestion and other metrics to console.
+ * It is used by hbv_model::getNSE_AD() and by models that only keep metrics.
+ * @param metrics metrics of HBV model
+ */
+inline void printMetrics(const hbv_metrics &metrics) {
+    const double NSE = metrics.NSE();
+    std::cout.precision(3);
+    std::cout<< "The NSE value is " << NSE <<"\n\n";
+    std::cout<< "NSE is a value to evaluate performance of model. "
+        <<"A value closer to 1 mean better performance on the model just like R^2."
+        <<"\n\n";
+    std::cout<< "  Suggestion: \n";
+    if (NSE == 1) {
+        std::cout<< "The result seems prefect but please check if the dataset is over fitted.\n";
+    } else if (NSE< 1 && NSE >= 0.9) {
+        std::cout<< "The result seems prefect. But over fitted maybe a potential issue. \n";
+    } else if (NSE< 0.9 && NSE >= 0.7) {
+        std::cout<< "The result seems good. \n";
+    } else if (NSE< 0.7 && NSE >= 0.4) {
+        std::cout<< "The result seems acceptable. \n";
+    } else if (NSE< 0.4) {
+        std::cout<< "The result seems not acceptable. Please choose other model or check dataset.\n";
+    }
+    std::cout<< "\n  Other metrics: \n";
+    for (const auto &metric : hbv_metric_table) {
+        std::cout<< "  " << metric.name << " (" << metric.description << "): "
+            << (metrics.*metric.value)() << "\n";
+    }
+    std::cout<< "KGE and logNSE are read as NSE (1 is perfect). RMSE is in the unit of discharge, "
+        << "and PBIAS is the percent of discharge over estimated (negative when under estimated).\n";
+}
+/**
+ * @brief hbv_model_t class will build HBV model with given dataset and parameters.
  * It included the function that can calculated predictions value and NSE, and provide 
  * function with return value.
+ * Real is the scalar type of parameters, storages and daily series (double, or float for
+ * float32 mode). Dataset stays in double and metrics are always summed in double.
  */
-class hbv_model {
+template <typename Real>
+class hbv_model_t {
  public:
       /**
-       * @brief This vector are use to storing Q(runoff/discharge) from dataset.
+       * @brief This view are use to storing Q(runoff/discharge) from dataset.
        */
-      std::vector<double> Q;
+      std::span<const double> Q;
       /**
-       * @brief This vector are use to storing P(precipitation) from dataset.
+       * @brief This view are use to storing P(precipitation) from dataset.
        */
-      std::vector<double> P;
+      std::span<const double> P;
       /**
-       * @brief This vector are use to storing T(daily mean temperature) from dataset.
+       * @brief This view are use to storing T(daily mean temperature) from dataset.
        */
-      std::vector<double> T;
+      std::span<const double> T;
       /**
        * @brief parameters vector are used to store parameters, and it store the parameters
        * as following:
@@ -55,97 +116,147 @@ class hbv_model {
        * Please note this constructor will not check the size of each vectors. Please check that before
        * construct hbv model.
        */
-      hbv_model(const std::vector<double> &Qz, const std::vector<double> &P1,
+      hbv_model_t(const std::vector<double> &Qz, const std::vector<double> &P1,
       const std::vector<double> &T1, const std::vector<double> &parameters1) {
+         forcing = std::make_shared<const std::array<std::vector<double>, 3>>(
+            std::array<std::vector<double>, 3>{Qz, P1, T1});
+         Q = (*forcing)[0];
+         P = (*forcing)[1];
+         T = (*forcing)[2];
+         parameters = parameters1;
+         setParameter();
+         getResult();
+      }
+      /**
+       * @brief Construct a new hbv model model with views of dataset, the data is not copied
+       * (for example views of a mapped cache file given by hbv_forcing).
+       * Please note Q, P and T should stay alive as long as the model.
+       * @param Qz discharge given bt dataset
+       * @param P1 precipitation given by dataset
+       * @param T1 daily mean temperature given by dataset
+       * @param parameters1 parameters vector that included basic elements for hbv model calculations
+       */
+      hbv_model_t(std::span<const double> Qz, std::span<const double> P1,
+      std::span<const double> T1, const std::vector<double> &parameters1) {
          Q = Qz;
          P = P1;
          T = T1;
          parameters = parameters1;
          setParameter();
-         getAverageQ();
+         getResult();
+      }
+      /**
+       * @brief Construct a new hbv model model with a shared read-only dataset, such as hbv_shared_forcing.
+       * The data is not copied and the model keeps a reference of dataset, so the views stay valid
+       * however long the model lives, and many models can share one dataset.
+       * @param dataset1 dataset with getQ(), getP() and getT()
+       * @param parameters1 parameters vector that included basic elements for hbv model calculations
+       */
+      template <typename Dataset>
+      hbv_model_t(std::shared_ptr<const Dataset> dataset1, const std::vector<double> &parameters1)
+         : hbv_model_t(dataset1->getQ(), dataset1->getP(), dataset1->getT(), parameters1) {
+         dataset = std::move(dataset1);
+      }
+      /**
+       * @brief reset() will run HBV model again with new parameters on the same dataset. Series are
+       * written into the vectors of the last run, so after the first run no memory is allocated
+       * (the model can be kept by each thread as a workspace of a parameters sweep).
+       * @param parameters1 parameters vector with the same order as parameters
+       */
+      void reset(const std::vector<double> &parameters1) {
+         parameters.assign(parameters1.begin(), parameters1.end());
+         setParameter();
          getResult();
       }
       /**
        * @brief getNSE() will return NSE value from HBV model
        * @return double NSE value
        */
-      double getNSE() {
+      double getNSE() const {
          return NSE;
       }
       /**
-       * @brief getRF() will return RF vector from HBV model
-       * @return std::vector<double>  RF
+       * @brief getMetrics() will return NSE, KGE, log-NSE, RMSE and PBIAS of HBV model, they are
+       * calculated in the same pass as the model.
+       * @return const hbv_metrics& metrics
        */
-      std::vector<double> getRF() {
+      const hbv_metrics &getMetrics() const {
+         return metrics;
+      }
+      /**
+       * @brief getRF() will return view of RF vector from HBV model
+       * @return std::span<const Real> RF
+       */
+      std::span<const Real> getRF() const {
          return RF;
       }
       /**
-       * @brief getET() will return ET vector from HBV model
-       * @return std::vector<double> ET
+       * @brief getET() will return view of ET vector from HBV model
+       * @return std::span<const Real> ET
        */
-      std::vector<double> getET() {
+      std::span<const Real> getET() const {
          return ET;
       }
       /**
-       * @brief getAET() will return AET vector from HBV model
+       * @brief getAET() will return view of AET vector from HBV model, it starts from day 2
+       * @return std::span<const Real> AET
        */
-      std::vector<double> getAET() {
+      std::span<const Real> getAET() const {
          return AET;
       }
       /**
-       * @brief getSLZ() will return SLZ vector from HBV model
-       * @return std::vector<double> SLZ
+       * @brief getSLZ() will return view of SLZ vector from HBV model
+       * @return std::span<const Real> SLZ
        */
-      std::vector<double> getSLZ() {
+      std::span<const Real> getSLZ() const {
          return SLZ;
       }
       /**
-       * @brief getSUZ() will return SUZ vector from HBV model
-       * @return std::vector<double> SUZ
+       * @brief getSUZ() will return view of SUZ vector from HBV model
+       * @return std::span<const Real> SUZ
        */
-      std::vector<double> getSUZ() {
+      std::span<const Real> getSUZ() const {
          return SUZ;
       }
       /**
-       * @brief getSQt() will return Qt vector from HBV model
-       * @return std::vector<double> Qt
+       * @brief getSQt() will return view of Qt vector from HBV model
+       * @return std::span<const Real> Qt
        */
-      std::vector<double> getQt() {
+      std::span<const Real> getQt() const {
          return Qt;
       }
       /**
-       * @brief getQa() will return Q_a vector from HBV model
-       * @return std::vector<double> Q_a
+       * @brief getQa() will return view of Q_a vector from HBV model
+       * @return std::span<const Real> Q_a
        */
-      std::vector<double> getQa() {
+      std::span<const Real> getQa() const {
          return Q_a;
       }
+      /**
+       * @brief getStorage() will return view of storage (SLZ + SUZ) of each day, it is
+       * calculated once with the model.
+       * @return std::span<const Real> storage
+       */
+      std::span<const Real> getStorage() const {
+         return storage;
+      }
+      /**
+       * @brief getResults() will return views of all series used in result file.
+       * @return hbv_result_t views of result
+       */
+      hbv_result_t<Real> getResults() const {
+         return {RF, ET, storage, SLZ, SUZ, AET, Qt, Q_a};
+      }
       /**
        * @brief getNSE_AD() will overview of NSE value and suggestion based on dataset,
        * and print those content to console.
        */
       void getNSE_AD() {
-         std::cout.precision(3);
          if (NSE == -2) {
             std::cout<< "The HBV model is not initialized or the value is not acceptable" <<"\n";
             std::cout<< "Please check the dataset and parameters or initialized the HBV model" <<"\n";
          } else {
-            std::cout<< "The NSE value is " << NSE <<"\n\n";
-            std::cout<< "NSE is a value to evaluate performance of model. "
-               <<"A value closer to 1 mean better performance on the model just like R^2."
-               <<"\n\n";
-            std::cout<< "  Suggestion: \n";
-            if (NSE == 1) {
-               std::cout<< "The result seems prefect but please check if the dataset is over fitted.\n";
-            } else if (NSE< 1 && NSE >= 0.9) {
-               std::cout<< "The result seems prefect. But over fitted maybe a potential issue. \n";
-            } else if (NSE< 0.9 && NSE >= 0.7) {
-               std::cout<< "The result seems good. \n";
-            } else if (NSE< 0.7 && NSE >= 0.4) {
-               std::cout<< "The result seems acceptable. \n";
-            } else if (NSE< 0.4) {
-               std::cout<< "The result seems not acceptable. Please choose other model or check dataset.\n";
-            }
+            printMetrics(metrics);
          }
       }
 
@@ -157,167 +268,177 @@ class hbv_model {
        */
       double NSE = -2;
       /**
-       * @brief averageQ is the average of Q (runoff/discharge) value from dataset. It will use 
-       * to calculate NSE value.
+       * @brief metrics stores NSE, KGE, log-NSE, RMSE and PBIAS summed day by day in getResult().
+       */
+      hbv_metrics metrics;
+      /**
+       * @brief par stores parameters value checked in double, it is converted to Real for calculation.
+       * Detailed information about each parameters can be found in Readme file.
        */
-      double averageQ;
+      hbv_parameters par;
       /**
-       * @brief those value are declare as parameters value for calculation. Detailed information
-       * about each parameters can be found in Readme file.
+       * @brief forcing stores copy of Q, P and T when the model is built from vectors. It is
+       * shared by copies of the model, so views of a copied model are still valid.
        */
-      double T_tr, DF, FC, beta, alpha, LP, k0, k1, k2, Lsuz, Cperc, SD_i, SUZ_i, SLZ_i, SM_i, A;
+      std::shared_ptr<const std::array<std::vector<double>, 3>> forcing;
+      /**
+       * @brief dataset keeps the shared dataset given to constructor alive, it is empty for other constructors.
+       */
+      std::shared_ptr<const void> dataset;
        /**
        * @brief Q_a are used to store Q(run off/discharge) per day in that area from HBV model.
        */
-      std::vector<double> Q_a;
+      std::vector<Real> Q_a;
       /**
        * @brief S_m are used to store snowmelt rate per day from HBV model.
        */
-      std::vector<double> S_m;
+      std::vector<Real> S_m;
       /**
        * @brief SD are used to store SnowDepth per day based on precipitation and temperature.
        */
-      std::vector<double> SD;
+      std::vector<Real> SD;
       /**
        * @brief SLZ are used to store amount of groundwater in the lower reservoir per day from calculation.
        */
-      std::vector<double> SLZ;
+      std::vector<Real> SLZ;
       /**
        * @brief SM are used to store actual soil moisture per day from calculation.
        */
-      std::vector<double> SM;
+      std::vector<Real> SM;
       /**
        * @brief ASM are used to store actual snow melt per day from calculation.
        */
-      std::vector<double> ASM;
+      std::vector<Real> ASM;
       /**
        * @brief RF are used to store effective rainfall per day from calculation.
        */
-      std::vector<double> RF;
+      std::vector<Real> RF;
       /**
        * @brief ET are used to store potential evapotranspiration per day from calculation.
        */
-      std::vector<double> ET;
+      std::vector<Real> ET;
       /**
        * @brief AET are used to store actual evapotranspiration per day from calculation.
        */
-      std::vector<double> AET;
+      std::vector<Real> AET;
       /**
        * @brief F are used to store water flex per day from calculation.
        */
-      std::vector<double> F;
+      std::vector<Real> F;
       /**
        * @brief SUZ are used to store amount of groundwater in the upper reservoir per day from calculation.
        */
-      std::vector<double> SUZ;
+      std::vector<Real> SUZ;
       /**
        * @brief Q0 are used to store amount of surface flow response per day.
        */
-      std::vector<double> Q0;
+      std::vector<Real> Q0;
       /**
        * @brief Q1 are used to store amount of interflow response per day.
        */
-      std::vector<double> Q1;
+      std::vector<Real> Q1;
       /**
        * @brief Q2 are used to store amount of base flow response per day.
        */
-      std::vector<double> Q2;
+      std::vector<Real> Q2;
       /**
        * @brief Qt are total amount of flow(runoff/discharge).
        */
-      std::vector<double> Qt;
+      std::vector<Real> Qt;
       /**
-       * @brief Get the Average value of Q(run off/discharge).
+       * @brief storage are total amount of groundwater (SLZ + SUZ) per day.
        */
-      void getAverageQ() {
-         double a = 0;  // used to store total value of Q.
-         for (uint64_t i = 1; i < Q.size(); i++) {
-            a += Q[i];
-         }
-         averageQ = a/static_cast<double>(Q.size());
-      }
+      std::vector<Real> storage;
+      /**
+       * @brief SG are used to store snow gain per day from calculation.
+       */
+      std::vector<Real> SG;
+      /**
+       * @brief hbv_prepass_key is the forcing and parameters that S_m, RF, SG and ET were calculated with.
+       */
+      struct hbv_prepass_key {
+         const double *P, *T;
+         uint64_t days;
+         Real T_tr, DF, alpha;
+         bool operator==(const hbv_prepass_key &) const = default;
+      };
+      /**
+       * @brief prepass is the key of S_m, RF, SG and ET, empty before the first run.
+       */
+      std::optional<hbv_prepass_key> prepass;
       /**
-       * @brief Start to do calculation of HBV model.
+       * @brief Start to do calculation of HBV model day by day with hbv_step().
        * For detailed information about HBV equation, please check readme file.
        */
       void getResult() {
-         double SG = 0;   // SG as snow gain in calculation.
-         double temp1 = 0;
-         // temp1 is to store the part 1 value of NSE value.
-         double temp2 = 0;
-         // temp2 is to store the part 2 value of NSE value.(Detail information can be found in readme file)
-         SD.push_back(SD_i);
-         SLZ.push_back(SLZ_i);
-         SUZ.push_back(SUZ_i);
-         SM.push_back(SM_i);
-         for (uint64_t i = 0; i < Q.size(); i++) {
-            SG = 0;
-            if (T[i] > T_tr) {
-               S_m.push_back(DF * (T[i] - T_tr));
-            } else {
-               S_m.push_back(0);
-            }
-            if (S_m[i] > SD[i]) {
-               ASM.push_back(SD[i]);
-            } else {
-               ASM.push_back(S_m[i]);
-            }
-            if (T[i] < T_tr) {
-               SG = P[i];
-               RF.push_back(0);
-            } else {
-               SG = 0;
-               RF.push_back(P[i]);
+         HBV_PROFILE_SCOPE(simulate);
+         const hbv_parameters_t<Real> p = par.template as<Real>();
+         hbv_state_t<Real> state = hbv_state_t<Real>::initial(p);
+         hbv_flux_t<Real> flux;
+         metrics = hbv_metrics();
+         // S_m, RF, SG and ET only depend on forcing, T_tr, DF and alpha, they are calculated for all days
+         // first and kept when reset() only changes other parameters.
+         const hbv_prepass_key key = {P.data(), T.data(), P.size(), p.T_tr, p.DF, p.alpha};
+         if (!(prepass && *prepass == key)) {
+            for (auto *series : {&S_m, &RF, &SG, &ET}) {
+               series->resize(Q.size());
             }
+            hbv_forcing_fluxes(p, P.first(Q.size()), T.first(Q.size()), S_m.data(), RF.data(), SG.data(), ET.data());
+            prepass = key;
+         }
+         // clear() keeps the capacity, so reset() reuses the vectors of the last run.
+         for (auto *series : {&Q_a, &SD, &SLZ, &SM, &ASM, &AET, &F, &SUZ, &Q0, &Q1, &Q2, &Qt}) {
+            series->clear();
+            series->reserve(Q.size());
+         }
+         SD.push_back(state.SD);
+         SLZ.push_back(state.SLZ);
+         SUZ.push_back(state.SUZ);
+         SM.push_back(state.SM);
+         for (uint64_t i = 0; i < Q.size(); i++) {
+            flux.S_m = S_m[i];
+            flux.RF = RF[i];
+            flux.SG = SG[i];
+            flux.ET = ET[i];
+            hbv_storage_step(p, state, flux);
+            ASM.push_back(flux.ASM);
             if (i+1 < Q.size()) {
-               SD.push_back(SD[i] + SG - ASM[i]);
-            }
-            if (T[i] >= 0) {
-               ET.push_back(alpha * T[i]);
-            } else {
-               ET.push_back(0);
+               SD.push_back(state.SD);
             }
             if (i > 0) {
-               AET.push_back(ET[i]* std::min(((SM[i-1]) / (FC*LP)), 1.0));
-               F.push_back((pow(SM[i-1] / FC, beta)) * (RF[i] + ASM[i]));
-               SM.push_back(SM[i-1] + RF[i] + ASM[i] - AET[i-1] - F[i-1]);
-               if (SUZ[i-1] > Lsuz) {
-                  Q0.push_back(k0*(SUZ[i-1] - Lsuz));
-               } else {
-                  Q0.push_back(0);
-               }
-               Q1.push_back(k1*SUZ[i-1]);
-               Q2.push_back(std::max(k2 * SLZ[i-1], 0.0));
-               Qt.push_back(Q0[i-1]+Q1[i-1] + Q2[i-1]);
-               Q_a.push_back((Qt[i-1]*0.001) * A);
-               SUZ.push_back(std::max((SUZ[i-1] + F[i-1] - Q0[i-1] - Q1[i-1] - Cperc), 0.0));
-               SLZ.push_back(SLZ[i-1] + std::min(Cperc, SUZ[i-1]) - Q2[i-1]);
-               temp1 += pow(Q[i] - Qt[i-1], 2);
-               temp2 += pow(Q[i] - averageQ, 2);
+               AET.push_back(flux.AET);
+               F.push_back(flux.F);
+               SM.push_back(state.SM);
+               Q0.push_back(flux.Q0);
+               Q1.push_back(flux.Q1);
+               Q2.push_back(flux.Q2);
+               Qt.push_back(flux.Qt);
+               Q_a.push_back(flux.Q_a);
+               SUZ.push_back(state.SUZ);
+               SLZ.push_back(state.SLZ);
             }
+            metrics.add(i == 0, Q[i], flux.Qt);
+         }
+         storage.resize(SLZ.size());
+         for (uint64_t i = 0; i < SLZ.size(); i++) {
+            storage[i] = SLZ[i] + SUZ[i];
          }
-         NSE = 1- temp1 / temp2;
+#if HBV_PROFILE
+         uint64_t bytes = forcing ? (Q.size() + P.size() + T.size()) * sizeof(double) : 0;
+         for (auto *series : {&Q_a, &S_m, &SD, &SLZ, &SM, &ASM, &RF, &ET, &AET, &F, &SUZ, &Q0, &Q1, &Q2, &Qt, &storage,
+            &SG}) {
+            bytes += series->capacity() * sizeof(Real);
+         }
+         HBV_PROFILE_COUNT(peak_vector_bytes, bytes);
+#endif
+         NSE = metrics.NSE();
       }
       /**
        * @brief Set the parameter based on given vector and check the range of each parameters.
        */
       void setParameter() {
-         T_tr = parameters[0];
-         DF = parameters[1];
-         FC = parameters[2];
-         beta = parameters[3];
-         alpha = parameters[4];
-         LP = parameters[5];
-         k0 = parameters[6];
-         k1 = parameters[7];
-         k2 = parameters[8];
-         Lsuz = parameters[9];
-         Cperc = parameters[10];
-         SD_i = parameters[11];
-         SUZ_i = parameters[12];
-         SLZ_i = parameters[13];
-         SM_i = parameters[14];
-         A = parameters[15];
+         HBV_PROFILE_SCOPE(set_parameter);
+         par = hbv_parameters::fromVector(parameters);
          try {
             checkRange();
          }
@@ -329,63 +450,13 @@ class hbv_model {
       /**
        * @brief checkRange() will check range of all parameters. If the value is not in range,
        * it will set to lower bound and throw a domain_error.
-       * For detailed range information, please check readme file.
+       * For detailed range information, please check readme file or hbv_bounds.
        */
       void checkRange() {
-         if (!inRange(T_tr, -1.5, 2.5)) {
-            T_tr = -1.5;
-            throw std::domain_error("The range of T_tr should be between -1.5 and 2.5");
-         }
-         if (!inRange(DF, 1, 10)) {
-            DF = 1;
-            throw std::domain_error("The range of DF should be between 1 and 10");
-         }
-         if (!inRange(FC, 50, 500)) {
-            FC = 50;
-            throw std::domain_error("The range of FC should be between 50 and 500");
-         }
-         if (!inRange(beta, 1, 6)) {
-            beta = 1;
-            throw std::domain_error("The range of beta should be between 1 and 6");
-         }
-         if (!inRange(alpha, 0.5, 1.25)) {
-            alpha = 0.5;
-            throw std::domain_error("The range of alpha should be between 0.5 and 1.25");
-         }
-         if (!inRange(LP, 0.1, 0.9)) {
-            LP = 0.1;
-            throw std::domain_error("The range of LP should be between 0.1 and 0.9");
-         }
-         if (!inRange(k0, 0.01, 0.8)) {
-            k0 = 0.01;
-            throw std::domain_error("The range of k0 should be between 0.01 and 0.8");
-         }
-         if (!inRange(k1, 0.01, 0.4)) {
-            k1 = 0.01;
-            throw std::domain_error("The range of k1 should be between 0.01 and 0.4");
-         }
-         if (!inRange(k2, 0.001, 0.15)) {
-            k2 = 0.001;
-            throw std::domain_error("The range of k2 should be between 0.001 and 0.15");
-         }
-         if (!inRange(Lsuz, 1, 100)) {
-            Lsuz = 1;
-            throw std::domain_error("The range of Lsuz should be between 1 and 100");
-         }
-         if (!inRange(Cperc, 0.01, 6)) {
-            Cperc = 0.01;
-            throw std::domain_error("The range of Cperc should be between 0.01 and 6");
-         }
-      }
-      /**
-       * @brief This function will check value in the range.
-       * @param value value want to check
-       * @param low lower bound of parameters
-       * @param high higher bound of parameters
-       * @return true value is in the range
-       * @return false value is not in the range
-       */
-      bool inRange(double value, double low, double high) {
-         return ((low <= value) && (value <= high));
+         par.checkRange();
       }
 };
+/**
+ * @brief hbv_model is HBV model calculated in double, it is used by most of the program.
+ */
+using hbv_model = hbv_model_t<double>;
@@ -0,0 +1,330 @@
+// Copyright 2022 Tianshuo Li
+#pragma once
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+/**
+ * @brief Get the default number of threads, which is the number of cores.
+ * @return uint64_t number of threads, at least 1
+ */
+inline uint64_t hbv_threads() {
+    return std::max<uint64_t>(1, std::thread::hardware_concurrency());
+}
+/**
+ * @brief Mix seed and stream number into a new seed (splitmix64). It is used to give every
+ * task its own random number generator, so result will not depend on number of threads.
+ * @param seed seed given by user
+ * @param stream number of task
+ * @return uint64_t seed for that task
+ */
+inline uint64_t hbv_seed(uint64_t seed, uint64_t stream) {
+    uint64_t z = seed + 0x9E3779B97F4A7C15ULL * (stream + 1);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+/**
+ * @brief hbv_thread_pool keeps threads alive and runs parallel loops with work stealing.
+ * Each thread owns a part of the loop and takes tasks from the front of it; when its own part
+ * is empty, it steals the back half of the largest part of other threads. So threads stay busy
+ * even if some tasks take longer than others. The thread calling parallel_for() is worker 0.
+ * Please note parallel_for() should not be called again inside a task of the same pool.
+ */
+class hbv_thread_pool {
+ public:
+      /**
+       * @brief Construct a new thread pool
+       * @param threads1 number of workers including the calling thread
+       */
+      explicit hbv_thread_pool(uint64_t threads1) {
+         threads = std::max<uint64_t>(1, threads1);
+         part = std::vector<range>(threads);
+         for (uint64_t w = 1; w < threads; w++) {
+            pool.emplace_back([this, w]() { work(w); });
+         }
+      }
+      hbv_thread_pool(const hbv_thread_pool &) = delete;
+      hbv_thread_pool &operator=(const hbv_thread_pool &) = delete;
+      /**
+       * @brief Stop all threads.
+       */
+      ~hbv_thread_pool() {
+         {
+            std::lock_guard<std::mutex> lock(job_mutex);
+            stop = true;
+         }
+         job_start.notify_all();
+         for (auto &thread : pool) {
+            thread.join();
+         }
+      }
+      /**
+       * @brief size() will return number of workers.
+       */
+      uint64_t size() const {
+         return threads;
+      }
+      /**
+       * @brief Run fn(i, worker) for i in [0, n) and wait until all finished. worker is the index
+       * of thread in [0, size()) and can be used to choose workspace of that thread. The first
+       * exception thrown by fn is thrown again after all threads stopped.
+       * @param n number of tasks
+       * @param fn task function
+       */
+      void parallel_for(uint64_t n, const std::function<void(uint64_t, uint64_t)> &fn) {
+         {
+            std::lock_guard<std::mutex> lock(job_mutex);
+            for (uint64_t w = 0; w < threads; w++) {
+               std::lock_guard<std::mutex> part_lock(part[w].mutex);
+               part[w].begin = n * w / threads;
+               part[w].end = n * (w + 1) / threads;
+            }
+            job = &fn;
+            error = nullptr;
+            running = threads;
+            generation++;
+         }
+         job_start.notify_all();
+         run(0);
+         std::unique_lock<std::mutex> lock(job_mutex);
+         job_done.wait(lock, [this]() { return running == 0; });
+         job = nullptr;
+         if (error) {
+            std::rethrow_exception(error);
+         }
+      }
+
+ private:
+      /**
+       * @brief range stores the tasks [begin, end) owned by one worker.
+       */
+      struct range {
+         std::mutex mutex;
+         uint64_t begin = 0;
+         uint64_t end = 0;
+      };
+      /**
+       * @brief threads is number of workers including the calling thread.
+       */
+      uint64_t threads;
+      /**
+       * @brief part stores the tasks owned by each worker.
+       */
+      std::vector<range> part;
+      /**
+       * @brief pool stores the threads of worker 1 to threads-1.
+       */
+      std::vector<std::thread> pool;
+      /**
+       * @brief job_mutex protects job, generation, running, error and stop.
+       */
+      std::mutex job_mutex;
+      /**
+       * @brief job_start wakes up workers for a new job, job_done wakes up the calling thread
+       * when all workers finished.
+       */
+      std::condition_variable job_start, job_done;
+      /**
+       * @brief job is the task function of current parallel loop.
+       */
+      const std::function<void(uint64_t, uint64_t)> *job = nullptr;
+      /**
+       * @brief generation is increased for every job, so workers know there is a new one.
+       */
+      uint64_t generation = 0;
+      /**
+       * @brief running is number of workers still working on current job.
+       */
+      uint64_t running = 0;
+      /**
+       * @brief error stores the first exception thrown by current job.
+       */
+      std::exception_ptr error;
+      /**
+       * @brief stop is set when the pool is destroyed.
+       */
+      bool stop = false;
+      /**
+       * @brief Loop of worker thread, wait for a new job and run it.
+       */
+      void work(uint64_t w) {
+         uint64_t seen = 0;
+         while (true) {
+            {
+               std::unique_lock<std::mutex> lock(job_mutex);
+               job_start.wait(lock, [&]() { return stop || generation != seen; });
+               if (stop) {
+                  return;
+               }
+               seen = generation;
+            }
+            run(w);
+         }
+      }
+      /**
+       * @brief Take one task, first from own range and then by stealing from others.
+       * @return true if task i is taken, false if there is no task left
+       */
+      bool take(uint64_t w, uint64_t &i) {
+         {
+            std::lock_guard<std::mutex> lock(part[w].mutex);
+            if (part[w].begin < part[w].end) {
+               i = part[w].begin++;
+               return true;
+            }
+         }
+         while (true) {
+            // find the worker with most tasks left.
+            uint64_t victim = w, most = 0;
+            for (uint64_t v = 0; v < threads; v++) {
+               std::lock_guard<std::mutex> lock(part[v].mutex);
+               if (part[v].end - part[v].begin > most) {
+                  most = part[v].end - part[v].begin;
+                  victim = v;
+               }
+            }
+            if (most == 0) {
+               return false;
+            }
+            uint64_t begin, end;
+            {
+               std::lock_guard<std::mutex> lock(part[victim].mutex);
+               if (part[victim].begin >= part[victim].end) {
+                  continue;
+               }
+               end = part[victim].end;
+               begin = part[victim].end - (part[victim].end - part[victim].begin + 1) / 2;
+               part[victim].end = begin;
+            }
+            std::lock_guard<std::mutex> lock(part[w].mutex);
+            i = begin;
+            part[w].begin = begin + 1;
+            part[w].end = end;
+            return true;
+         }
+      }
+      /**
+       * @brief Run tasks of current job until no task left.
+       */
+      void run(uint64_t w) {
+         uint64_t i;
+         while (take(w, i)) {
+            try {
+               (*job)(i, w);
+            } catch (...) {
+               std::lock_guard<std::mutex> lock(job_mutex);
+               if (!error) {
+                  error = std::current_exception();
+               }
+               for (auto &p : part) {
+                  std::lock_guard<std::mutex> part_lock(p.mutex);
+                  p.begin = p.end;
+               }
+            }
+         }
+         std::lock_guard<std::mutex> lock(job_mutex);
+         if (--running == 0) {
+            job_done.notify_all();
+         }
+      }
+};
+/**
+ * @brief Run fn(i, worker) for i in [0, n) with a new hbv_thread_pool of given number of threads.
+ * For detailed information, please check hbv_thread_pool::parallel_for().
+ * @param n number of tasks
+ * @param threads number of threads
+ * @param fn task function
+ */
+inline void parallel_for(uint64_t n, uint64_t threads,
+    const std::function<void(uint64_t, uint64_t)> &fn) {
+    threads = std::max<uint64_t>(1, std::min(threads, n));
+    if (threads == 1) {
+        for (uint64_t i = 0; i < n; i++) {
+            fn(i, 0);
+        }
+        return;
+    }
+    hbv_thread_pool pool(threads);
+    pool.parallel_for(n, fn);
+}
+/**
+ * @brief hbv_queue is a bounded queue shared by threads. push() waits when the queue is full and
+ * pop() waits when the queue is empty, so a fast stage can not run too far ahead of a slow one.
+ */
+template <typename Item>
+class hbv_queue {
+ public:
+      /**
+       * @brief Construct a new queue
+       * @param capacity1 maximum number of items in queue
+       */
+      explicit hbv_queue(uint64_t capacity1) {
+         capacity = std::max<uint64_t>(1, capacity1);
+      }
+      /**
+       * @brief Add item to queue, wait if the queue is full.
+       */
+      void push(Item item) {
+         std::unique_lock<std::mutex> lock(mutex);
+         not_full.wait(lock, [this]() { return items.size() < capacity; });
+         items.push_back(std::move(item));
+         not_empty.notify_one();
+      }
+      /**
+       * @brief Take item from queue, wait if the queue is empty.
+       * @return false if the queue is empty and closed
+       */
+      bool pop(Item &item) {
+         std::unique_lock<std::mutex> lock(mutex);
+         not_empty.wait(lock, [this]() { return !items.empty() || producers == 0; });
+         if (items.empty()) {
+            return false;
+         }
+         item = std::move(items.front());
+         items.pop_front();
+         not_full.notify_one();
+         return true;
+      }
+      /**
+       * @brief Tell the queue how many threads will push items into it.
+       */
+      void open(uint64_t producers1) {
+         std::lock_guard<std::mutex> lock(mutex);
+         producers = producers1;
+      }
+      /**
+       * @brief Called by each producer when it finished. After the last one, pop() returns
+       * false once the queue is empty.
+       */
+      void close() {
+         std::lock_guard<std::mutex> lock(mutex);
+         if (producers > 0 && --producers == 0) {
+            not_empty.notify_all();
+         }
+      }
+
+ private:
+      /**
+       * @brief capacity is maximum number of items and producers is number of threads still pushing.
+       */
+      uint64_t capacity, producers = 1;
+      /**
+       * @brief items stores items in queue.
+       */
+      std::deque<Item> items;
+      /**
+       * @brief mutex protects items and producers.
+       */
+      std::mutex mutex;
+      /**
+       * @brief not_full and not_empty wake up threads waiting in push() and pop().
+       */
+      std::condition_variable not_full, not_empty;
+};
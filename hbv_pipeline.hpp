@@ -0,0 +1,256 @@
+// Copyright 2022 Tianshuo Li
+#pragma once
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "hbv_model.hpp"
+#include "hbv_io.hpp"
+#include "hbv_cache.hpp"
+#include "hbv_parallel.hpp"
+/**
+ * @brief hbv_basin stores the files of one basin in batch.
+ */
+struct hbv_basin {
+    std::string data_file, parameters_file, output_path;
+};
+/**
+ * @brief hbv_basin_result stores the result of one basin in batch. error is empty if the basin
+ * finished successfully, otherwise it is the reason of failure.
+ */
+struct hbv_basin_result {
+    uint64_t days = 0;
+    uint64_t skipped = 0;
+    double NSE = std::nan("");
+    std::string error;
+};
+/**
+ * @brief hbv_pipeline_options stores number of threads of each stage and size of queues.
+ */
+struct hbv_pipeline_options {
+    uint64_t readers = 2;
+    uint64_t workers = hbv_threads();
+    uint64_t writers = 2;
+    uint64_t queue = 8;
+};
+/**
+ * @brief This function will read manifest file. Each line is "data_file,parameters_file,output_path",
+ * empty lines and lines start with '#' are skipped.
+ * @param manifest_file path of manifest file
+ * @return std::vector<hbv_basin> basins in the same order of file
+ * @throw std::runtime_error if the file can't be opened or a line is not in correct format
+ */
+inline std::vector<hbv_basin> readManifest(const std::string &manifest_file) {
+    std::ifstream input(manifest_file);
+    if (!input.is_open()) {
+        throw std::runtime_error("Can't Open " + manifest_file);
+    }
+    std::vector<hbv_basin> basins;
+    std::string line;
+    for (uint64_t t = 1; std::getline(input, line); t++) {
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        std::istringstream cells(line);
+        hbv_basin basin;
+        if (!std::getline(cells, basin.data_file, ',') || !std::getline(cells, basin.parameters_file, ',')
+            || !std::getline(cells, basin.output_path)) {
+            throw std::runtime_error("Line " + std::to_string(t) + " of " + manifest_file
+                + " should be data_file,parameters_file,output_path");
+        }
+        basins.push_back(basin);
+    }
+    return basins;
+}
+/**
+ * @brief This function will check if name matches pattern, '*' matches any characters and
+ * '?' matches one character.
+ */
+inline bool matchPattern(const std::string &name, const std::string &pattern) {
+    uint64_t n = 0, p = 0, star = std::string::npos, mark = 0;
+    while (n < name.size()) {
+        if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == name[n])) {
+            n++;
+            p++;
+        } else if (p < pattern.size() && pattern[p] == '*') {
+            star = p++;
+            mark = n;
+        } else if (star != std::string::npos) {
+            p = star + 1;
+            n = ++mark;
+        } else {
+            return false;
+        }
+    }
+    while (p < pattern.size() && pattern[p] == '*') {
+        p++;
+    }
+    return p == pattern.size();
+}
+/**
+ * @brief This function will find all data files matching pattern. Wildcard is only allowed in
+ * file name, for example all csv files in folder "data" is "data" + "/" + "*.csv".
+ * All basins use the same parameters file and the result of "name.csv" is written to
+ * "output_dir/name_result.csv".
+ * @param pattern pattern of data files
+ * @param parameters_file parameters file of all basins
+ * @param output_dir folder of result files
+ * @return std::vector<hbv_basin> basins sorted by data file
+ */
+inline std::vector<hbv_basin> globBasins(const std::string &pattern, const std::string &parameters_file,
+    const std::string &output_dir) {
+    std::filesystem::path path(pattern);
+    std::filesystem::path folder = path.has_parent_path() ? path.parent_path() : ".";
+    std::vector<hbv_basin> basins;
+    for (const auto &entry : std::filesystem::directory_iterator(folder)) {
+        if (entry.is_regular_file() && matchPattern(entry.path().filename().string(), path.filename().string())) {
+            std::filesystem::path output = std::filesystem::path(output_dir)
+                / (entry.path().stem().string() + "_result.csv");
+            basins.push_back({entry.path().string(), parameters_file, output.string()});
+        }
+    }
+    std::sort(basins.begin(), basins.end(), [](const hbv_basin &a, const hbv_basin &b) {
+        return a.data_file < b.data_file;
+    });
+    return basins;
+}
+/**
+ * @brief This function will run HBV model for all basins with 3 stages connected by bounded queues:
+ * reader threads read data file (or its cache file) and parameters file, worker threads build HBV model
+ * and writer threads write result files. So reading and writing files happen at the same time as calculation.
+ * A basin with error is recorded in its result and does not stop other basins.
+ * @param basins basins to run
+ * @param options number of threads and size of queues
+ * @return std::vector<hbv_basin_result> result of each basin, same order as basins
+ */
+inline std::vector<hbv_basin_result> runBasins(const std::vector<hbv_basin> &basins,
+    const hbv_pipeline_options &options) {
+    // parsed stores the input of one basin read by reader.
+    struct parsed {
+        uint64_t index;
+        std::vector<double> parameters;
+        hbv_forcing forcing;
+    };
+    // simulated stores the HBV model of one basin built by worker, model has views of forcing.
+    struct simulated {
+        uint64_t index;
+        hbv_forcing forcing;
+        std::unique_ptr<hbv_model> model;
+    };
+    std::vector<hbv_basin_result> results(basins.size());
+    hbv_queue<parsed> read_queue(options.queue);
+    hbv_queue<simulated> write_queue(options.queue);
+    const uint64_t readers = std::max<uint64_t>(1, options.readers);
+    const uint64_t workers = std::max<uint64_t>(1, options.workers);
+    const uint64_t writers = std::max<uint64_t>(1, options.writers);
+    read_queue.open(readers);
+    write_queue.open(workers);
+    std::atomic<uint64_t> next(0);
+    std::vector<std::thread> threads;
+    for (uint64_t r = 0; r < readers; r++) {
+        threads.emplace_back([&]() {
+            for (uint64_t i = next++; i < basins.size(); i = next++) {
+                try {
+                    parsed item;
+                    item.index = i;
+                    hbv_columns columns;
+                    readParameters(basins[i].parameters_file, item.parameters, columns);
+                    item.forcing = loadForcing(basins[i].data_file, columns);
+                    results[i].skipped = item.forcing.getReport().skipped;
+                    read_queue.push(std::move(item));
+                } catch (const std::exception &e) {
+                    results[i].error = e.what();
+                }
+            }
+            read_queue.close();
+        });
+    }
+    for (uint64_t w = 0; w < workers; w++) {
+        threads.emplace_back([&]() {
+            parsed item;
+            while (read_queue.pop(item)) {
+                try {
+                    auto model = std::make_unique<hbv_model>(item.forcing.getQ(), item.forcing.getP(),
+                        item.forcing.getT(), item.parameters);
+                    results[item.index].days = item.forcing.size();
+                    results[item.index].NSE = model->getNSE();
+                    write_queue.push({item.index, std::move(item.forcing), std::move(model)});
+                } catch (const std::exception &e) {
+                    results[item.index].error = e.what();
+                }
+            }
+            write_queue.close();
+        });
+    }
+    for (uint64_t w = 0; w < writers; w++) {
+        threads.emplace_back([&]() {
+            simulated item;
+            while (write_queue.pop(item)) {
+                try {
+                    writeResult(basins[item.index].output_path, *item.model);
+                } catch (const std::exception &e) {
+                    results[item.index].error = e.what();
+                }
+                item.model.reset();
+                item.forcing = hbv_forcing();
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    return results;
+}
+/**
+ * @brief This function will print NSE of each basin as a table.
+ * @param output stream to print
+ * @param basins basins in batch
+ * @param results result of each basin
+ */
+inline void printSummary(std::ostream &output, const std::vector<hbv_basin> &basins,
+    const std::vector<hbv_basin_result> &results) {
+    uint64_t width = 9;
+    for (const auto &basin : basins) {
+        width = std::max<uint64_t>(width, basin.data_file.size());
+    }
+    output << std::left << std::setw(6) << "No" << std::setw(width + 2) << "Data file"
+        << std::setw(8) << "Days" << std::setw(9) << "Skipped" << std::setw(10) << "NSE" << "Status" << "\n";
+    for (uint64_t i = 0; i < basins.size(); i++) {
+        output << std::setw(6) << i + 1 << std::setw(width + 2) << basins[i].data_file;
+        if (results[i].error.empty()) {
+            output << std::setw(8) << results[i].days << std::setw(9) << results[i].skipped
+                << std::setw(10) << std::fixed << std::setprecision(3) << results[i].NSE << "OK" << "\n";
+        } else {
+            output << std::setw(8) << "-" << std::setw(9) << "-" << std::setw(10) << "-" << results[i].error << "\n";
+        }
+    }
+    output << std::right;
+}
+/**
+ * @brief This function will write NSE of each basin to a csv file.
+ * @throw std::runtime_error if the file can't be opened
+ */
+inline void writeSummary(const std::string &summary_path, const std::vector<hbv_basin> &basins,
+    const std::vector<hbv_basin_result> &results) {
+    std::ofstream output(summary_path);
+    if (!output.is_open()) {
+        throw std::runtime_error("Can't Open " + summary_path);
+    }
+    output << "Data file,Parameters file,Output file,Days,Skipped,NSE,Error\n";
+    output.precision(10);
+    for (uint64_t i = 0; i < basins.size(); i++) {
+        output << basins[i].data_file << "," << basins[i].parameters_file << "," << basins[i].output_path << ","
+            << results[i].days << "," << results[i].skipped << "," << results[i].NSE << "," << results[i].error << "\n";
+    }
+}
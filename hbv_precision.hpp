@@ -0,0 +1,165 @@
+// Copyright 2022 Tianshuo Li
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <iomanip>
+#include <limits>
+#include <ostream>
+#include <span>
+#include <string>
+#include <vector>
+#include "hbv_kernel.hpp"
+#include "hbv_model.hpp"
+#include "hbv_batch.hpp"
+#include "hbv_parallel.hpp"
+#include "hbv_sampler.hpp"
+/**
+ * @brief hbv_precision_options stores the options of comparePrecision().
+ */
+struct hbv_precision_options {
+    /**
+     * @brief samples is number of lhs parameters sets run by hbv_batch in both precisions, 0 to skip it.
+     */
+    uint64_t samples = 1000;
+    /**
+     * @brief seed of random number.
+     */
+    uint64_t seed = 1;
+    /**
+     * @brief threads is number of threads used to run model.
+     */
+    uint64_t threads = hbv_threads();
+};
+/**
+ * @brief hbv_drift stores how far a daily series of float model is from double model.
+ * max_rel is max_abs divided by the largest absolute value of double series, so days with
+ * value near 0 do not make it large. rms is root mean square of the differences.
+ */
+struct hbv_drift {
+    const char *name;
+    double max_abs, max_rel, rms;
+};
+/**
+ * @brief hbv_precision_report stores the result of comparePrecision().
+ * NSE_double and NSE_float are NSE of hbv_model_t with given parameters, series are the drift of
+ * each column of result file. The batch part compares NSE of sampled parameters sets: finite is number
+ * of sets with finite NSE in both precisions, mean_abs and max_abs are the differences of their NSE,
+ * and same_best is true when both precisions give the same best set.
+ */
+struct hbv_precision_report {
+    double NSE_double, NSE_float;
+    std::array<hbv_drift, 6> series;
+    uint64_t samples = 0, finite = 0;
+    double mean_abs = 0, max_abs = 0;
+    bool same_best = true;
+};
+/**
+ * @brief Get the drift of float series from double series, days with NaN in double are skipped.
+ */
+template <typename Real>
+inline hbv_drift hbv_series_drift(const char *name, std::span<const double> reference, std::span<const Real> value) {
+    double largest = 0, max_abs = 0, square = 0;
+    uint64_t count = 0;
+    for (uint64_t i = 0; i < reference.size(); i++) {
+        if (std::isnan(reference[i])) {
+            continue;
+        }
+        const double error = std::abs(static_cast<double>(value[i]) - reference[i]);
+        largest = std::max(largest, std::abs(reference[i]));
+        max_abs = std::max(max_abs, error);
+        square += error * error;
+        count++;
+    }
+    return {name, max_abs, (largest > 0) ? max_abs / largest : 0,
+        (count > 0) ? std::sqrt(square / static_cast<double>(count)) : 0};
+}
+/**
+ * @brief Run HBV model in double and in float and report how far float is from double, so it can be
+ * decided whether float is precise enough for a dataset. The model with given parameters is compared day
+ * by day for each column of result file, then sampled parameters sets are compared by NSE of hbv_batch.
+ * @param Q discharge given by dataset
+ * @param P precipitation given by dataset
+ * @param T daily mean temperature given by dataset
+ * @param parameters parameters vector, the last 5 values are also used for sampled sets
+ * @param options options of comparison
+ * @return hbv_precision_report
+ */
+inline hbv_precision_report comparePrecision(std::span<const double> Q, std::span<const double> P,
+    std::span<const double> T, const std::vector<double> &parameters,
+    const hbv_precision_options &options = hbv_precision_options()) {
+    hbv_precision_report report;
+    const hbv_model model(Q, P, T, parameters);
+    const hbv_model_t<float> single(Q, P, T, parameters);
+    report.NSE_double = model.getNSE();
+    report.NSE_float = single.getNSE();
+    const hbv_result a = model.getResults();
+    const hbv_result_t<float> b = single.getResults();
+    report.series = {hbv_series_drift("RF", a.RF, b.RF), hbv_series_drift("ET", a.ET, b.ET),
+        hbv_series_drift("AET", a.AET, b.AET), hbv_series_drift("storage", a.storage, b.storage),
+        hbv_series_drift("Qt", a.Qt, b.Qt), hbv_series_drift("Q_a", a.Q_a, b.Q_a)};
+    report.samples = options.samples;
+    if (options.samples == 0) {
+        return report;
+    }
+    hbv_sampler sampler("lhs", options.samples, options.seed);
+    hbv_thread_pool pool(options.threads);
+    std::vector<hbv_parameters> sets(options.samples);
+    pool.parallel_for(options.samples, [&](uint64_t i, uint64_t) {
+        sets[i] = hbv_parameters::fromVector(sampler.parameters(i, parameters));
+    });
+    const hbv_batch batch(sets);
+    const hbv_batch_t<float> batch_float(sets);
+    std::vector<double> NSE(options.samples), NSE_float(options.samples);
+    const uint64_t tiles = (options.samples + hbv_batch::tile - 1) / hbv_batch::tile;
+    const double temp2 = hbv_sum_squares_q(Q);
+    pool.parallel_for(tiles, [&](uint64_t t, uint64_t) {
+        const uint64_t begin = t * hbv_batch::tile, end = std::min(options.samples, begin + hbv_batch::tile);
+        batch.evaluate(Q, P, T, begin, end, NSE.data() + begin, temp2);
+        batch_float.evaluate(Q, P, T, begin, end, NSE_float.data() + begin, temp2);
+    });
+    uint64_t best = 0, best_float = 0;
+    double best_NSE = -std::numeric_limits<double>::infinity(), best_NSE_float = best_NSE;
+    for (uint64_t i = 0; i < options.samples; i++) {
+        if (NSE[i] > best_NSE) {
+            best_NSE = NSE[i];
+            best = i;
+        }
+        if (NSE_float[i] > best_NSE_float) {
+            best_NSE_float = NSE_float[i];
+            best_float = i;
+        }
+        if (std::isfinite(NSE[i]) && std::isfinite(NSE_float[i])) {
+            const double error = std::abs(NSE_float[i] - NSE[i]);
+            report.mean_abs += error;
+            report.max_abs = std::max(report.max_abs, error);
+            report.finite++;
+        }
+    }
+    report.mean_abs = (report.finite > 0) ? report.mean_abs / static_cast<double>(report.finite) : 0;
+    report.same_best = (best == best_float);
+    return report;
+}
+/**
+ * @brief This function will print the report of comparePrecision() as tables.
+ */
+inline void printPrecision(std::ostream &output, const hbv_precision_report &report) {
+    output << std::setprecision(10) << "NSE in double: " << report.NSE_double << "\n";
+    output << "NSE in float:  " << report.NSE_float << "\n";
+    output << std::scientific << std::setprecision(2) << "NSE difference: "
+        << std::abs(report.NSE_float - report.NSE_double) << "\n\n";
+    output << std::left << std::setw(10) << "Series" << std::setw(14) << "Max abs" << std::setw(14) << "Max rel"
+        << "RMS" << "\n";
+    for (const hbv_drift &drift : report.series) {
+        output << std::setw(10) << drift.name << std::setw(14) << drift.max_abs << std::setw(14) << drift.max_rel
+            << drift.rms << "\n";
+    }
+    if (report.samples > 0) {
+        output << "\nNSE difference of " << report.finite << " of " << report.samples
+            << " sampled parameters sets with finite NSE: mean " << report.mean_abs << ", max " << report.max_abs
+            << "\n";
+        output << "Best sampled set is " << (report.same_best ? "the same" : "different") << " in float" << "\n";
+    }
+    output << std::right << std::defaultfloat << std::setprecision(6);
+}
@@ -0,0 +1,188 @@
+// Copyright 2022 Tianshuo Li
+#pragma once
+#include <time.h>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <ostream>
+/**
+ * @brief HBV_PROFILE turns on timers and counters of hbv_profiler. Compile with "-DHBV_PROFILE=0"
+ * to remove all of them from the program, then --profile prints nothing.
+ */
+#ifndef HBV_PROFILE
+#define HBV_PROFILE 1
+#endif
+/**
+ * @brief hbv_phase is the list of phases measured by hbv_profiler.
+ */
+enum class hbv_phase : uint64_t {
+    open_files, parse_parameters, parse_data, set_parameter, simulate, write_result, count
+};
+/**
+ * @brief hbv_counter is the list of counters of hbv_profiler.
+ */
+enum class hbv_counter : uint64_t {
+    records_parsed, records_skipped, peak_vector_bytes, count
+};
+/**
+ * @brief hbv_profiler sums wall time and CPU time of each phase and the counters of the whole program.
+ * All values are atomic, so phases can be measured by many threads (CPU time of each thread is summed).
+ * It only works after enable() is called (--profile), otherwise a timer only checks one flag.
+ */
+class hbv_profiler {
+ public:
+      /**
+       * @brief Get the profiler of the program.
+       */
+      static hbv_profiler &global() {
+         static hbv_profiler profiler;
+         return profiler;
+      }
+      /**
+       * @brief Start to measure phases and counters.
+       */
+      void enable() {
+         enabled.store(true, std::memory_order_relaxed);
+      }
+      /**
+       * @brief isEnabled() will return true if enable() was called.
+       */
+      bool isEnabled() const {
+         return enabled.load(std::memory_order_relaxed);
+      }
+      /**
+       * @brief Add one call of phase with its wall time and CPU time in ns.
+       */
+      void addPhase(hbv_phase phase, uint64_t wall, uint64_t cpu) {
+         auto &entry = phases[static_cast<uint64_t>(phase)];
+         entry.calls.fetch_add(1, std::memory_order_relaxed);
+         entry.wall.fetch_add(wall, std::memory_order_relaxed);
+         entry.cpu.fetch_add(cpu, std::memory_order_relaxed);
+      }
+      /**
+       * @brief Add value to counter. For peak_vector_bytes, the largest value is kept.
+       */
+      void count(hbv_counter counter, uint64_t value) {
+         if (!isEnabled()) {
+            return;
+         }
+         auto &entry = counters[static_cast<uint64_t>(counter)];
+         if (counter == hbv_counter::peak_vector_bytes) {
+            uint64_t old = entry.load(std::memory_order_relaxed);
+            while (old < value && !entry.compare_exchange_weak(old, value, std::memory_order_relaxed)) {
+            }
+         } else {
+            entry.fetch_add(value, std::memory_order_relaxed);
+         }
+      }
+      /**
+       * @brief Get CPU time of the calling thread in ns.
+       */
+      static uint64_t cpuTime() {
+         timespec time;
+         clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+         return static_cast<uint64_t>(time.tv_sec) * 1000000000ULL + static_cast<uint64_t>(time.tv_nsec);
+      }
+      /**
+       * @brief Print phases and counters as a table.
+       */
+      void printTable(std::ostream &output) const {
+         output << "\n  Profile\n" << std::left << std::setw(20) << "Phase" << std::setw(10) << "Calls"
+            << std::setw(14) << "Wall (ms)" << "CPU (ms)" << "\n" << std::fixed << std::setprecision(3);
+         for (uint64_t p = 0; p < phases.size(); p++) {
+            output << std::setw(20) << names[p] << std::setw(10) << phases[p].calls.load()
+               << std::setw(14) << static_cast<double>(phases[p].wall.load()) / 1e6
+               << static_cast<double>(phases[p].cpu.load()) / 1e6 << "\n";
+         }
+         for (uint64_t c = 0; c < counters.size(); c++) {
+            output << std::setw(20) << counter_names[c] << counters[c].load() << "\n";
+         }
+         output << std::right;
+      }
+      /**
+       * @brief Print phases and counters as json.
+       */
+      void printJson(std::ostream &output) const {
+         output << "{\"phases\": [" << std::fixed << std::setprecision(3);
+         for (uint64_t p = 0; p < phases.size(); p++) {
+            output << (p > 0 ? ", " : "") << "{\"name\": \"" << names[p] << "\", \"calls\": "
+               << phases[p].calls.load() << ", \"wall_ms\": " << static_cast<double>(phases[p].wall.load()) / 1e6
+               << ", \"cpu_ms\": " << static_cast<double>(phases[p].cpu.load()) / 1e6 << "}";
+         }
+         output << "], \"counters\": {";
+         for (uint64_t c = 0; c < counters.size(); c++) {
+            output << (c > 0 ? ", " : "") << "\"" << counter_names[c] << "\": " << counters[c].load();
+         }
+         output << "}}\n";
+      }
+
+ private:
+      /**
+       * @brief phase_entry stores number of calls, wall time and CPU time (ns) of one phase.
+       */
+      struct phase_entry {
+         std::atomic<uint64_t> calls{0}, wall{0}, cpu{0};
+      };
+      /**
+       * @brief enabled is set by enable().
+       */
+      std::atomic<bool> enabled{false};
+      /**
+       * @brief phases and counters, same order as hbv_phase and hbv_counter.
+       */
+      std::array<phase_entry, static_cast<uint64_t>(hbv_phase::count)> phases;
+      std::array<std::atomic<uint64_t>, static_cast<uint64_t>(hbv_counter::count)> counters{};
+      /**
+       * @brief names of phases and counters.
+       */
+      static constexpr const char *names[] = {"open_files", "parse_parameters", "parse_data",
+         "set_parameter", "simulate", "write_result"};
+      static constexpr const char *counter_names[] = {"records_parsed", "records_skipped", "peak_vector_bytes"};
+};
+/**
+ * @brief hbv_profile_scope measures wall time and CPU time from its construction to its destruction
+ * and adds them to a phase of hbv_profiler, if the profiler is enabled.
+ */
+class hbv_profile_scope {
+ public:
+      explicit hbv_profile_scope(hbv_phase phase1) {
+         phase = phase1;
+         active = hbv_profiler::global().isEnabled();
+         if (active) {
+            wall = std::chrono::steady_clock::now();
+            cpu = hbv_profiler::cpuTime();
+         }
+      }
+      hbv_profile_scope(const hbv_profile_scope &) = delete;
+      hbv_profile_scope &operator=(const hbv_profile_scope &) = delete;
+      ~hbv_profile_scope() {
+         if (active) {
+            auto time = std::chrono::steady_clock::now() - wall;
+            hbv_profiler::global().addPhase(phase,
+               static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(time).count()),
+               hbv_profiler::cpuTime() - cpu);
+         }
+      }
+
+ private:
+      hbv_phase phase;
+      bool active;
+      std::chrono::steady_clock::time_point wall;
+      uint64_t cpu = 0;
+};
+/**
+ * @brief HBV_PROFILE_SCOPE(phase) measures the rest of current block as a phase, and
+ * HBV_PROFILE_COUNT(counter, value) adds value to a counter. Both are empty if HBV_PROFILE is 0.
+ */
+#if HBV_PROFILE
+#define HBV_PROFILE_JOIN2(a, b) a##b
+#define HBV_PROFILE_JOIN(a, b) HBV_PROFILE_JOIN2(a, b)
+#define HBV_PROFILE_SCOPE(phase) hbv_profile_scope HBV_PROFILE_JOIN(hbv_profile_, __LINE__)(hbv_phase::phase)
+#define HBV_PROFILE_COUNT(counter, value) hbv_profiler::global().count(hbv_counter::counter, (value))
+#else
+#define HBV_PROFILE_SCOPE(phase) static_cast<void>(0)
+#define HBV_PROFILE_COUNT(counter, value) static_cast<void>(0)
+#endif
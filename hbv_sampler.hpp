@@ -0,0 +1,320 @@
+// Copyright 2022 Tianshuo Li
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <limits>
+#include <numeric>
+#include <optional>
+#include <random>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "hbv_kernel.hpp"
+#include "hbv_batch.hpp"
+#include "hbv_parallel.hpp"
+#include "hbv_memo.hpp"
+/**
+ * @brief hbv_sampler will give N points of the first 11 parameters inside hbv_bounds.
+ * Point i only depends on method, N, seed and i, so points can be made by any thread
+ * in any order. The methods are:
+ * uniform: each value is independent uniform random number.
+ * lhs: Latin hypercube, range of each parameter is cut into N parts and each part is used once.
+ * sobol: Sobol sequence with a random digital shift given by seed.
+ * With 2 parts, each point has a second independent set of 11 values (dimensions 12 to 22 of the
+ * same sequence), for example matrices A and B of Sobol sensitivity analysis.
+ */
+class hbv_sampler {
+ public:
+      /**
+       * @brief n is number of sampled parameters.
+       */
+      static constexpr uint64_t n = hbv_bounds.size();
+      /**
+       * @brief Construct a new hbv sampler
+       * @param method1 "uniform", "lhs" or "sobol"
+       * @param samples1 number of points
+       * @param seed1 seed of random number
+       * @param parts1 number of sets of 11 values of each point, 1 or 2
+       * @throw std::invalid_argument if method is unknown
+       */
+      hbv_sampler(const std::string &method1, uint64_t samples1, uint64_t seed1, uint64_t parts1 = 1) {
+         samples = samples1;
+         seed = seed1;
+         parts = std::clamp<uint64_t>(parts1, 1, 2);
+         if (method1 == "uniform") {
+            kind = uniform;
+         } else if (method1 == "lhs") {
+            kind = lhs;
+            for (uint64_t d = 0; d < parts * n; d++) {
+               permutation[d].resize(samples);
+               std::iota(permutation[d].begin(), permutation[d].end(), 0);
+               std::mt19937_64 rng(hbv_seed(seed, samples + d));
+               std::shuffle(permutation[d].begin(), permutation[d].end(), rng);
+            }
+         } else if (method1 == "sobol") {
+            kind = sobol;
+            setDirection();
+         } else {
+            throw std::invalid_argument("Unknown sampling method " + method1);
+         }
+      }
+      /**
+       * @brief Get i-th point in unit hypercube [0, 1)^11.
+       * @param i index of point
+       * @param part which set of 11 values, less than number of parts
+       */
+      std::array<double, n> unit(uint64_t i, uint64_t part = 0) const {
+         std::array<double, n> u;
+         const uint64_t stream = hbv_seed(seed, i);
+         for (uint64_t k = 0; k < n; k++) {
+            const uint64_t d = part * n + k;
+            if (kind == sobol) {
+               // point 0 is not zero because of the digital shift, so it starts from index 0.
+               uint64_t gray = i ^ (i >> 1);
+               uint32_t x = shift[d];
+               for (uint64_t b = 0; gray != 0 && b < 32; b++, gray >>= 1) {
+                  if (gray & 1) {
+                     x ^= direction[d][b];
+                  }
+               }
+               u[k] = static_cast<double>(x) * 0x1.0p-32;
+               continue;
+            }
+            double r = static_cast<double>(hbv_seed(stream, d) >> 11) * 0x1.0p-53;
+            if (kind == uniform) {
+               u[k] = r;
+            } else {
+               u[k] = (static_cast<double>(permutation[d][i]) + r) / static_cast<double>(samples);
+            }
+         }
+         return u;
+      }
+      /**
+       * @brief Get i-th point as parameters vector, the last 5 values are copied from base.
+       * @param i index of point
+       * @param base parameters vector given by parameters file
+       * @param part which set of 11 values, less than number of parts
+       */
+      std::vector<double> parameters(uint64_t i, const std::vector<double> &base, uint64_t part = 0) const {
+         std::vector<double> parameters = base;
+         std::array<double, n> u = unit(i, part);
+         for (uint64_t d = 0; d < n; d++) {
+            parameters[d] = hbv_bounds[d].low + u[d] * (hbv_bounds[d].high - hbv_bounds[d].low);
+         }
+         return parameters;
+      }
+
+ private:
+      /**
+       * @brief kind is method of sampling.
+       */
+      enum { uniform, lhs, sobol } kind;
+      /**
+       * @brief samples is number of points and seed is seed of random number.
+       */
+      uint64_t samples, seed;
+      /**
+       * @brief parts is number of sets of 11 values of each point.
+       */
+      uint64_t parts;
+      /**
+       * @brief permutation[d] stores which part of range is used by each point for lhs.
+       */
+      std::vector<uint32_t> permutation[2 * n];
+      /**
+       * @brief direction numbers and digital shift of each dimension for sobol.
+       */
+      uint32_t direction[2 * n][32], shift[2 * n];
+      /**
+       * @brief Build Sobol direction numbers. The primitive polynomials and initial numbers are
+       * the first 22 dimensions of Joe and Kuo (2008).
+       */
+      void setDirection() {
+         // {degree, coefficients, initial numbers}, first dimension is van der Corput sequence.
+         const struct { uint32_t s, a, m[7]; } table[2 * n - 1] = {
+            {1, 0, {1}}, {2, 1, {1, 3}}, {3, 1, {1, 3, 1}}, {3, 2, {1, 1, 1}},
+            {4, 1, {1, 1, 3, 3}}, {4, 4, {1, 3, 5, 13}}, {5, 2, {1, 1, 5, 5, 17}},
+            {5, 4, {1, 1, 5, 5, 5}}, {5, 7, {1, 1, 7, 11, 19}}, {5, 11, {1, 1, 5, 1, 1}},
+            {5, 13, {1, 1, 1, 3, 11}}, {5, 14, {1, 3, 5, 5, 31}}, {6, 1, {1, 3, 3, 9, 7, 49}},
+            {6, 13, {1, 1, 1, 15, 21, 21}}, {6, 16, {1, 3, 1, 13, 27, 49}}, {6, 19, {1, 1, 1, 15, 7, 5}},
+            {6, 22, {1, 3, 1, 15, 13, 25}}, {6, 25, {1, 1, 5, 5, 19, 61}}, {7, 1, {1, 3, 7, 11, 23, 15, 103}},
+            {7, 4, {1, 3, 7, 13, 13, 15, 69}}, {7, 7, {1, 1, 3, 13, 7, 35, 63}},
+         };
+         for (uint32_t b = 0; b < 32; b++) {
+            direction[0][b] = 1u << (31 - b);
+         }
+         for (uint64_t d = 1; d < parts * n; d++) {
+            const uint32_t s = table[d - 1].s, a = table[d - 1].a;
+            for (uint32_t b = 0; b < 32; b++) {
+               if (b < s) {
+                  direction[d][b] = table[d - 1].m[b] << (31 - b);
+               } else {
+                  uint32_t v = direction[d][b - s] ^ (direction[d][b - s] >> s);
+                  for (uint32_t r = 1; r < s; r++) {
+                     if ((a >> (s - 1 - r)) & 1) {
+                        v ^= direction[d][b - r];
+                     }
+                  }
+                  direction[d][b] = v;
+               }
+            }
+         }
+         for (uint64_t d = 0; d < parts * n; d++) {
+            shift[d] = static_cast<uint32_t>(hbv_seed(seed, d) >> 32);
+         }
+      }
+};
+/**
+ * @brief hbv_sampling_options stores the options of sampleParameters().
+ */
+struct hbv_sampling_options {
+    /**
+     * @brief method is "uniform", "lhs" or "sobol".
+     */
+    std::string method = "lhs";
+    /**
+     * @brief samples is number of parameters sets.
+     */
+    uint64_t samples = 10000;
+    /**
+     * @brief seed of random number. Same seed gives same file whatever the number of threads.
+     */
+    uint64_t seed = 1;
+    /**
+     * @brief threads is number of threads used to run model.
+     */
+    uint64_t threads = hbv_threads();
+    /**
+     * @brief format of output file, "csv" or "binary".
+     */
+    std::string format = "csv";
+    /**
+     * @brief precision of model, "double" or "float" (hbv_batch_t<float>), NSE is written as double.
+     */
+    std::string precision = "double";
+    /**
+     * @brief memo stores NSE of parameters sets already run (for example by a sampling stopped before), it
+     * should be opened with the same dataset and precision. It is not used when it is nullptr.
+     */
+    hbv_memo *memo = nullptr;
+};
+/**
+ * @brief Run HBV model with sampled parameters and write parameters and NSE of each sample.
+ * Samples are run block by block: each block is cut into tiles of hbv_batch and the tiles are run
+ * by a work stealing thread pool, then the block is written in order of samples. So memory of
+ * results only depends on size of block (lhs still keeps one permutation of samples for each parameter).
+ * With memo, only the samples not found in it are run, and their NSE is added to it.
+ * The binary file starts with 8 characters "HBVSMPL1", number of samples and number of columns
+ * (both uint64), then each sample is 12 little-endian doubles (11 parameters and NSE).
+ * @param Q discharge given by dataset
+ * @param P precipitation given by dataset
+ * @param T daily mean temperature given by dataset
+ * @param base parameters vector, the last 5 values are used for all samples
+ * @param options options of sampling
+ * @param output_path path of output file
+ * @return uint64_t index of sample with highest NSE
+ * @throw std::runtime_error if the file can't be opened
+ * @throw std::invalid_argument if format or precision is unknown
+ */
+inline uint64_t sampleParameters(std::span<const double> Q, std::span<const double> P,
+    std::span<const double> T, const std::vector<double> &base, const hbv_sampling_options &options,
+    const std::string &output_path) {
+    const uint64_t n = hbv_sampler::n;
+    const uint64_t block = 64 * hbv_batch::tile;
+    const bool binary = (options.format == "binary");
+    if (!binary && options.format != "csv") {
+        throw std::invalid_argument("Unknown output format " + options.format);
+    }
+    const bool single = (options.precision == "float");
+    if (!single && options.precision != "double") {
+        throw std::invalid_argument("Unknown precision " + options.precision);
+    }
+    hbv_sampler sampler(options.method, options.samples, options.seed);
+    std::ofstream output(output_path, binary ? std::ios::binary : std::ios::out);
+    if (!output.is_open()) {
+        throw std::runtime_error("Can't Open " + output_path);
+    }
+    if (binary) {
+        uint64_t header[2] = {options.samples, n + 1};
+        output.write("HBVSMPL1", 8);
+        output.write(reinterpret_cast<const char *>(header), sizeof(header));
+    } else {
+        output << "Sample";
+        for (const auto &bound : hbv_bounds) {
+            output << "," << bound.name;
+        }
+        output << ",NSE\n";
+        output.precision(10);
+    }
+    hbv_thread_pool pool(options.threads);
+    std::vector<hbv_parameters> sets, missing;  // missing is the sets not found in memo
+    std::vector<uint64_t> position;  // position is index of each missing set in block
+    std::vector<double> NSE(block), missing_NSE(block), record(n + 1);
+    uint64_t best = 0;
+    double best_NSE = -std::numeric_limits<double>::infinity();
+    const double temp2 = hbv_sum_squares_q(Q);  // part 2 of NSE, same for every block
+    for (uint64_t b = 0; b < options.samples; b += block) {
+        const uint64_t size = std::min(block, options.samples - b);
+        sets.resize(size);
+        pool.parallel_for(size, [&](uint64_t i, uint64_t) {
+            sets[i] = hbv_parameters::fromVector(sampler.parameters(b + i, base));
+        });
+        missing.clear();
+        position.clear();
+        for (uint64_t i = 0; i < size; i++) {
+            std::optional<double> cached = options.memo ? options.memo->find(sets[i]) : std::nullopt;
+            if (cached) {
+                NSE[i] = *cached;
+            } else {
+                missing.push_back(sets[i]);
+                position.push_back(i);
+            }
+        }
+        auto evaluate = [&](const auto &batch) {
+            const uint64_t count = missing.size();
+            const uint64_t tiles = (count + hbv_batch::tile - 1) / hbv_batch::tile;
+            pool.parallel_for(tiles, [&](uint64_t t, uint64_t) {
+                const uint64_t begin = t * hbv_batch::tile;
+                batch.evaluate(Q, P, T, begin, std::min(count, begin + hbv_batch::tile), missing_NSE.data() + begin,
+                    temp2);
+            });
+        };
+        if (missing.empty()) {
+            // every sample of this block is in memo
+        } else if (single) {
+            evaluate(hbv_batch_t<float>(missing));
+        } else {
+            evaluate(hbv_batch(missing));
+        }
+        for (uint64_t j = 0; j < missing.size(); j++) {
+            NSE[position[j]] = missing_NSE[j];
+            if (options.memo) {
+                options.memo->insert(missing[j], missing_NSE[j]);
+            }
+        }
+        for (uint64_t i = 0; i < size; i++) {
+            if (NSE[i] > best_NSE) {
+                best_NSE = NSE[i];
+                best = b + i;
+            }
+            for (uint64_t d = 0; d < n; d++) {
+                record[d] = sets[i][d];
+            }
+            record[n] = NSE[i];
+            if (binary) {
+                output.write(reinterpret_cast<const char *>(record.data()), record.size() * sizeof(double));
+            } else {
+                output << b + i;
+                for (double value : record) {
+                    output << "," << value;
+                }
+                output << "\n";
+            }
+        }
+    }
+    return best;
+}
@@ -0,0 +1,263 @@
+// Copyright 2022 Tianshuo Li
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <ostream>
+#include <span>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "hbv_kernel.hpp"
+#include "hbv_batch.hpp"
+#include "hbv_metrics.hpp"
+#include "hbv_parallel.hpp"
+#include "hbv_sampler.hpp"
+/**
+ * @brief hbv_sensitivity_options stores the options of analyzeSensitivity().
+ */
+struct hbv_sensitivity_options {
+    /**
+     * @brief method is how matrices A and B are sampled, "sobol", "lhs" or "uniform" (see hbv_sampler).
+     */
+    std::string method = "sobol";
+    /**
+     * @brief samples is number of rows N of A and B, the model is run N * (11 + 2) times.
+     */
+    uint64_t samples = 1024;
+    /**
+     * @brief bootstrap is number of bootstrap replicates used for confidence interval, 0 to skip it.
+     */
+    uint64_t bootstrap = 200;
+    /**
+     * @brief confidence is the level of confidence interval.
+     */
+    double confidence = 0.95;
+    /**
+     * @brief objective is the name of metric in hbv_metric_table that indices are calculated for.
+     */
+    std::string objective = "NSE";
+    /**
+     * @brief seed of random number. Same seed gives same indices whatever the number of threads.
+     */
+    uint64_t seed = 1;
+    /**
+     * @brief threads is number of threads used to run model.
+     */
+    uint64_t threads = hbv_threads();
+};
+/**
+ * @brief hbv_sensitivity_index stores first-order (S1) and total-order (ST) Sobol index of one
+ * parameter with the bounds of their confidence intervals.
+ */
+struct hbv_sensitivity_index {
+    double S1, S1_low, S1_high, ST, ST_low, ST_high;
+};
+/**
+ * @brief hbv_sensitivity_result stores the result of analyzeSensitivity().
+ * rows is number of rows used, skipped is number of rows with a NaN or infinite objective value
+ * (they are not used), evaluations is number of model runs and variance is the variance of objective.
+ */
+struct hbv_sensitivity_result {
+    std::array<hbv_sensitivity_index, hbv_bounds.size()> index;
+    uint64_t rows, skipped, evaluations;
+    double variance;
+};
+/**
+ * @brief hbv_sobol_sums stores the weighted sums of one bootstrap replicate. Objective values are
+ * moved by the value of the first row, so the sums of squares do not lose digits.
+ */
+struct hbv_sobol_sums {
+    static constexpr uint64_t n = hbv_bounds.size();
+    double weight = 0, sum = 0, square = 0;
+    std::array<double, n> first{}, total{};
+    /**
+     * @brief Add one row with weight w. f is objective value of A, B and A with j-th column from B.
+     */
+    void add(double w, const double *f) {
+        const double fA = f[0], fB = f[1];
+        weight += w;
+        sum += w * (fA + fB);
+        square += w * (fA * fA + fB * fB);
+        for (uint64_t j = 0; j < n; j++) {
+            const double fAB = f[2 + j];
+            first[j] += w * fB * (fAB - fA);
+            total[j] += w * (fA - fAB) * (fA - fAB);
+        }
+    }
+    /**
+     * @brief Variance of objective values of A and B.
+     */
+    double variance() const {
+        const double mean = sum / (2 * weight);
+        return square / (2 * weight) - mean * mean;
+    }
+    /**
+     * @brief First-order index of j-th parameter (Saltelli et al. 2010).
+     */
+    double S1(uint64_t j) const {
+        return first[j] / weight / variance();
+    }
+    /**
+     * @brief Total-order index of j-th parameter (Jansen 1999).
+     */
+    double ST(uint64_t j) const {
+        return total[j] / (2 * weight) / variance();
+    }
+};
+/**
+ * @brief Get a Poisson(1) random number from a seed. Weight of a row in a bootstrap replicate follows
+ * Poisson(1), so replicates can be summed row by row without keeping all rows (Poisson bootstrap).
+ */
+inline double hbv_poisson_weight(uint64_t seed) {
+    const double u = static_cast<double>(seed >> 11) * 0x1.0p-53;
+    double p = std::exp(-1.0), cdf = p;
+    uint64_t k = 0;
+    while (u > cdf && k < 20) {
+        k++;
+        p /= static_cast<double>(k);
+        cdf += p;
+    }
+    return static_cast<double>(k);
+}
+/**
+ * @brief Calculate first-order and total-order Sobol indices of the first 11 parameters.
+ * Matrices A and B are the two parts of N points of hbv_sampler (22 dimensions), and the
+ * model is run for A, B and A with j-th column from B for every row. Rows are run block by block on a
+ * work stealing thread pool (hbv_batch for NSE, hbv_evaluate_metrics() for other objectives), and each
+ * block is added to the sums of all bootstrap replicates in order of rows, so memory only depends on
+ * size of block and number of replicates, and the result does not depend on number of threads.
+ * @param Q discharge given by dataset
+ * @param P precipitation given by dataset
+ * @param T daily mean temperature given by dataset
+ * @param base parameters vector, the last 5 values are used for all runs
+ * @param options options of analysis
+ * @return hbv_sensitivity_result
+ * @throw std::invalid_argument if method or objective is unknown or there is no usable row
+ */
+inline hbv_sensitivity_result analyzeSensitivity(std::span<const double> Q, std::span<const double> P,
+    std::span<const double> T, const std::vector<double> &base, const hbv_sensitivity_options &options) {
+    const uint64_t n = hbv_sampler::n, width = n + 2;
+    const uint64_t block = 256;
+    const hbv_metric &metric = findMetric(options.objective);
+    const bool NSE = (&metric == &hbv_metric_table[0]);
+    hbv_sampler sampler(options.method, options.samples, options.seed, 2);
+    hbv_thread_pool pool(options.threads);
+    // replicate 0 is the estimate with all weights 1, others are bootstrap replicates.
+    std::vector<hbv_sobol_sums> sums(options.bootstrap + 1);
+    std::vector<hbv_parameters> sets;
+    std::vector<double> values;
+    std::vector<uint8_t> usable;
+    hbv_sensitivity_result result{};
+    double shift = std::nan("");  // objective value of the first usable row of A
+    const double temp2 = hbv_sum_squares_q(Q);  // part 2 of NSE, same for every block
+    for (uint64_t b = 0; b < options.samples; b += block) {
+        const uint64_t size = std::min(block, options.samples - b);
+        sets.resize(size * width);
+        values.resize(size * width);
+        usable.assign(size, 0);
+        pool.parallel_for(size, [&](uint64_t i, uint64_t) {
+            const std::vector<double> A = sampler.parameters(b + i, base);
+            const std::vector<double> B = sampler.parameters(b + i, base, 1);
+            sets[i * width] = hbv_parameters::fromVector(A);
+            sets[i * width + 1] = hbv_parameters::fromVector(B);
+            for (uint64_t j = 0; j < n; j++) {
+                hbv_parameters AB = sets[i * width];
+                AB[j] = B[j];
+                sets[i * width + 2 + j] = AB;
+            }
+        });
+        if (NSE) {
+            hbv_batch batch(sets);
+            const uint64_t tiles = (sets.size() + hbv_batch::tile - 1) / hbv_batch::tile;
+            pool.parallel_for(tiles, [&](uint64_t t, uint64_t) {
+                const uint64_t begin = t * hbv_batch::tile;
+                batch.evaluate(Q, P, T, begin, std::min<uint64_t>(sets.size(), begin + hbv_batch::tile),
+                    values.data() + begin, temp2);
+            });
+        } else {
+            pool.parallel_for(sets.size(), [&](uint64_t k, uint64_t) {
+                values[k] = (hbv_evaluate_metrics(sets[k], Q, P, T).*metric.value)();
+            });
+        }
+        result.evaluations += sets.size();
+        for (uint64_t i = 0; i < size; i++) {
+            usable[i] = std::all_of(values.begin() + i * width, values.begin() + (i + 1) * width,
+                [](double value) { return std::isfinite(value); });
+            if (usable[i] && std::isnan(shift)) {
+                shift = values[i * width];
+            }
+            result.rows += usable[i];
+            result.skipped += 1 - usable[i];
+        }
+        for (double &value : values) {
+            value -= shift;
+        }
+        pool.parallel_for(sums.size(), [&](uint64_t r, uint64_t) {
+            for (uint64_t i = 0; i < size; i++) {
+                if (usable[i]) {
+                    double w = (r == 0) ? 1 : hbv_poisson_weight(hbv_seed(hbv_seed(options.seed, b + i), r));
+                    sums[r].add(w, values.data() + i * width);
+                }
+            }
+        });
+    }
+    if (result.rows < 2) {
+        throw std::invalid_argument("There are less than 2 samples with finite " + std::string(metric.name));
+    }
+    result.variance = sums[0].variance();
+    const double tail = (1 - options.confidence) / 2;
+    std::vector<double> S1, ST;
+    for (uint64_t j = 0; j < n; j++) {
+        S1.clear();
+        ST.clear();
+        for (uint64_t r = 1; r < sums.size(); r++) {
+            if (sums[r].weight > 0) {
+                S1.push_back(sums[r].S1(j));
+                ST.push_back(sums[r].ST(j));
+            }
+        }
+        std::sort(S1.begin(), S1.end());
+        std::sort(ST.begin(), ST.end());
+        result.index[j] = {sums[0].S1(j), hbv_quantile(S1, tail), hbv_quantile(S1, 1 - tail),
+            sums[0].ST(j), hbv_quantile(ST, tail), hbv_quantile(ST, 1 - tail)};
+    }
+    return result;
+}
+/**
+ * @brief This function will print indices of each parameter as a table.
+ */
+inline void printSensitivity(std::ostream &output, const hbv_sensitivity_result &result) {
+    output << std::left << std::setw(8) << "Name" << std::setw(10) << "S1" << std::setw(22) << "S1 interval"
+        << std::setw(10) << "ST" << "ST interval" << "\n" << std::fixed << std::setprecision(3);
+    for (uint64_t j = 0; j < result.index.size(); j++) {
+        const hbv_sensitivity_index &index = result.index[j];
+        std::ostringstream S1, ST;
+        S1 << std::fixed << std::setprecision(3) << "[" << index.S1_low << ", " << index.S1_high << "]";
+        ST << std::fixed << std::setprecision(3) << "[" << index.ST_low << ", " << index.ST_high << "]";
+        output << std::setw(8) << hbv_bounds[j].name << std::setw(10) << index.S1 << std::setw(22) << S1.str()
+            << std::setw(10) << index.ST << ST.str() << "\n";
+    }
+    output << std::right << std::defaultfloat;
+}
+/**
+ * @brief This function will write indices of each parameter to a csv file.
+ * @throw std::runtime_error if the file can't be opened
+ */
+inline void writeSensitivity(const std::string &path, const hbv_sensitivity_result &result) {
+    std::ofstream output(path);
+    if (!output.is_open()) {
+        throw std::runtime_error("Can't Open " + path);
+    }
+    output << "Parameter,S1,S1 low,S1 high,ST,ST low,ST high\n";
+    output.precision(10);
+    for (uint64_t j = 0; j < result.index.size(); j++) {
+        const hbv_sensitivity_index &index = result.index[j];
+        output << hbv_bounds[j].name << "," << index.S1 << "," << index.S1_low << "," << index.S1_high << ","
+            << index.ST << "," << index.ST_low << "," << index.ST_high << "\n";
+    }
+}
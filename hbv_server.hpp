@@ -0,0 +1,761 @@
+// Copyright 2022 Tianshuo Li
+#pragma once
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "hbv_kernel.hpp"
+#include "hbv_batch.hpp"
+#include "hbv_cache.hpp"
+#include "hbv_io.hpp"
+#include "hbv_metrics.hpp"
+#include "hbv_parallel.hpp"
+/**
+ * @brief hbv_json stores one JSON value of a request. Only the part of JSON used by hbv_server is
+ * kept: object members are kept in order in keys and values.
+ */
+struct hbv_json {
+    enum class type { null, boolean, number, string, array, object };
+    type kind = type::null;
+    bool boolean = false;
+    double number = 0;
+    std::string string;
+    std::vector<hbv_json> values;
+    std::vector<std::string> keys;
+    /**
+     * @brief Get the member of object by key, nullptr if there is no such member.
+     */
+    const hbv_json *find(const std::string &key) const {
+        for (uint64_t i = 0; i < keys.size(); i++) {
+            if (keys[i] == key) {
+                return &values[i];
+            }
+        }
+        return nullptr;
+    }
+    /**
+     * @brief Parse JSON text of one line.
+     * @throw std::invalid_argument if the text is not JSON
+     */
+    static hbv_json parse(const std::string &text) {
+        const char *begin = text.data(), *end = text.data() + text.size();
+        hbv_json value = parseValue(begin, end, 0);
+        skipSpace(begin, end);
+        if (begin != end) {
+            throw std::invalid_argument("Unexpected character after JSON value");
+        }
+        return value;
+    }
+
+ private:
+    static void skipSpace(const char *&begin, const char *end) {
+        while (begin < end && (*begin == ' ' || *begin == '\t' || *begin == '\r' || *begin == '\n')) {
+            begin++;
+        }
+    }
+    static void expect(const char *&begin, const char *end, const char *word) {
+        const uint64_t length = std::strlen(word);
+        if (static_cast<uint64_t>(end - begin) < length || std::strncmp(begin, word, length) != 0) {
+            throw std::invalid_argument("Invalid JSON value");
+        }
+        begin += length;
+    }
+    /**
+     * @brief Parse the 4 hex digits of a unicode escape of JSON string.
+     * @throw std::invalid_argument if there are not 4 hex digits
+     */
+    static uint32_t parseHex(const char *&begin, const char *end) {
+        uint32_t code = 0;
+        if (end - begin < 4) {
+            throw std::invalid_argument("Invalid escape in JSON string");
+        }
+        auto [last, error] = std::from_chars(begin, begin + 4, code, 16);
+        if (error != std::errc() || last != begin + 4) {
+            throw std::invalid_argument("Invalid escape in JSON string");
+        }
+        begin += 4;
+        return code;
+    }
+    /**
+     * @brief Get the end of the JSON number at begin: optional '-', integer part without leading zeros,
+     * optional fraction and exponent. So '+', "inf", "nan" and hex numbers are not accepted.
+     * @throw std::invalid_argument if there is no JSON number at begin
+     */
+    static const char *scanNumber(const char *begin, const char *end) {
+        auto digits = [end](const char *&p) {
+            const char *first = p;
+            while (p < end && *p >= '0' && *p <= '9') {
+                p++;
+            }
+            if (p == first) {
+                throw std::invalid_argument("Invalid JSON value");
+            }
+        };
+        const char *p = begin;
+        if (p < end && *p == '-') {
+            p++;
+        }
+        if (p < end && *p == '0') {
+            p++;
+        } else {
+            digits(p);
+        }
+        if (p < end && *p == '.') {
+            digits(++p);
+        }
+        if (p < end && (*p == 'e' || *p == 'E')) {
+            p++;
+            if (p < end && (*p == '+' || *p == '-')) {
+                p++;
+            }
+            digits(p);
+        }
+        return p;
+    }
+    static std::string parseString(const char *&begin, const char *end) {
+        std::string value;
+        begin++;  // opening quote
+        while (begin < end && *begin != '"') {
+            char c = *begin++;
+            if (c != '\\') {
+                value += c;
+                continue;
+            }
+            if (begin == end) {
+                break;
+            }
+            c = *begin++;
+            switch (c) {
+                case 'b': value += '\b'; break;
+                case 'f': value += '\f'; break;
+                case 'n': value += '\n'; break;
+                case 'r': value += '\r'; break;
+                case 't': value += '\t'; break;
+                case '"': case '\\': case '/': value += c; break;
+                case 'u': {
+                    uint32_t code = parseHex(begin, end);
+                    // a code point above the basic plane is a high surrogate followed by a low surrogate
+                    if (code >= 0xD800 && code < 0xDC00) {
+                        if (end - begin < 2 || begin[0] != '\\' || begin[1] != 'u') {
+                            throw std::invalid_argument("Invalid escape in JSON string");
+                        }
+                        begin += 2;
+                        const uint32_t low = parseHex(begin, end);
+                        if (low < 0xDC00 || low >= 0xE000) {
+                            throw std::invalid_argument("Invalid escape in JSON string");
+                        }
+                        code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                    } else if (code >= 0xDC00 && code < 0xE000) {
+                        throw std::invalid_argument("Invalid escape in JSON string");
+                    }
+                    // code points are written as UTF-8
+                    if (code < 0x80) {
+                        value += static_cast<char>(code);
+                    } else if (code < 0x800) {
+                        value += static_cast<char>(0xC0 | (code >> 6));
+                        value += static_cast<char>(0x80 | (code & 0x3F));
+                    } else if (code < 0x10000) {
+                        value += static_cast<char>(0xE0 | (code >> 12));
+                        value += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+                        value += static_cast<char>(0x80 | (code & 0x3F));
+                    } else {
+                        value += static_cast<char>(0xF0 | (code >> 18));
+                        value += static_cast<char>(0x80 | ((code >> 12) & 0x3F));
+                        value += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+                        value += static_cast<char>(0x80 | (code & 0x3F));
+                    }
+                    break;
+                }
+                default: throw std::invalid_argument("Invalid escape in JSON string");
+            }
+        }
+        if (begin == end) {
+            throw std::invalid_argument("Unterminated JSON string");
+        }
+        begin++;  // closing quote
+        return value;
+    }
+    static hbv_json parseValue(const char *&begin, const char *end, uint64_t depth) {
+        if (depth > 64) {
+            throw std::invalid_argument("JSON value is nested too deep");
+        }
+        skipSpace(begin, end);
+        if (begin == end) {
+            throw std::invalid_argument("Empty JSON value");
+        }
+        hbv_json value;
+        if (*begin == '{' || *begin == '[') {
+            const bool object = (*begin == '{');
+            const char close = object ? '}' : ']';
+            value.kind = object ? type::object : type::array;
+            begin++;
+            skipSpace(begin, end);
+            if (begin < end && *begin == close) {
+                begin++;
+                return value;
+            }
+            for (;;) {
+                if (object) {
+                    skipSpace(begin, end);
+                    if (begin == end || *begin != '"') {
+                        throw std::invalid_argument("Key of JSON object should be a string");
+                    }
+                    value.keys.push_back(parseString(begin, end));
+                    skipSpace(begin, end);
+                    if (begin == end || *begin++ != ':') {
+                        throw std::invalid_argument("Missing ':' in JSON object");
+                    }
+                }
+                value.values.push_back(parseValue(begin, end, depth + 1));
+                skipSpace(begin, end);
+                if (begin < end && *begin == ',') {
+                    begin++;
+                } else if (begin < end && *begin == close) {
+                    begin++;
+                    return value;
+                } else {
+                    throw std::invalid_argument("Missing ',' in JSON value");
+                }
+            }
+        } else if (*begin == '"') {
+            value.kind = type::string;
+            value.string = parseString(begin, end);
+        } else if (*begin == 't' || *begin == 'f') {
+            value.kind = type::boolean;
+            value.boolean = (*begin == 't');
+            expect(begin, end, value.boolean ? "true" : "false");
+        } else if (*begin == 'n') {
+            expect(begin, end, "null");
+        } else {
+            value.kind = type::number;
+            const char *last = scanNumber(begin, end);
+            auto [stop, error] = std::from_chars(begin, last, value.number);
+            if (error != std::errc() || stop != last) {
+                throw std::invalid_argument("Invalid JSON value");
+            }
+            begin = last;
+        }
+        return value;
+    }
+};
+/**
+ * @brief Append value as JSON text, NaN and infinity are written as null.
+ */
+inline void appendJson(std::string &buffer, double value) {
+    if (!std::isfinite(value)) {
+        buffer += "null";
+        return;
+    }
+    char cell[32];
+    buffer.append(cell, std::to_chars(cell, cell + sizeof(cell), value).ptr);
+}
+/**
+ * @brief Append text as JSON string with quotes.
+ */
+inline void appendJson(std::string &buffer, const std::string &text) {
+    buffer += '"';
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            buffer += '\\';
+            buffer += c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            char cell[8];
+            std::snprintf(cell, sizeof(cell), "\\u%04x", static_cast<unsigned>(c));
+            buffer += cell;
+        } else {
+            buffer += c;
+        }
+    }
+    buffer += '"';
+}
+/**
+ * @brief hbv_server_dataset stores a forcing dataset loaded by hbv_server and the parameters vector of
+ * its parameters file. Parameters vectors with 11 values use the last 5 values of it. temp2 is
+ * hbv_sum_squares_q() of Q, calculated once when it is loaded.
+ */
+struct hbv_server_dataset {
+    hbv_forcing forcing;
+    std::vector<double> parameters;
+    double temp2;
+};
+/**
+ * @brief hbv_server answers requests of newline-delimited JSON. Forcing datasets are loaded once by name
+ * and kept in memory, so a request only pays for the model runs. Requests (one JSON object each line):
+ *   {"id": 1, "method": "load", "name": "basin", "data": "data.csv", "parameters": "parameters.txt"}
+ *   {"id": 2, "method": "evaluate", "dataset": "basin", "parameters": [[16 values], ...], "objective": "NSE"}
+ *   {"id": 3, "method": "unload", "name": "basin"}
+ *   {"id": 4, "method": "list"}
+ *   {"id": 5, "method": "shutdown"}
+ * Each answer is one line with the same id and "result", or "error" with the message, so errors never
+ * stop the server. Evaluate requests are put in a queue and answered by one evaluator thread: all requests
+ * queued while the last batch ran are taken together, and parameters sets of the same dataset with NSE
+ * objective are run as one hbv_batch on the thread pool. So answers can come in a different order than
+ * requests, please match them by id. Other requests are answered by the thread reading them, so a load
+ * of a large dataset delays the next requests of the same client (or stdin) until it is finished, while
+ * other socket clients are not blocked.
+ */
+class hbv_server {
+ public:
+      /**
+       * @brief max_line is the longest request line in bytes read from a socket client (64 MiB, about
+       * 200000 parameters sets of 16 values); a client sending a longer line is answered with an error
+       * and disconnected.
+       */
+      static constexpr uint64_t max_line = uint64_t(64) << 20;
+      /**
+       * @brief Construct a new hbv server and start the evaluator thread.
+       * @param threads1 number of threads used to run model
+       */
+      explicit hbv_server(uint64_t threads1) : pool(threads1) {
+         evaluator = std::thread([this]() { evaluate(); });
+      }
+      hbv_server(const hbv_server &) = delete;
+      hbv_server &operator=(const hbv_server &) = delete;
+      /**
+       * @brief Stop the evaluator thread after the queued requests are answered.
+       */
+      ~hbv_server() {
+         {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            stop = true;
+         }
+         queue_ready.notify_all();
+         evaluator.join();
+      }
+      /**
+       * @brief Handle one request line. reply is called once with the answer line (without line break),
+       * from this thread or later from the evaluator thread, so it should be safe to call from any thread.
+       * @param line one line of request
+       * @param reply function to send answer
+       */
+      void handle(const std::string &line, const std::function<void(const std::string &)> &reply) {
+         std::string id = "null";  // id is the JSON text of id of request
+         try {
+            const hbv_json request = hbv_json::parse(line);
+            if (request.kind != hbv_json::type::object) {
+               throw std::invalid_argument("Request should be a JSON object");
+            }
+            if (const hbv_json *value = request.find("id")) {
+               if (value->kind == hbv_json::type::string) {
+                  id.clear();
+                  appendJson(id, value->string);
+               } else if (value->kind == hbv_json::type::number) {
+                  id.clear();
+                  appendJson(id, value->number);
+               } else if (value->kind != hbv_json::type::null) {
+                  throw std::invalid_argument("id should be a number or a string");
+               }
+            }
+            const std::string method = text(request, "method");
+            if (method == "evaluate") {
+               queue(request, id, reply);
+            } else if (method == "load") {
+               reply(answer(id, load(request)));
+            } else if (method == "unload") {
+               const std::string name = text(request, "name");
+               std::lock_guard<std::mutex> lock(datasets_mutex);
+               if (datasets.erase(name) == 0) {
+                  throw std::invalid_argument("Unknown dataset " + name);
+               }
+               reply(answer(id, "true"));
+            } else if (method == "list") {
+               std::string result = "[";
+               std::lock_guard<std::mutex> lock(datasets_mutex);
+               for (const auto &[name, dataset] : datasets) {
+                  result += (result.size() > 1) ? ",{\"name\":" : "{\"name\":";
+                  appendJson(result, name);
+                  result += ",\"days\":" + std::to_string(dataset->forcing.size()) + "}";
+               }
+               reply(answer(id, result + "]"));
+            } else if (method == "shutdown") {
+               stopped = true;
+               reply(answer(id, "true"));
+            } else {
+               throw std::invalid_argument("Unknown method " + method);
+            }
+         } catch (const std::exception &e) {
+            std::string error = "{\"id\":" + id + ",\"error\":";
+            appendJson(error, std::string(e.what()));
+            reply(error + "}");
+         }
+      }
+      /**
+       * @brief isStopped() will return true after a shutdown request.
+       */
+      bool isStopped() const {
+         return stopped;
+      }
+      /**
+       * @brief Wait until all queued evaluate requests are answered.
+       */
+      void wait() {
+         std::unique_lock<std::mutex> lock(queue_mutex);
+         queue_idle.wait(lock, [this]() { return pending == 0; });
+      }
+
+ private:
+      /**
+       * @brief job stores one evaluate request in the queue.
+       */
+      struct job {
+         std::shared_ptr<const hbv_server_dataset> dataset;
+         std::vector<hbv_parameters> sets;
+         const hbv_metric *metric;
+         std::vector<double> values;
+         std::string id;
+         std::function<void(const std::string &)> reply;
+      };
+      /**
+       * @brief datasets stores datasets by name, jobs keep their dataset alive after it is unloaded.
+       */
+      std::map<std::string, std::shared_ptr<const hbv_server_dataset>> datasets;
+      std::mutex datasets_mutex;
+      /**
+       * @brief jobs stores evaluate requests not taken by the evaluator, pending also counts the
+       * requests being evaluated.
+       */
+      std::vector<job> jobs;
+      uint64_t pending = 0;
+      bool stop = false;
+      std::mutex queue_mutex;
+      std::condition_variable queue_ready, queue_idle;
+      std::atomic<bool> stopped = false;
+      /**
+       * @brief pool is only used by the evaluator thread.
+       */
+      hbv_thread_pool pool;
+      std::thread evaluator;
+      /**
+       * @brief Get a string member of request.
+       * @throw std::invalid_argument if there is no such string
+       */
+      static std::string text(const hbv_json &request, const std::string &key) {
+         const hbv_json *value = request.find(key);
+         if (value == nullptr || value->kind != hbv_json::type::string) {
+            throw std::invalid_argument("Request should have string \"" + key + "\"");
+         }
+         return value->string;
+      }
+      static std::string answer(const std::string &id, const std::string &result) {
+         return "{\"id\":" + id + ",\"result\":" + result + "}";
+      }
+      /**
+       * @brief Load a dataset with loadForcing() (the cache file is used when it is up to date), it replaces
+       * the dataset with the same name.
+       */
+      std::string load(const hbv_json &request) {
+         const std::string name = text(request, "name");
+         auto dataset = std::make_shared<hbv_server_dataset>();
+         hbv_columns columns;
+         readParameters(text(request, "parameters"), dataset->parameters, columns);
+         dataset->forcing = loadForcing(text(request, "data"), columns);
+         const uint64_t days = dataset->forcing.size();
+         if (days < 2) {
+            throw std::runtime_error("The data file should contain at leasts 2-day records");
+         }
+         dataset->temp2 = hbv_sum_squares_q(dataset->forcing.getQ());
+         std::lock_guard<std::mutex> lock(datasets_mutex);
+         datasets[name] = std::move(dataset);
+         return "{\"days\":" + std::to_string(days) + "}";
+      }
+      /**
+       * @brief Check an evaluate request and put it in the queue.
+       */
+      void queue(const hbv_json &request, const std::string &id,
+      const std::function<void(const std::string &)> &reply) {
+         job item;
+         item.id = id;
+         item.reply = reply;
+         const std::string name = text(request, "dataset");
+         {
+            std::lock_guard<std::mutex> lock(datasets_mutex);
+            auto found = datasets.find(name);
+            if (found == datasets.end()) {
+               throw std::invalid_argument("Unknown dataset " + name);
+            }
+            item.dataset = found->second;
+         }
+         const hbv_json *objective = request.find("objective");
+         item.metric = &findMetric((objective != nullptr) ? text(request, "objective") : "NSE");
+         const hbv_json *parameters = request.find("parameters");
+         if (parameters == nullptr || parameters->kind != hbv_json::type::array) {
+            throw std::invalid_argument("Request should have array \"parameters\"");
+         }
+         // one parameters vector or an array of them
+         const bool single = !parameters->values.empty() && parameters->values[0].kind == hbv_json::type::number;
+         for (uint64_t k = 0; k < (single ? 1 : parameters->values.size()); k++) {
+            const hbv_json &vector = single ? *parameters : parameters->values[k];
+            if (vector.kind != hbv_json::type::array || (vector.values.size() != 11 && vector.values.size() != 16)) {
+               throw std::invalid_argument("Parameters vector should have 11 or 16 numbers");
+            }
+            std::vector<double> values = item.dataset->parameters;
+            for (uint64_t j = 0; j < vector.values.size(); j++) {
+               if (vector.values[j].kind != hbv_json::type::number) {
+                  throw std::invalid_argument("Parameters vector should have 11 or 16 numbers");
+               }
+               values[j] = vector.values[j].number;
+            }
+            hbv_parameters p = hbv_parameters::fromVector(values);
+            p.checkRange();
+            item.sets.push_back(p);
+         }
+         {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            jobs.push_back(std::move(item));
+            pending++;
+         }
+         queue_ready.notify_one();
+      }
+      /**
+       * @brief The loop of evaluator thread, it takes all queued jobs each time.
+       */
+      void evaluate() {
+         for (;;) {
+            std::vector<job> batch;
+            {
+               std::unique_lock<std::mutex> lock(queue_mutex);
+               queue_ready.wait(lock, [this]() { return stop || !jobs.empty(); });
+               if (jobs.empty()) {
+                  return;
+               }
+               batch.swap(jobs);
+            }
+            run(batch);
+            for (job &item : batch) {
+               std::string result = "[";
+               for (double value : item.values) {
+                  if (result.size() > 1) {
+                     result += ',';
+                  }
+                  appendJson(result, value);
+               }
+               item.reply(answer(item.id, result + "]"));
+            }
+            {
+               std::lock_guard<std::mutex> lock(queue_mutex);
+               pending -= batch.size();
+            }
+            queue_idle.notify_all();
+         }
+      }
+      /**
+       * @brief Run all parameters sets of jobs in one parallel loop. NSE sets of the same dataset are joined
+       * into one hbv_batch and each tile is a task, other objectives are a task for each set.
+       */
+      void run(std::vector<job> &batch) {
+         struct group {
+            const hbv_server_dataset *dataset;
+            std::vector<hbv_parameters> sets;
+            std::vector<double *> out;
+            std::vector<double> NSE;
+         };
+         struct task {
+            uint64_t group;  // group of a tile, or UINT64_MAX for one set of other objective
+            uint64_t index;  // first set of tile, or index of job
+            uint64_t set;
+         };
+         std::vector<group> groups;
+         std::vector<task> tasks;
+         for (uint64_t i = 0; i < batch.size(); i++) {
+            job &item = batch[i];
+            item.values.assign(item.sets.size(), std::nan(""));
+            if (item.metric != &hbv_metric_table[0]) {
+               for (uint64_t k = 0; k < item.sets.size(); k++) {
+                  tasks.push_back({UINT64_MAX, i, k});
+               }
+               continue;
+            }
+            auto found = std::find_if(groups.begin(), groups.end(),
+               [&](const group &g) { return g.dataset == item.dataset.get(); });
+            if (found == groups.end()) {
+               groups.push_back({item.dataset.get(), {}, {}, {}});
+               found = groups.end() - 1;
+            }
+            for (uint64_t k = 0; k < item.sets.size(); k++) {
+               found->sets.push_back(item.sets[k]);
+               found->out.push_back(&item.values[k]);
+            }
+         }
+         std::vector<std::unique_ptr<hbv_batch>> engines;
+         for (uint64_t g = 0; g < groups.size(); g++) {
+            engines.push_back(std::make_unique<hbv_batch>(groups[g].sets));
+            groups[g].NSE.resize(groups[g].sets.size());
+            for (uint64_t b = 0; b < groups[g].sets.size(); b += hbv_batch::tile) {
+               tasks.push_back({g, b, 0});
+            }
+         }
+         pool.parallel_for(tasks.size(), [&](uint64_t t, uint64_t) {
+            const task &current = tasks[t];
+            if (current.group == UINT64_MAX) {
+               job &item = batch[current.index];
+               const hbv_forcing &forcing = item.dataset->forcing;
+               item.values[current.set] = (hbv_evaluate_metrics(item.sets[current.set], forcing.getQ(),
+                  forcing.getP(), forcing.getT()).*item.metric->value)();
+            } else {
+               group &g = groups[current.group];
+               const hbv_forcing &forcing = g.dataset->forcing;
+               engines[current.group]->evaluate(forcing.getQ(), forcing.getP(), forcing.getT(), current.index,
+                  std::min<uint64_t>(g.sets.size(), current.index + hbv_batch::tile), g.NSE.data() + current.index,
+                  g.dataset->temp2);
+            }
+         });
+         for (group &g : groups) {
+            for (uint64_t k = 0; k < g.sets.size(); k++) {
+               *g.out[k] = g.NSE[k];
+            }
+         }
+      }
+};
+/**
+ * @brief Answer requests from input line by line and write answers to output, until the end of input
+ * or a shutdown request. Answers of evaluate requests are waited for before it returns.
+ */
+inline void serveStream(hbv_server &server, std::istream &input, std::ostream &output) {
+    std::mutex output_mutex;
+    auto reply = [&](const std::string &line) {
+        std::lock_guard<std::mutex> lock(output_mutex);
+        output << line << "\n" << std::flush;
+    };
+    for (std::string line; !server.isStopped() && std::getline(input, line);) {
+        if (line.find_first_not_of(" \t\r") != std::string::npos) {
+            server.handle(line, reply);
+        }
+    }
+    server.wait();
+}
+/**
+ * @brief hbv_connection stores one client of serveSocket(). The socket is closed when the connection and
+ * all answers waiting for it are destroyed.
+ */
+struct hbv_connection {
+    int fd;
+    std::mutex mutex;
+    explicit hbv_connection(int fd1) : fd(fd1) {}
+    ~hbv_connection() {
+        ::close(fd);
+    }
+    /**
+     * @brief Send one line, it is dropped if the client is closed.
+     */
+    void send(const std::string &line) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::string text = line + "\n";
+        for (uint64_t sent = 0; sent < text.size();) {
+            ssize_t n = ::send(fd, text.data() + sent, text.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0) {
+                return;
+            }
+            sent += static_cast<uint64_t>(n);
+        }
+    }
+};
+/**
+ * @brief Listen on a Unix domain socket and answer requests of each client on its own thread, until a
+ * shutdown request. Requests of all clients share the datasets and the evaluator of server.
+ * @param server server answering requests
+ * @param path path of socket, an old socket file at that path is removed
+ * @throw std::runtime_error if the socket can't be created
+ */
+inline void serveSocket(hbv_server &server, const std::string &path) {
+    sockaddr_un address{};
+    if (path.size() >= sizeof(address.sun_path)) {
+        throw std::runtime_error("Socket path is too long: " + path);
+    }
+    struct stat status;
+    if (::stat(path.c_str(), &status) == 0) {
+        if (!S_ISSOCK(status.st_mode)) {
+            throw std::runtime_error("Can't Open " + path + ", it is not a socket");
+        }
+        ::unlink(path.c_str());
+    }
+    const int listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    address.sun_family = AF_UNIX;
+    std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+    if (listener < 0 || ::bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0
+        || ::listen(listener, 64) != 0) {
+        if (listener >= 0) {
+            ::close(listener);
+        }
+        throw std::runtime_error("Can't Open " + path + ": " + std::strerror(errno));
+    }
+    // clients stores the thread of each client and whether it finished, finished threads are joined.
+    std::vector<std::pair<std::thread, std::shared_ptr<std::atomic<bool>>>> clients;
+    // poll() wakes up every 100 ms to check for a shutdown request.
+    while (!server.isStopped()) {
+        for (auto client = clients.begin(); client != clients.end();) {
+            if (*client->second) {
+                client->first.join();
+                client = clients.erase(client);
+            } else {
+                client++;
+            }
+        }
+        pollfd wait_for = {listener, POLLIN, 0};
+        if (::poll(&wait_for, 1, 100) <= 0) {
+            continue;
+        }
+        const int fd = ::accept(listener, nullptr, nullptr);
+        if (fd < 0) {
+            continue;
+        }
+        auto connection = std::make_shared<hbv_connection>(fd);
+        auto finished = std::make_shared<std::atomic<bool>>(false);
+        std::thread client([&server, connection, finished]() {
+            auto reply = [connection](const std::string &line) { connection->send(line); };
+            std::string buffer;
+            char block[65536];
+            while (!server.isStopped()) {
+                pollfd wait_for = {connection->fd, POLLIN, 0};
+                if (::poll(&wait_for, 1, 100) <= 0) {
+                    continue;
+                }
+                const ssize_t n = ::recv(connection->fd, block, sizeof(block), 0);
+                if (n <= 0) {
+                    break;
+                }
+                buffer.append(block, static_cast<uint64_t>(n));
+                for (uint64_t end; (end = buffer.find('\n')) != std::string::npos;) {
+                    const std::string line = buffer.substr(0, end);
+                    buffer.erase(0, end + 1);
+                    if (line.find_first_not_of(" \t\r") != std::string::npos) {
+                        server.handle(line, reply);
+                    }
+                }
+                if (buffer.size() > hbv_server::max_line) {
+                    reply("{\"id\":null,\"error\":\"Request line is longer than "
+                        + std::to_string(hbv_server::max_line) + " bytes\"}");
+                    break;
+                }
+            }
+            *finished = true;
+        });
+        clients.emplace_back(std::move(client), finished);
+    }
+    for (auto &client : clients) {
+        client.first.join();
+    }
+    server.wait();
+    ::close(listener);
+    ::unlink(path.c_str());
+}
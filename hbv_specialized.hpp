@@ -0,0 +1,203 @@
+// Copyright 2022 Tianshuo Li
+#pragma once
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <span>
+#include <utility>
+#include "hbv_kernel.hpp"
+/**
+ * @brief hbv_kernel_tolerance is the largest difference of NSE between hbv_evaluate_fast() (or hbv_batch
+ * with fast pow) and hbv_evaluate() for parameters in hbv_bounds. Integer and half-integer beta only differ
+ * by the rounding of pow(), hbv_fast_pow() by its error (less than 1e-14 of the value), other
+ * instantiations give exactly the same value.
+ */
+inline constexpr double hbv_kernel_tolerance = 1e-10;
+/**
+ * @brief Calculate natural log of x without calling libm, so a loop of it can be vectorized by compiler.
+ * Exponent is taken from the bits and log of mantissa in [sqrt(2)/2, sqrt(2)) is calculated by the
+ * series of atanh. Only positive normal x gives an accurate value, hbv_fast_pow() checks other values.
+ */
+inline double hbv_fast_log(double x) {
+    constexpr double ln2_hi = 6.93147180369123816490e-01, ln2_lo = 1.90821492927058770002e-10;
+    const uint64_t bits = std::bit_cast<uint64_t>(x);
+    double e = static_cast<double>(static_cast<int64_t>(bits >> 52) - 1023);
+    double m = std::bit_cast<double>((bits & 0x000fffffffffffffULL) | 0x3ff0000000000000ULL);
+    const bool high = m > 1.4142135623730951;
+    m = high ? m * 0.5 : m;
+    e = high ? e + 1 : e;
+    const double f = (m - 1) / (m + 1), s = f * f;
+    // coefficients are 1/(2j+1) for j = 11 to 0.
+    constexpr double c[12] = {1.0 / 23, 1.0 / 21, 1.0 / 19, 1.0 / 17, 1.0 / 15, 1.0 / 13, 1.0 / 11,
+        1.0 / 9, 1.0 / 7, 1.0 / 5, 1.0 / 3, 1.0};
+    double series = c[0];
+    for (int j = 1; j < 12; j++) {
+        series = series * s + c[j];
+    }
+    return e * ln2_hi + (2 * f * series + e * ln2_lo);
+}
+/**
+ * @brief Calculate exp(y) without calling libm, so a loop of it can be vectorized by compiler.
+ * y is split to k*ln(2) + r with |r| <= ln(2)/2, exp(r) is calculated by Taylor series and 2^k is
+ * written into the exponent bits. y less than -708 gives 0 and y more than 709 gives infinity.
+ */
+inline double hbv_fast_exp(double y) {
+    constexpr double ln2_hi = 6.93147180369123816490e-01, ln2_lo = 1.90821492927058770002e-10;
+    constexpr double shifter = 0x1.8p52;  // adding it rounds to integer, the integer is in the low bits
+    const double x = std::clamp(y, -708.0, 709.0);
+    const double t = x * 1.4426950408889634 + shifter;
+    const double k = t - shifter;
+    const double r = (x - k * ln2_hi) - k * ln2_lo;
+    // coefficients are 1/j! for j = 13 to 0.
+    constexpr double c[14] = {1.0 / 6227020800, 1.0 / 479001600, 1.0 / 39916800, 1.0 / 3628800,
+        1.0 / 362880, 1.0 / 40320, 1.0 / 5040, 1.0 / 720, 1.0 / 120, 1.0 / 24, 1.0 / 6, 0.5, 1.0, 1.0};
+    double series = c[0];
+    for (int j = 1; j < 14; j++) {
+        series = series * r + c[j];
+    }
+    const double scale = std::bit_cast<double>((std::bit_cast<uint64_t>(t) + 1023) << 52);
+    const double value = series * scale;
+    return (y < -708) ? 0 : ((y > 709) ? std::numeric_limits<double>::infinity() : value);
+}
+/**
+ * @brief Calculate pow(x, beta) by hbv_fast_exp(beta * hbv_fast_log(x)). 0 gives 0 and negative
+ * value or NaN gives NaN, the same as pow() for non-integer beta.
+ */
+inline double hbv_fast_pow(double x, double beta) {
+    const double value = hbv_fast_exp(beta * hbv_fast_log(x));
+    return (x > 0) ? value : ((x == 0) ? 0 : std::numeric_limits<double>::quiet_NaN());
+}
+/**
+ * @brief Calculate x^N by squaring, N is known at compile time.
+ */
+template <int N>
+inline double hbv_ipow(double x) {
+    if constexpr (N == 0) {
+        return 1;
+    } else if constexpr (N == 1) {
+        return x;
+    } else {
+        const double half = hbv_ipow<N / 2>(x);
+        return (N % 2 == 1) ? half * half * x : half * half;
+    }
+}
+/**
+ * @brief Calculate x^beta in F equation. B2 is 2 * beta when beta is an integer or half-integer,
+ * then only multiplication and sqrt() are used. B2 = 0 means general beta with pow(): one day depends
+ * on the day before, so the latency of pow() in libm is shorter than hbv_fast_pow() here, and
+ * hbv_fast_pow() is only used where many values are calculated together (hbv_batch).
+ */
+template <int B2>
+inline double hbv_pow_beta(double x, double beta) {
+    if constexpr (B2 == 0) {
+        return pow(x, beta);
+    } else if constexpr (B2 % 2 == 1) {
+        return hbv_ipow<B2 / 2>(x) * std::sqrt(x);
+    } else {
+        return hbv_ipow<B2 / 2>(x);
+    }
+}
+/**
+ * @brief hbv_kernel_key stores which instantiation of hbv_evaluate_kernel() is used for parameters.
+ * beta2 is 2 * beta for integer or half-integer beta in (0, 6] and 0 for other beta. snow is false
+ * when there is no snow at the beginning and temperature never falls below T_tr, then snow depth
+ * stays 0 for all days and the snow routine can be skipped without changing any value.
+ */
+struct hbv_kernel_key {
+    static constexpr int max_beta2 = 12;
+    int beta2;
+    bool snow;
+    /**
+     * @brief Choose the instantiation for parameters.
+     * @param p parameters of model
+     * @param minT minimum of daily mean temperature of dataset given by hbv_min_t()
+     */
+    static hbv_kernel_key select(const hbv_parameters &p, double minT) {
+        const double twice = 2 * p.beta;
+        const bool half = twice == std::round(twice) && twice >= 1 && twice <= max_beta2;
+        return {half ? static_cast<int>(twice) : 0, !(p.SD_i == 0 && minT >= p.T_tr)};
+    }
+};
+/**
+ * @brief Get the minimum of daily mean temperature, it is used to choose the snow routine.
+ * Infinity is returned for empty dataset and NaN makes snow routine always used.
+ */
+inline double hbv_min_t(std::span<const double> T) {
+    double minT = std::numeric_limits<double>::infinity();
+    for (double t : T) {
+        if (std::isnan(t)) {
+            return t;
+        }
+        minT = std::min(minT, t);
+    }
+    return minT;
+}
+/**
+ * @brief Run HBV model and only return NSE value as hbv_evaluate(), with beta and snow routine fixed at
+ * compile time. Each day is hbv_lane_step() with pow(SM / FC, beta) given by hbv_pow_beta(), the first day
+ * is taken out of the loop and squares are multiplications.
+ * @tparam B2 2 * beta for integer or half-integer beta, 0 for general beta
+ * @tparam Snow false if snow routine can be skipped (see hbv_kernel_key)
+ */
+template <int B2, bool Snow>
+hbv_score hbv_evaluate_kernel(const hbv_parameters &p, std::span<const double> Q,
+    std::span<const double> P, std::span<const double> T, double averageQ) {
+    hbv_state s = hbv_state::initial(p);
+    double temp1 = 0;  // temp1 is to store the part 1 value of NSE value.
+    double temp2 = 0;  // temp2 is to store the part 2 value of NSE value.
+    if (!Q.empty()) {
+        // The first day only calculates snow part, pow is not used.
+        hbv_lane_step<Snow>(p, s, P[0], T[0], 0);
+    }
+    for (uint64_t i = 1; i < Q.size(); i++) {
+        const double Qt = hbv_lane_step<Snow>(p, s, P[i], T[i], hbv_pow_beta<B2>(s.SM / p.FC, p.beta));
+        const double error = Q[i] - Qt, spread = Q[i] - averageQ;
+        temp1 += error * error;
+        temp2 += spread * spread;
+    }
+    return {1 - temp1 / temp2, temp1, temp2, s};
+}
+/**
+ * @brief hbv_kernel_fn is the type of one instantiation of hbv_evaluate_kernel().
+ */
+using hbv_kernel_fn = hbv_score (*)(const hbv_parameters &, std::span<const double>,
+    std::span<const double>, std::span<const double>, double);
+/**
+ * @brief Build table of all instantiations, row is beta2 and column is snow.
+ */
+template <int... B2>
+constexpr std::array<std::array<hbv_kernel_fn, 2>, sizeof...(B2)> hbv_kernel_table(
+    std::integer_sequence<int, B2...>) {
+    return {{{&hbv_evaluate_kernel<B2, false>, &hbv_evaluate_kernel<B2, true>}...}};
+}
+/**
+ * @brief hbv_kernels is the table used by hbv_evaluate_fast().
+ */
+inline constexpr auto hbv_kernels =
+    hbv_kernel_table(std::make_integer_sequence<int, hbv_kernel_key::max_beta2 + 1>());
+/**
+ * @brief Run HBV model with the instantiation chosen by hbv_kernel_key and only return NSE value.
+ * NSE is within hbv_kernel_tolerance of hbv_evaluate(), storages of the last day are also close.
+ * @param p parameters of model, range should be checked before
+ * @param Q discharge given by dataset
+ * @param P precipitation given by dataset
+ * @param T daily mean temperature given by dataset
+ * @param averageQ average value of Q given by hbv_average_q()
+ * @param minT minimum of T given by hbv_min_t()
+ * @return hbv_score
+ */
+inline hbv_score hbv_evaluate_fast(const hbv_parameters &p, std::span<const double> Q,
+    std::span<const double> P, std::span<const double> T, double averageQ, double minT) {
+    const hbv_kernel_key key = hbv_kernel_key::select(p, minT);
+    return hbv_kernels[key.beta2][key.snow](p, Q, P, T, averageQ);
+}
+/**
+ * @brief Run HBV model with the chosen instantiation, average and minimum of dataset will be calculated first.
+ */
+inline hbv_score hbv_evaluate_fast(const hbv_parameters &p, std::span<const double> Q,
+    std::span<const double> P, std::span<const double> T) {
+    return hbv_evaluate_fast(p, Q, P, T, hbv_average_q(Q), hbv_min_t(T));
+}
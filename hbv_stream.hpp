@@ -0,0 +1,139 @@
+// Copyright 2022 Tianshuo Li
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "hbv_kernel.hpp"
+#include "hbv_metrics.hpp"
+#include "hbv_incremental.hpp"
+#include "hbv_io.hpp"
+#include "hbv_profile.hpp"
+/**
+ * @brief hbv_stream_options stores the options of streamHBV().
+ */
+struct hbv_stream_options {
+    /**
+     * @brief chunk is the largest number of days kept in memory, they are calculated and written together.
+     */
+    uint64_t chunk = 65536;
+    /**
+     * @brief block is number of bytes read from data file at a time.
+     */
+    uint64_t block = 1 << 20;
+};
+/**
+ * @brief hbv_stream_result stores the result of streamHBV().
+ */
+struct hbv_stream_result {
+    hbv_data_report report;
+    hbv_metrics metrics;
+    uint64_t chunks = 0;
+};
+/**
+ * @brief This function will run HBV model from data file to result file chunk by chunk. The data file is
+ * read one block at a time and parsed with parseDataLine(), and when chunk days are parsed, they are
+ * calculated with hbv_incremental, added to metrics and written with appendResultRow(). Only the
+ * storages of the last day are kept between chunks, so memory depends on chunk and block but not on
+ * the length of data file. The result file and metrics are the same as runHBV() with hbv_model.
+ * @param data_file The path of data file(csv file or same format)
+ * @param columns column position of T, P and Q
+ * @param parameters parameters vector, out of range value is set to the lower bound value as hbv_model does
+ * @param output_path output path
+ * @param options size of chunk and block
+ * @return hbv_stream_result report of data file and metrics
+ * @throw std::runtime_error if a file can't be opened, the column position exceed length of file or there
+ * are less than 2 records
+ */
+inline hbv_stream_result streamHBV(const std::string &data_file, const hbv_columns &columns,
+    const std::vector<double> &parameters, const std::string &output_path,
+    const hbv_stream_options &options = hbv_stream_options()) {
+    const uint64_t chunk = std::max<uint64_t>(1, options.chunk);
+    std::ifstream input;
+    std::ofstream output;
+    {
+        HBV_PROFILE_SCOPE(open_files);
+        input.open(data_file, std::ios::binary);
+        if (!input.is_open()) {
+            throw std::runtime_error("Can't Open " + data_file);
+        }
+        output.open(output_path);
+        if (!output.is_open()) {
+            throw std::runtime_error("Can't Open " + output_path);
+        }
+    }
+    hbv_incremental model(parameters);
+    hbv_stream_result result;
+    std::vector<double> Q, P, T;
+    Q.reserve(chunk);
+    P.reserve(chunk);
+    T.reserve(chunk);
+    std::string buffer(hbv_result_header);  // buffer stores rows of result file of one chunk
+    buffer.reserve(chunk * 96);
+    // run() calculates and writes days of Q, P and T, then they are cleared.
+    auto run = [&]() {
+        {
+            HBV_PROFILE_SCOPE(simulate);
+            for (uint64_t i = 0; i < Q.size(); i++) {
+                const bool first = (model.getDay() == 0);
+                const hbv_flux &flux = model.step(P[i], T[i]);
+                const hbv_state &state = model.getState();
+                result.metrics.add(first, Q[i], flux.Qt);
+                appendResultRow(buffer, state.day, {flux.RF, flux.ET, flux.AET, state.SLZ + state.SUZ, flux.Qt,
+                    flux.Q_a});
+            }
+        }
+        HBV_PROFILE_SCOPE(write_result);
+        output.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+        buffer.clear();
+        Q.clear();
+        P.clear();
+        T.clear();
+        result.chunks++;
+    };
+    std::string text(std::max<uint64_t>(1, options.block), '\0');  // text stores one block and a partial line
+    uint64_t used = 0;  // used is number of characters of text not parsed yet
+    for (bool end = false; !end;) {
+        if (used == text.size()) {
+            // a line is longer than block, the block is made larger for it.
+            text.resize(text.size() * 2);
+        }
+        {
+            HBV_PROFILE_SCOPE(open_files);
+            input.read(text.data() + used, static_cast<std::streamsize>(text.size() - used));
+        }
+        used += static_cast<uint64_t>(input.gcount());
+        end = !input;
+        const char *begin = text.data(), *last = text.data() + used;
+        for (bool full = true; full;) {
+            {
+                HBV_PROFILE_SCOPE(parse_data);
+                while (begin < last && Q.size() < chunk) {
+                    const char *line_end = std::find(begin, last, '\n');
+                    if (line_end == last && !end) {
+                        break;  // the rest of line is in the next block
+                    }
+                    parseDataLine(begin, line_end, columns, Q, P, T, result.report);
+                    begin = (line_end == last) ? last : line_end + 1;
+                }
+                full = (Q.size() == chunk);
+            }
+            if (full) {
+                run();
+            }
+        }
+        used = static_cast<uint64_t>(last - begin);
+        std::copy(begin, last, text.data());
+    }
+    run();
+    HBV_PROFILE_COUNT(records_parsed, result.report.records);
+    HBV_PROFILE_COUNT(records_skipped, result.report.skipped);
+    HBV_PROFILE_COUNT(peak_vector_bytes, (Q.capacity() + P.capacity() + T.capacity()) * sizeof(double)
+        + buffer.capacity() + text.capacity());
+    if (result.report.records < 2) {
+        throw std::runtime_error("The data file should contain at leasts 2-day records");
+    }
+    return result;
+}
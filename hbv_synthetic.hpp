@@ -0,0 +1,84 @@
+// Copyright 2022 Tianshuo Li
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "hbv_incremental.hpp"
+/**
+ * @brief hbv_synthetic stores a synthetic dataset made by generateForcing().
+ */
+struct hbv_synthetic {
+    std::vector<double> Q, P, T;
+};
+/**
+ * @brief parameters used to make discharge of synthetic dataset, same as "parameters.txt".
+ */
+inline const std::vector<double> hbv_synthetic_parameters = {-1.34, 2.68, 499.16, 1.01, 1.17, 0.77,
+    0.19, 0.22, 0.001, 90.67, 0.45, 38, 0, 332, 164, 1034300000};
+/**
+ * @brief This function will make a synthetic daily dataset with seasons, it is used by benchmark.
+ * T is a yearly sine wave (-5 to 21 C) with day-to-day correlated noise. P follows wet and dry days
+ * (a wet day is more likely after a wet day and in autumn) and amount of a wet day is exponential.
+ * Q is runoff of HBV model with hbv_synthetic_parameters multiplied by log-normal noise, so a good
+ * model gives NSE close to 1. The same years and seed always give the same dataset.
+ * @param years number of years (365 days each)
+ * @param seed seed of random number
+ * @return hbv_synthetic synthetic dataset
+ */
+inline hbv_synthetic generateForcing(uint64_t years, uint64_t seed = 1) {
+    const uint64_t days = years * 365;
+    hbv_synthetic data;
+    data.Q.resize(days);
+    data.P.resize(days);
+    data.T.resize(days);
+    std::mt19937_64 rng(seed);
+    std::normal_distribution<double> normal(0, 1);
+    std::uniform_real_distribution<double> uniform(0, 1);
+    std::exponential_distribution<double> amount(1 / 6.0);
+    double noise = 0;  // noise of temperature, correlated day to day
+    bool wet = false;
+    for (uint64_t i = 0; i < days; i++) {
+        const double season = 2 * M_PI * static_cast<double>(i % 365) / 365.0;
+        noise = 0.7 * noise + 2.0 * normal(rng);
+        data.T[i] = 8 - 13 * std::cos(season) + noise;
+        const double chance = (wet ? 0.6 : 0.25) + 0.1 * std::sin(season - M_PI / 2);
+        wet = uniform(rng) < chance;
+        data.P[i] = wet ? amount(rng) : 0;
+    }
+    hbv_incremental model(hbv_synthetic_parameters);
+    for (uint64_t i = 0; i < days; i++) {
+        double Qt = model.step(data.P[i], data.T[i]).Qt;
+        data.Q[i] = std::isnan(Qt) ? 0 : Qt * std::exp(0.1 * normal(rng));
+    }
+    if (days > 1) {
+        data.Q[0] = data.Q[1];
+    }
+    return data;
+}
+/**
+ * @brief This function will write a synthetic dataset in the same format as "example_data.csv",
+ * so "parameters.txt" can be used with it (T, P and Q in column 5, 6 and 4).
+ * @param path path of data file
+ * @param data synthetic dataset
+ * @throw std::runtime_error if the file can't be opened
+ */
+inline void writeForcing(const std::string &path, const hbv_synthetic &data) {
+    std::ofstream output(path);
+    if (!output.is_open()) {
+        throw std::runtime_error("Can't Open " + path);
+    }
+    output << "YYYY,MM,DD,Q(mm/d),TMean(C),Precip(mm/day)\n";
+    output << std::fixed;
+    for (uint64_t i = 0; i < data.Q.size(); i++) {
+        const uint64_t day = i % 365;
+        output << 1900 + i / 365 << "," << 1 + std::min<uint64_t>(day / 30, 11) << "," << 1 + day % 30 << ","
+            << std::setprecision(3) << data.Q[i] << "," << std::setprecision(2) << data.T[i] << ","
+            << std::setprecision(1) << data.P[i] << "\n";
+    }
+}
@@ -0,0 +1,240 @@
+// Copyright 2022 Tianshuo Li
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <optional>
+#include <ostream>
+#include <span>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "hbv_kernel.hpp"
+#include "hbv_metrics.hpp"
+/**
+ * @brief Get number of days from 1970-01-01 to a date of Gregorian calendar.
+ */
+inline int64_t hbv_days_from_date(int64_t year, int64_t month, int64_t day) {
+    year -= (month <= 2) ? 1 : 0;
+    const int64_t era = (year >= 0 ? year : year - 399) / 400;
+    const int64_t year_of_era = year - era * 400;
+    const int64_t day_of_year = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    const int64_t day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+    return era * 146097 + day_of_era - 719468;
+}
+/**
+ * @brief Get month (1 to 12) of a number of days from 1970-01-01.
+ */
+inline int64_t hbv_month_from_days(int64_t days) {
+    days += 719468;
+    const int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+    const int64_t day_of_era = days - era * 146097;
+    const int64_t year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+    const int64_t day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+    const int64_t month = (5 * day_of_year + 2) / 153;
+    return month < 10 ? month + 3 : month - 9;
+}
+/**
+ * @brief Get number of days from 1970-01-01 of a date written as YYYY-MM-DD.
+ * @throw std::invalid_argument if the date is not in that format
+ */
+inline int64_t hbv_parse_date(const std::string &text) {
+    int64_t year = 0, month = 0, day = 0;
+    char dash1 = 0, dash2 = 0;
+    std::istringstream input(text);
+    if (!(input >> year >> dash1 >> month >> dash2 >> day) || dash1 != '-' || dash2 != '-' || !input.eof()
+        || month < 1 || month > 12 || day < 1 || day > 31) {
+        throw std::invalid_argument("Date should be YYYY-MM-DD: " + text);
+    }
+    return hbv_days_from_date(year, month, day);
+}
+/**
+ * @brief hbv_window stores one period that metrics are calculated for: days [first, last] (day 0 is the first
+ * record of dataset) that are in one of the months of months (bit m for month m).
+ */
+struct hbv_window {
+    static constexpr uint16_t all_months = 0x1FFE;
+    std::string name;
+    uint64_t first = 0;
+    uint64_t last = UINT64_MAX;
+    uint16_t months = all_months;
+    /**
+     * @brief Check whether day i with month is in this window.
+     */
+    bool contains(uint64_t i, int64_t month) const {
+        return i >= first && i <= last && (months >> month & 1);
+    }
+};
+/**
+ * @brief Parse one window written as [name=][range][@months]. range is "YYYY-MM-DD:YYYY-MM-DD" or
+ * "days:first-last" (days count from 1 as the result file, both ends included), and all days when it is
+ * empty. months is a list of months or ranges of months, for example "@3-5" or "@12,1,2". Name is the
+ * text of window when it is not given.
+ * @param text window
+ * @param start days from 1970-01-01 of the first record, needed for dates and months
+ * @return hbv_window
+ * @throw std::invalid_argument if the window can't be read
+ */
+inline hbv_window parseWindow(const std::string &text, std::optional<int64_t> start) {
+    hbv_window window;
+    std::string rest = text;
+    const uint64_t equal = rest.find('=');
+    window.name = (equal == std::string::npos) ? text : text.substr(0, equal);
+    if (equal != std::string::npos) {
+        rest = rest.substr(equal + 1);
+    }
+    const uint64_t at = rest.find('@');
+    std::string range = rest.substr(0, at);
+    const bool days = (range.rfind("days:", 0) == 0);
+    if (!start && ((!range.empty() && !days) || at != std::string::npos)) {
+        throw std::invalid_argument("Window " + text + " needs the date of the first record (--start)");
+    }
+    try {
+        if (days) {
+            range = range.substr(5);
+            const uint64_t dash = range.find('-');
+            const uint64_t first = std::stoull(range.substr(0, dash));
+            const uint64_t last = (dash == std::string::npos) ? first : std::stoull(range.substr(dash + 1));
+            if (first < 1 || last < first) {
+                throw std::invalid_argument("range");
+            }
+            window.first = first - 1;
+            window.last = last - 1;
+        } else if (!range.empty()) {
+            const uint64_t colon = range.find(':');
+            if (colon == std::string::npos) {
+                throw std::invalid_argument("range");
+            }
+            const int64_t first = hbv_parse_date(range.substr(0, colon)) - *start;
+            const int64_t last = hbv_parse_date(range.substr(colon + 1)) - *start;
+            if (last < first || last < 0) {
+                throw std::invalid_argument("range");
+            }
+            window.first = static_cast<uint64_t>(std::max<int64_t>(first, 0));
+            window.last = static_cast<uint64_t>(last);
+        }
+        if (at != std::string::npos) {
+            window.months = 0;
+            std::istringstream cells(rest.substr(at + 1));
+            for (std::string cell; std::getline(cells, cell, ',');) {
+                const uint64_t dash = cell.find('-');
+                const int64_t first = std::stoll(cell.substr(0, dash));
+                const int64_t last = (dash == std::string::npos) ? first : std::stoll(cell.substr(dash + 1));
+                if (first < 1 || first > 12 || last < 1 || last > 12) {
+                    throw std::invalid_argument("month");
+                }
+                // a range like 11-2 goes over the end of year
+                for (int64_t m = first;; m = m % 12 + 1) {
+                    window.months |= static_cast<uint16_t>(1 << m);
+                    if (m == last) {
+                        break;
+                    }
+                }
+            }
+        }
+    } catch (const std::exception &) {
+        throw std::invalid_argument("Window should be [name=][YYYY-MM-DD:YYYY-MM-DD|days:first-last][@months]: "
+            + text);
+    }
+    return window;
+}
+/**
+ * @brief Parse windows split by ';', see parseWindow().
+ */
+inline std::vector<hbv_window> parseWindows(const std::string &text, std::optional<int64_t> start) {
+    std::vector<hbv_window> windows;
+    std::istringstream cells(text);
+    for (std::string cell; std::getline(cells, cell, ';');) {
+        if (!cell.empty()) {
+            windows.push_back(parseWindow(cell, start));
+        }
+    }
+    if (windows.empty()) {
+        throw std::invalid_argument("There is no window");
+    }
+    return windows;
+}
+/**
+ * @brief Run HBV model once and calculate metrics of every window. Each window has its own hbv_metrics and
+ * every day is added to the windows containing it, so the spin-up before a window is simulated but not
+ * compared, and a window costs one check and one hbv_metrics::add() a day. A window of all days gives the
+ * same metrics as hbv_model.
+ * @param p parameters of model, range should be checked before
+ * @param Q discharge given by dataset
+ * @param P precipitation given by dataset
+ * @param T daily mean temperature given by dataset
+ * @param windows windows given by parseWindows()
+ * @param start days from 1970-01-01 of the first record, only needed for windows of months
+ * @return std::vector<hbv_metrics> metrics of each window
+ */
+inline std::vector<hbv_metrics> evaluateWindows(const hbv_parameters &p, std::span<const double> Q,
+    std::span<const double> P, std::span<const double> T, const std::vector<hbv_window> &windows,
+    std::optional<int64_t> start = std::nullopt) {
+    std::vector<hbv_metrics> metrics(windows.size());
+    const bool monthly = std::any_of(windows.begin(), windows.end(),
+        [](const hbv_window &window) { return window.months != hbv_window::all_months; });
+    if (monthly && !start) {
+        throw std::invalid_argument("Windows of months need the date of the first record");
+    }
+    hbv_state s = hbv_state::initial(p);
+    hbv_flux f;
+    for (uint64_t i = 0; i < Q.size(); i++) {
+        hbv_step(p, s, P[i], T[i], f);
+        const int64_t month = monthly ? hbv_month_from_days(*start + static_cast<int64_t>(i)) : 1;
+        for (uint64_t w = 0; w < windows.size(); w++) {
+            if (windows[w].contains(i, month)) {
+                metrics[w].add(i == 0, Q[i], f.Qt);
+            }
+        }
+    }
+    return metrics;
+}
+/**
+ * @brief This function will print metrics of each window as a table.
+ */
+inline void printWindows(std::ostream &output, const std::vector<hbv_window> &windows,
+    const std::vector<hbv_metrics> &metrics) {
+    uint64_t width = 8;
+    for (const auto &window : windows) {
+        width = std::max<uint64_t>(width, window.name.size() + 2);
+    }
+    output << std::left << std::setw(static_cast<int>(width)) << "Window" << std::setw(8) << "Days";
+    for (const auto &metric : hbv_metric_table) {
+        output << std::setw(10) << metric.name;
+    }
+    output << "\n" << std::fixed << std::setprecision(3);
+    for (uint64_t w = 0; w < windows.size(); w++) {
+        output << std::setw(static_cast<int>(width)) << windows[w].name << std::setw(8) << metrics[w].count;
+        for (const auto &metric : hbv_metric_table) {
+            output << std::setw(10) << (metrics[w].*metric.value)();
+        }
+        output << "\n";
+    }
+    output << std::right << std::defaultfloat;
+}
+/**
+ * @brief This function will write metrics of each window to a csv file.
+ * @throw std::runtime_error if the file can't be opened
+ */
+inline void writeWindows(const std::string &path, const std::vector<hbv_window> &windows,
+    const std::vector<hbv_metrics> &metrics) {
+    std::ofstream output(path);
+    if (!output.is_open()) {
+        throw std::runtime_error("Can't Open " + path);
+    }
+    output << "Window,Days";
+    for (const auto &metric : hbv_metric_table) {
+        output << "," << metric.name;
+    }
+    output << "\n";
+    output.precision(10);
+    for (uint64_t w = 0; w < windows.size(); w++) {
+        output << windows[w].name << "," << metrics[w].count;
+        for (const auto &metric : hbv_metric_table) {
+            output << "," << (metrics[w].*metric.value)();
+        }
+        output << "\n";
+    }
+}